@@ -0,0 +1,465 @@
+////////////////////////////////////////////////////////
+// The AHCI (SATA) driver
+//
+// A SATA controller in AHCI mode (class 0x01, subclass 0x06;
+// the ICH9 of QEMU is one) is driven through memory mapped
+// registers (ABAR, BAR5), as explained in the AHCI 1.3
+// specification and http://wiki.osdev.org/AHCI
+//
+// Each port of the HBA has a command list of up to 32 slots in
+// memory shared with the HBA. A slot points at a command table:
+// the command FIS (the ATA registers) and the PRD table of the
+// data buffer. The HBA runs the commands of the slots whose bit
+// we set in PxCI, and writes what the drive sends back to the
+// receive FIS area of the port.
+//
+// With Native Command Queuing the drive takes every slot at
+// once: READ FPDMA QUEUED carries the slot number as its tag,
+// the drive reads the sectors in the order it likes, and
+// clears the tag in PxSACT when it is done. A drive without
+// NCQ gets one READ DMA EXT at a time.
+//
+// read_disk uses the drive in mode DISK_AHCI ("disk ahci"),
+// e.g. with the SOS disk attached to QEMU a second time, as
+// -device ahci,id=ahci -drive id=d,file=SOS.dsk,if=none,readonly=on
+// -device ide-hd,drive=d,bus=ahci.0. As for virtio, the requests
+// skip the I/O scheduler (see iosched.c). disk_lock protects
+// everything here
+
+#include "kernel_only.h"
+
+extern spinlock_t disk_lock;	// from disk.c
+extern spinlock_t sched_lock;	// from scheduler.c
+extern DISK_STATS disk_stats[N_DISK_MODES];	// from disk.c
+extern uint16_t virtio_base;	// from virtio.c
+extern uint8_t virtio_irq;	// from virtio.c
+
+/*** HBA registers (offsets from ABAR) ***/
+#define HBA_CAP			0x00	// capabilities
+#define HBA_GHC			0x04	// global host control
+#define HBA_IS			0x08	// interrupt status, one bit per port
+#define HBA_PI			0x0C	// ports implemented
+
+/*** Port registers (offsets from ABAR + 0x100 + 0x80*port) ***/
+#define PX_CLB			0x00	// command list (physical, 1KB aligned)
+#define PX_CLBU			0x04
+#define PX_FB			0x08	// receive FIS area (physical, 256 bytes aligned)
+#define PX_FBU			0x0C
+#define PX_IS			0x10	// interrupt status
+#define PX_IE			0x14	// interrupt enable
+#define PX_CMD			0x18	// command and status
+#define PX_TFD			0x20	// task file (ATA status and error)
+#define PX_SIG			0x24	// signature of the device
+#define PX_SSTS			0x28	// SATA status
+#define PX_SERR			0x30	// SATA error
+#define PX_SACT			0x34	// NCQ tags not done yet
+#define PX_CI			0x38	// slots not done yet
+
+#define CAP_SNCQ		0x40000000	// the HBA can do NCQ
+#define GHC_AE			0x80000000	// AHCI enable
+#define GHC_IE			0x00000002	// interrupt enable
+#define CMD_ST			0x0001		// start running the command list
+#define CMD_FRE			0x0010		// FIS receive enable
+#define CMD_FR			0x4000		// FIS receive running
+#define CMD_CR			0x8000		// command list running
+#define IS_DHRS			0x00000001	// register FIS from the drive (a command is done)
+#define IS_SDBS			0x00000008	// set device bits FIS (NCQ tags are done)
+#define IS_ERRORS		0x78000000	// task file, host bus data/fatal, interface fatal errors
+
+volatile uint8_t *ahci_hba = NULL;	// registers of the HBA (ABAR, mapped 1:1)
+volatile uint8_t *ahci_port = NULL;	// registers of the port of the drive; NULL if there is none
+uint8_t ahci_port_number = 0;
+uint8_t ahci_irq = 0;			// ISA IRQ of the HBA
+uint8_t ahci_bus, ahci_dev, ahci_fn;	// PCI function of the HBA (see route_pci_irq)
+uint32_t ahci_sectors = 0;		// capacity of the drive (up to 2TB)
+bool ahci_ncq = FALSE;			// commands are queued with NCQ
+uint32_t ahci_slots = 0;		// command slots we use: 1, or the NCQ queue depth
+
+AHCI_CMD_HEADER *ahci_cmd_list;		// the command list
+AHCI_CMD_TABLE *ahci_tables;		// one command table per slot
+uint16_t *ahci_identify;		// the IDENTIFY DEVICE data
+
+DISK_REQUEST *ahci_requests[AHCI_MAX_SLOTS];	// request of each slot
+uint32_t ahci_issued = 0;		// slots given to the HBA (bit n: slot n)
+DISK_REQUEST *ahci_pending = NULL;	// waiting for a free slot, in the order they came
+DISK_REQUEST *ahci_pending_tail = NULL;
+uint32_t ahci_in_flight = 0;		// requests in the slots
+uint32_t ahci_max_in_flight = 0;	// most of them at once
+uint32_t ahci_errors = 0;		// times the port was restarted after an error
+
+/*** The AHCI (IRQ) handler ***/
+asm(".globl handler_ahci_entry\n"
+	"handler_ahci_entry: \n"
+	"pushal\n"
+	// must reset the segment selectors before
+	// accessing any kernel data
+	"movl $0x10, %eax\n"
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"movl %eax, %fs\n"
+	"movl %eax, %gs\n"
+	"call ahci_interrupt_handler\n"
+	"testl %eax, %eax\n"
+	"jz return_from_trap\n"
+	// a woken process should run here now (see timer.c)
+	"pushl %esp\n"
+	"call timer_interrupt_handler\n"
+	"addl $4, %esp\n"
+	"jmp return_from_trap\n"
+);
+
+/*** Register access ***/
+uint32_t hba_read(uint32_t reg) {
+	return *(volatile uint32_t *)(ahci_hba + reg);
+}
+
+void hba_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t *)(ahci_hba + reg) = value;
+}
+
+uint32_t ahci_read(uint32_t reg) {
+	return *(volatile uint32_t *)(ahci_port + reg);
+}
+
+void ahci_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t *)(ahci_port + reg) = value;
+}
+
+/*** Find and set up the HBA and its drive ***/
+// The command list, receive FIS area and command tables take a
+// few pages of the first 4MB. The registers are mapped with
+// map_mmio, so ABAR must be above the kernel's 4MB (QEMU puts
+// it near 4GB). The interrupt line is the one the BIOS gave the
+// PCI function, as for virtio (see init_virtio); the drive is
+// not used without one. Must run before the first process is
+// created, since processes copy the kernel's page directory
+void init_ahci(void) {
+	uint8_t bus, dev, fn, irq;
+	uint32_t abar, command, cap, pi, port, depth, i;
+	uint8_t *mem;
+
+	if (!pci_find_class(0x01, 0x06, &bus, &dev, &fn)) return;
+
+	abar = pci_config_read(bus, dev, fn, 0x24) & 0xFFFFFFF0; // BAR5
+	irq = (uint8_t)pci_config_read(bus, dev, fn, 0x3C); // interrupt line
+	if (abar < KERNEL_BASE + 0x400000 || irq == 0 || irq > 15) return;
+
+	// memory space (bit 1) and bus master (bit 2) enable, INTx on (bit 10)
+	command = pci_config_read(bus, dev, fn, 0x04);
+	pci_config_write(bus, dev, fn, 0x04, (command | 0x6) & ~0x400);
+
+	map_mmio(abar);
+	ahci_hba = (volatile uint8_t *)abar;
+	hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_AE);
+
+	// the first port with a SATA drive: device present and
+	// link up (DET 3), ATA signature
+	cap = hba_read(HBA_CAP);
+	pi = hba_read(HBA_PI);
+	for (port=0; port<32; port++) {
+		if (!(pi & (1 << port))) continue;
+		ahci_port = ahci_hba + 0x100 + 0x80*port;
+		if ((ahci_read(PX_SSTS) & 0xF) == 3 && ahci_read(PX_SIG) == 0x00000101) break;
+	}
+	if (port == 32) {
+		ahci_port = NULL;
+		return;
+	}
+
+	// command list, receive FIS area and IDENTIFY data in the
+	// first page; the command tables (1KB each) after it
+	mem = (uint8_t *)alloc_kernel_pages(1 + AHCI_MAX_SLOTS*sizeof(AHCI_CMD_TABLE)/4096); // zeroed
+	if (mem == NULL) {
+		ahci_port = NULL;
+		return;
+	}
+	ahci_cmd_list = (AHCI_CMD_HEADER *)mem;
+	ahci_identify = (uint16_t *)(mem + 2048);
+	ahci_tables = (AHCI_CMD_TABLE *)(mem + 4096);
+	for (i=0; i<AHCI_MAX_SLOTS; i++) ahci_cmd_list[i].table = (uint32_t)&ahci_tables[i] - KERNEL_BASE;
+
+	// the BIOS may have left the port running on its own lists
+	ahci_stop_port();
+	ahci_write(PX_CLB, (uint32_t)ahci_cmd_list - KERNEL_BASE);
+	ahci_write(PX_CLBU, 0);
+	ahci_write(PX_FB, (uint32_t)mem + 1024 - KERNEL_BASE);
+	ahci_write(PX_FBU, 0);
+	ahci_start_port();
+
+	if (!ahci_identify_drive()) {
+		ahci_stop_port();
+		ahci_port = NULL;
+		return;
+	}
+
+	// NCQ if both the HBA and the drive can; the queue is as
+	// deep as the smaller of the two allows
+	ahci_ncq = ((cap & CAP_SNCQ) && (ahci_identify[76] & 0x0100));
+	depth = ((cap >> 8) & 0x1F) + 1;
+	if (depth > (uint32_t)(ahci_identify[75] & 0x1F) + 1) depth = (ahci_identify[75] & 0x1F) + 1;
+	ahci_slots = (ahci_ncq ? depth : 1);
+
+	if (ahci_identify[83] & 0x0400) { // LBA48
+		if (ahci_identify[102] != 0 || ahci_identify[103] != 0) ahci_sectors = 0xFFFFFFFF;
+		else ahci_sectors = ahci_identify[100] | ((uint32_t)ahci_identify[101] << 16);
+	}
+	else ahci_sectors = ahci_identify[60] | ((uint32_t)ahci_identify[61] << 16);
+
+	// a shared line keeps the virtio handler; it serves both
+	if (irq != virtio_irq || virtio_base == 0)
+		install_interrupt_handler(32+irq,handler_ahci_entry,0x0008,0x8E);
+	if (irq < 8) port_write_byte(0x21, port_read_byte(0x21) & ~(1 << irq));
+	else { // on the slave PIC, through the cascade (IRQ2)
+		port_write_byte(0xA1, port_read_byte(0xA1) & ~(1 << (irq-8)));
+		port_write_byte(0x21, port_read_byte(0x21) & ~0x04);
+	}
+
+	ahci_write(PX_IS, 0xFFFFFFFF);
+	hba_write(HBA_IS, 1 << port);
+	ahci_write(PX_IE, IS_DHRS | IS_SDBS | IS_ERRORS);
+	hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_IE);
+
+	ahci_port_number = (uint8_t)port;
+	ahci_irq = irq;
+	ahci_bus = bus;
+	ahci_dev = dev;
+	ahci_fn = fn;
+}
+
+/*** Stop the port running the command list ***/
+// Slots given to the HBA are dropped
+void ahci_stop_port(void) {
+	uint32_t i;
+
+	ahci_write(PX_CMD, ahci_read(PX_CMD) & ~CMD_ST);
+	for (i=0; i<1000000 && (ahci_read(PX_CMD) & CMD_CR); i++);
+	ahci_write(PX_CMD, ahci_read(PX_CMD) & ~CMD_FRE);
+	for (i=0; i<1000000 && (ahci_read(PX_CMD) & CMD_FR); i++);
+}
+
+/*** Start the port on our command list ***/
+// Clears the errors a stopped port may have
+void ahci_start_port(void) {
+	ahci_write(PX_SERR, 0xFFFFFFFF);
+	ahci_write(PX_IS, 0xFFFFFFFF);
+	ahci_write(PX_CMD, ahci_read(PX_CMD) | CMD_FRE);
+	ahci_write(PX_CMD, ahci_read(PX_CMD) | CMD_ST);
+}
+
+/*** Fill in the command FIS of a slot ***/
+// A register FIS, host to device, with the command bit set;
+// LBA48 layout. For READ FPDMA QUEUED the sector count goes in
+// the features registers and the tag in the count register
+void ahci_build_fis(uint32_t slot, uint8_t command, uint32_t LBA, uint32_t count) {
+	uint8_t *fis = ahci_tables[slot].fis;
+	uint32_t i;
+
+	for (i=0; i<20; i++) fis[i] = 0;
+
+	fis[0] = 0x27;			// register FIS, host to device
+	fis[1] = 0x80;			// a command
+	fis[2] = command;
+	fis[4] = (uint8_t)LBA;		// LBA bits 0-7
+	fis[5] = (uint8_t)(LBA>>8);	// LBA bits 8-15
+	fis[6] = (uint8_t)(LBA>>16);	// LBA bits 16-23
+	fis[8] = (uint8_t)(LBA>>24);	// LBA bits 24-31
+	if (command != 0xEC) fis[7] = 0x40; // LBA mode
+
+	if (command == 0x60) {
+		fis[3] = (uint8_t)count;	// features: sector count
+		fis[11] = (uint8_t)(count>>8);
+		fis[12] = (uint8_t)(slot<<3);	// count: the tag
+	}
+	else {
+		fis[12] = (uint8_t)count;
+		fis[13] = (uint8_t)(count>>8);
+	}
+}
+
+/*** Read the IDENTIFY DEVICE data ***/
+// Polls slot 0; the port interrupts are not on yet. Returns
+// FALSE if the drive does not answer
+bool ahci_identify_drive(void) {
+	uint32_t i;
+
+	ahci_build_fis(0, 0xEC, 0, 0);
+	ahci_tables[0].prdt[0].base = (uint32_t)ahci_identify - KERNEL_BASE;
+	ahci_tables[0].prdt[0].base_high = 0;
+	ahci_tables[0].prdt[0].count = 512 - 1;
+	ahci_cmd_list[0].flags = 5; // FIS of 5 dwords, read
+	ahci_cmd_list[0].prdt_length = 1;
+	ahci_cmd_list[0].prd_bytes = 0;
+
+	asm volatile ("" : : : "memory"); // the command before the slot bit
+	ahci_write(PX_CI, 1);
+	for (i=0; i<10000000 && (ahci_read(PX_CI) & 1); i++)
+		if (ahci_read(PX_IS) & IS_ERRORS) break;
+
+	return !(ahci_read(PX_CI) & 1) && !(ahci_read(PX_IS) & IS_ERRORS);
+}
+
+/*** Queue a read on the drive ***/
+// req is filled in by submit_disk_request; it waits in
+// ahci_pending if every slot is taken. Called with disk_lock
+// held
+void ahci_submit(DISK_REQUEST *req) {
+	if (req->LBA >= ahci_sectors) {
+		ahci_finish(req, DISK_ERROR_LBA_OUTSIDE_RANGE);
+		return;
+	}
+	if (req->LBA + req->sectors_left > ahci_sectors) {
+		ahci_finish(req, DISK_ERROR_SECTORCOUNT_TOO_BIG);
+		return;
+	}
+
+	if (ahci_pending == NULL && ahci_start(req)) return;
+
+	req->next = NULL;
+	if (ahci_pending_tail == NULL) ahci_pending = req;
+	else ahci_pending_tail->next = req;
+	ahci_pending_tail = req;
+}
+
+/*** Put a request in a free slot ***/
+// One PRD per physically contiguous piece of the buffer.
+// Returns FALSE if no slot is free (nothing is done then); a
+// buffer that is not mapped finishes the request with an
+// error. Called with disk_lock held
+bool ahci_start(DISK_REQUEST *req) {
+	uint32_t bytes = req->sectors_left*512, n = 0, slot, p, l;
+	uint8_t *buffer = req->buffer;
+	uint64_t start = get_uptime_ns();
+	AHCI_PRD *prd;
+
+	for (slot=0; slot<ahci_slots; slot++)
+		if (!(ahci_issued & (1 << slot))) break;
+	if (slot == ahci_slots) return FALSE;
+
+	prd = ahci_tables[slot].prdt;
+	while (bytes > 0) {
+		p = get_physical_address(req->page_directory, buffer);
+		if (p == 0) {
+			ahci_finish(req, DISK_ERROR);
+			return TRUE;
+		}
+
+		l = 4096 - (p & 0xFFF); // to the end of the page
+		if (l > bytes) l = bytes;
+
+		if (n != 0 && prd[n-1].base + (prd[n-1].count + 1) == p) prd[n-1].count += l;
+		else {
+			prd[n].base = p;
+			prd[n].base_high = 0;
+			prd[n].count = l - 1;
+			n++;
+		}
+
+		buffer += l;
+		bytes -= l;
+	}
+
+	if (ahci_ncq) ahci_build_fis(slot, 0x60, req->LBA, req->sectors_left);	// READ FPDMA QUEUED
+	else ahci_build_fis(slot, 0x25, req->LBA, req->sectors_left);		// READ DMA EXT
+	ahci_cmd_list[slot].flags = 5; // FIS of 5 dwords, read
+	ahci_cmd_list[slot].prdt_length = (uint16_t)n;
+	ahci_cmd_list[slot].prd_bytes = 0;
+	ahci_requests[slot] = req;
+	ahci_issued |= 1 << slot;
+
+	asm volatile ("" : : : "memory"); // the command before the slot bit
+	if (ahci_ncq) ahci_write(PX_SACT, 1 << slot); // the tag first
+	ahci_write(PX_CI, 1 << slot);
+
+	ahci_in_flight++;
+	if (ahci_in_flight > ahci_max_in_flight) ahci_max_in_flight = ahci_in_flight;
+
+	req->busy_ns += get_uptime_ns() - start;
+	return TRUE;
+}
+
+/*** Finish the requests the drive is done with ***/
+// A slot is done when its bit is clear in PxCI and, with NCQ,
+// in PxSACT. After an error the drive drops every queued
+// command, so they all fail and the port is restarted. Freed
+// slots may let waiting requests start. Called with disk_lock
+// held
+void ahci_reap(void) {
+	DISK_REQUEST *req, *next;
+	uint32_t is, busy, done, slot;
+	uint8_t status = NO_ERROR;
+
+	// cleared before looking at the slots, so that a command
+	// done after the look raises the interrupt again
+	is = ahci_read(PX_IS);
+	ahci_write(PX_IS, is);
+	hba_write(HBA_IS, 1 << ahci_port_number);
+
+	if (is & IS_ERRORS) {
+		ahci_stop_port();
+		ahci_start_port();
+		ahci_errors++;
+		status = DISK_ERROR;
+		done = ahci_issued;
+	}
+	else {
+		busy = ahci_read(PX_CI);
+		if (ahci_ncq) busy |= ahci_read(PX_SACT);
+		done = ahci_issued & ~busy;
+	}
+
+	for (slot=0; slot<ahci_slots; slot++) {
+		if (!(done & (1 << slot))) continue;
+
+		req = ahci_requests[slot];
+		ahci_requests[slot] = NULL;
+		ahci_issued &= ~(1 << slot);
+		ahci_in_flight--;
+		ahci_finish(req, status);
+	}
+
+	while ((req = ahci_pending) != NULL) {
+		next = req->next; // req may be gone once it starts
+		if (!ahci_start(req)) break;
+		ahci_pending = next;
+	}
+	if (ahci_pending == NULL) ahci_pending_tail = NULL;
+}
+
+/*** A request is over ***/
+// Accounts for it and wakes its waiters up; the owner of req
+// may go on as soon as done is set. Called with disk_lock held
+void ahci_finish(DISK_REQUEST *req, uint8_t status) {
+	PCB *waiter = req->waiter;
+	DISK_WAITER *waiters = req->waiters;
+	uint64_t now = get_uptime_ns();
+
+	if (status == NO_ERROR) {
+		disk_stats[DISK_AHCI].reads++;
+		disk_stats[DISK_AHCI].sectors += (req->n_sectors == 0 ? 256 : req->n_sectors);
+		disk_stats[DISK_AHCI].busy_ns += req->busy_ns;
+		disk_stats[DISK_AHCI].wait_ns += now - req->queued_at - req->busy_ns;
+	}
+
+	spin_lock(&sched_lock);
+	req->status = status;
+	req->done = TRUE;
+	wake_disk_waiters(waiter, waiters);
+	spin_unlock(&sched_lock);
+}
+
+// The HBA raises its interrupt when the drive has finished
+// commands (or failed one). On a line shared with virtio-blk,
+// virtio_interrupt_handler calls ahci_reap as well. Returns
+// TRUE if this CPU must run the scheduler
+uint32_t ahci_interrupt_handler() {
+	extern bool ioapic_active;	// from smp.c
+
+	spin_lock(&disk_lock);
+	ahci_reap();
+	spin_unlock(&disk_lock);
+
+	if (!ioapic_active && ahci_irq >= 8) port_write_byte(0xA0,0x20); // on the slave PIC
+	end_of_interrupt();
+
+	return this_cpu()->need_resched;
+}
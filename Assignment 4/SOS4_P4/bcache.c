@@ -0,0 +1,292 @@
+////////////////////////////////////////////////////////
+// The block buffer cache
+//
+// Sits in front of read_disk: the disk is read in blocks of
+// BCACHE_BLOCK_SECTORS sectors (one page), and the blocks
+// read last are kept in kernel memory. A block is found by
+// its first LBA through a hash table; when all blocks are in
+// use, the least recently used one is given to the new block.
+//
+// When a read starts where the previous one ended, the next
+// BCACHE_READ_AHEAD blocks are asked for without waiting for
+// them, so that the disk works while the reader copies; a
+// later read finds them in the cache or on their way.
+
+#include "kernel_only.h"
+
+BUFFER_BLOCK *bcache_blocks = NULL;	// all blocks; NULL if there is no cache
+uint32_t bcache_size = 0;		// number of blocks
+BUFFER_BLOCK *bcache_hash[BCACHE_HASH_SIZE];	// chains of blocks with the same hash
+BUFFER_BLOCK *lru_head = NULL;		// most recently used block
+BUFFER_BLOCK *lru_tail = NULL;		// least recently used block
+uint32_t next_sequential_LBA = 0;	// where a sequential read would start
+BCACHE_STATS bcache_stats;
+spinlock_t bcache_lock;			// protects all of the above
+
+/*** Set up the cache ***/
+// The cache takes 1/BCACHE_FRACTION of the free memory, but at
+// most BCACHE_MAX_BLOCKS blocks: its pages come from the first
+// 4MB, which the PCBs, kernel stacks and page tables need too
+void init_bcache(void) {
+	uint32_t n = count_free_memory() / 4096 / BCACHE_FRACTION;
+	uint32_t i, header_pages;
+	uint8_t mode;
+
+	for (mode=0; mode<N_DISK_MODES; mode++)
+		if (disk_mode_available(mode) && disk_capacity(mode) != 0) break;
+	if (mode == N_DISK_MODES) return; // no disk
+	if (n > BCACHE_MAX_BLOCKS) n = BCACHE_MAX_BLOCKS;
+
+	header_pages = bytes_to_frames(n*sizeof(BUFFER_BLOCK));
+	bcache_blocks = (BUFFER_BLOCK *)alloc_kernel_pages(header_pages);
+	if (bcache_blocks == NULL) return;
+
+	for (i=0; i<n; i++) {
+		bcache_blocks[i].data = (uint8_t *)alloc_kernel_pages(1);
+		if (bcache_blocks[i].data == NULL) break; // a smaller cache then
+
+		bcache_blocks[i].state = BLOCK_EMPTY;
+		bcache_blocks[i].users = 0;
+		bcache_blocks[i].hash_next = NULL;
+
+		// all blocks start at the cold end of the LRU list
+		bcache_blocks[i].lru_prev = lru_tail;
+		bcache_blocks[i].lru_next = NULL;
+		if (lru_tail == NULL) lru_head = &bcache_blocks[i];
+		else lru_tail->lru_next = &bcache_blocks[i];
+		lru_tail = &bcache_blocks[i];
+	}
+	bcache_size = i;
+
+	for (i=0; i<BCACHE_HASH_SIZE; i++) bcache_hash[i] = NULL;
+}
+
+/*** Hash bucket of a block ***/
+uint32_t bcache_hash_of(uint32_t LBA) {
+	return (LBA / BCACHE_BLOCK_SECTORS) % BCACHE_HASH_SIZE;
+}
+
+/*** Find the block starting at LBA ***/
+// Returns NULL if it is not in the cache; called with
+// bcache_lock held
+BUFFER_BLOCK *bcache_lookup(uint32_t LBA) {
+	BUFFER_BLOCK *b = bcache_hash[bcache_hash_of(LBA)];
+
+	while (b != NULL && b->LBA != LBA) b = b->hash_next;
+	return b;
+}
+
+/*** Take a block out of its hash chain ***/
+// Called with bcache_lock held
+void bcache_unhash(BUFFER_BLOCK *b) {
+	BUFFER_BLOCK **link = &bcache_hash[bcache_hash_of(b->LBA)];
+
+	while (*link != NULL && *link != b) link = &(*link)->hash_next;
+	if (*link == b) *link = b->hash_next;
+
+	b->hash_next = NULL;
+	b->state = BLOCK_EMPTY;
+}
+
+/*** Make a block the most recently used ***/
+// Called with bcache_lock held
+void bcache_touch(BUFFER_BLOCK *b) {
+	if (lru_head == b) return;
+
+	// unlink
+	b->lru_prev->lru_next = b->lru_next;
+	if (b->lru_next != NULL) b->lru_next->lru_prev = b->lru_prev;
+	else lru_tail = b->lru_prev;
+
+	// to the front
+	b->lru_prev = NULL;
+	b->lru_next = lru_head;
+	lru_head->lru_prev = b;
+	lru_head = b;
+}
+
+/*** Settle a block whose read may be over ***/
+// A block stays BLOCK_READING until someone looks at it after
+// its read is done. Called with bcache_lock held
+void bcache_settle(BUFFER_BLOCK *b) {
+	if (b->state != BLOCK_READING || !b->req.done) return;
+
+	if (b->req.status == NO_ERROR) b->state = BLOCK_VALID;
+	else bcache_unhash(b); // nobody may use the data
+}
+
+/*** Get a block for LBA and start reading it ***/
+// The least recently used block nobody is using or reading is
+// given up; returns NULL if there is none. Called with
+// bcache_lock held
+BUFFER_BLOCK *bcache_fill(uint32_t LBA, bool read_ahead) {
+	BUFFER_BLOCK *b;
+
+	for (b=lru_tail; b!=NULL; b=b->lru_prev) {
+		bcache_settle(b);
+		if (b->users == 0 && b->state != BLOCK_READING) break;
+	}
+	if (b == NULL) return NULL;
+
+	if (b->state == BLOCK_VALID) {
+		bcache_stats.evictions++;
+		if (b->read_ahead) bcache_stats.ra_wasted++; // never used
+		bcache_unhash(b);
+	}
+
+	b->LBA = LBA;
+	b->state = BLOCK_READING;
+	b->read_ahead = read_ahead;
+	b->hash_next = bcache_hash[bcache_hash_of(LBA)];
+	bcache_hash[bcache_hash_of(LBA)] = b;
+	bcache_touch(b);
+
+	// nobody waits yet; the first reader of the block will
+	b->req.waiter = NULL;
+	submit_disk_request(&b->req, DISK_DEFAULT, LBA, BCACHE_BLOCK_SECTORS, b->data);
+
+	return b;
+}
+
+/*** Read ahead of a sequential reader ***/
+// Asks for the blocks from LBA on that are not in the cache;
+// called with bcache_lock held
+void bcache_read_ahead(uint32_t LBA) {
+	uint32_t capacity = disk_capacity(DISK_DEFAULT), i;
+
+	for (i=0; i<BCACHE_READ_AHEAD; i++, LBA+=BCACHE_BLOCK_SECTORS) {
+		if (LBA + BCACHE_BLOCK_SECTORS > capacity) return;
+		if (bcache_lookup(LBA) != NULL) continue;
+		if (bcache_fill(LBA, TRUE) == NULL) return; // all blocks busy
+		bcache_stats.ra_issued++;
+	}
+}
+
+/*** Start reading the blocks from LBA on ***/
+// Without waiting for them, for a reader that knows it wants
+// them next (see unpack_fill); the ones in the cache are left
+// as they are
+void bcache_prefetch(uint32_t LBA) {
+	uint32_t flags;
+
+	if (bcache_size == 0 || !disk_irq_ready(DISK_DEFAULT)) return;
+
+	flags = spin_lock_irqsave(&bcache_lock);
+	bcache_read_ahead(LBA / BCACHE_BLOCK_SECTORS * BCACHE_BLOCK_SECTORS);
+	spin_unlock_irqrestore(&bcache_lock, flags);
+}
+
+/*** Read sectors through the cache ***/
+// Same arguments and return codes as read_disk; n_sectors = 0
+// means 256. Blocks that cannot be cached (no cache, every
+// block busy, or the short block at the end of the disk) are
+// read from the disk directly. buffer is in the address space
+// loaded when called; it is loaded again for each copy, since
+// waiting for the disk switches it out
+uint8_t bcache_read(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
+	uint32_t count = (n_sectors == 0 ? 256 : n_sectors);
+	uint32_t cr3 = read_CR3();
+	uint32_t capacity = disk_capacity(DISK_DEFAULT);
+	uint32_t block, offset, n, i, flags;
+	uint8_t status;
+	BUFFER_BLOCK *b;
+	DISK_REQUEST req;
+
+	if (bcache_size == 0 || !disk_irq_ready(DISK_DEFAULT)) return read_disk(LBA, n_sectors, buffer);
+
+	if (LBA >= capacity) return DISK_ERROR_LBA_OUTSIDE_RANGE;
+	if (LBA + count > capacity) return DISK_ERROR_SECTORCOUNT_TOO_BIG;
+
+	flags = spin_lock_irqsave(&bcache_lock);
+	if (LBA == next_sequential_LBA) {
+		bcache_stats.sequential++;
+		block = (LBA + count + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS * BCACHE_BLOCK_SECTORS;
+		bcache_read_ahead(block);
+	}
+	next_sequential_LBA = LBA + count;
+	spin_unlock_irqrestore(&bcache_lock, flags);
+
+	while (count > 0) {
+		block = LBA / BCACHE_BLOCK_SECTORS * BCACHE_BLOCK_SECTORS;
+		offset = LBA - block;
+		n = BCACHE_BLOCK_SECTORS - offset;
+		if (n > count) n = count;
+
+		flags = spin_lock_irqsave(&bcache_lock);
+		b = NULL;
+		if (block + BCACHE_BLOCK_SECTORS > capacity) bcache_stats.misses++;
+		else if ((b = bcache_lookup(block)) == NULL) {
+			bcache_stats.misses++;
+			b = bcache_fill(block, FALSE);
+		}
+		else {
+			bcache_stats.hits++;
+			if (b->read_ahead) {
+				bcache_stats.ra_used++;
+				b->read_ahead = FALSE;
+			}
+			bcache_touch(b);
+		}
+		if (b != NULL) b->users++; // cannot be given up now
+		spin_unlock_irqrestore(&bcache_lock, flags);
+
+		if (b == NULL) {
+			// the request takes the address space of buffer
+			// from CR3; nothing switches it out under the lock
+			flags = spin_lock_irqsave(&bcache_lock);
+			if (read_CR3() != cr3) load_CR3(cr3);
+			req.waiter = current_process;
+			submit_disk_request(&req, DISK_DEFAULT, LBA, (uint8_t)n, buffer);
+			spin_unlock_irqrestore(&bcache_lock, flags);
+
+			wait_disk_request(&req);
+			if (req.status != NO_ERROR) return req.status;
+		}
+		else {
+			wait_disk_request(&b->req);
+
+			flags = spin_lock_irqsave(&bcache_lock);
+			bcache_settle(b);
+			if (b->state == BLOCK_VALID) {
+				if (read_CR3() != cr3) load_CR3(cr3);
+				for (i=0; i<n*128; i++)
+					((uint32_t *)buffer)[i] = ((uint32_t *)(b->data + offset*512))[i];
+				status = NO_ERROR;
+			}
+			else status = b->req.status;
+			b->users--;
+			spin_unlock_irqrestore(&bcache_lock, flags);
+
+			if (status != NO_ERROR) return status;
+		}
+
+		count -= n;
+		LBA += n;
+		buffer += n*512;
+	}
+
+	return NO_ERROR;
+}
+
+/*** Forget every block ***/
+// For when the disk behind read_disk changes (see
+// set_disk_mode). Blocks being read or copied from stay as they
+// are for their readers, but nobody finds them any more
+void bcache_flush(void) {
+	uint32_t flags, i;
+	BUFFER_BLOCK *b, *next;
+
+	if (bcache_size == 0) return;
+
+	flags = spin_lock_irqsave(&bcache_lock);
+	for (i=0; i<BCACHE_HASH_SIZE; i++) {
+		for (b=bcache_hash[i]; b!=NULL; b=next) {
+			next = b->hash_next;
+			b->hash_next = NULL;
+			if (b->state == BLOCK_VALID && b->users == 0) b->state = BLOCK_EMPTY;
+		}
+		bcache_hash[i] = NULL;
+	}
+	next_sequential_LBA = 0;
+	spin_unlock_irqrestore(&bcache_lock, flags);
+}
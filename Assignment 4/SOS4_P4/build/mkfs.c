@@ -0,0 +1,162 @@
+////////////////////////////////////////////////////////
+// Makes the SOS filesystem on a disk image (see fs.h)
+//
+// Usage: mkfs <disk image> <list of files>
+//
+// The list has one file name per line, relative to the
+// directory of the list. The files are written one after the
+// other from the first data sector, each in one extent that
+// starts at a multiple of FS_ALIGN_SECTORS, and entered in the
+// directory under their name. Runs on the host
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fs.h"
+
+#define N_SLOTS		(FS_DIR_SECTORS*FS_DIRENTS_PER_SECTOR)
+
+FS_DIRENT dir[N_SLOTS];
+
+/*** Hash of a file name ***/
+// 32-bit FNV-1a; must be the one of the kernel (see fs.c)
+uint32_t fs_hash(const char *name) {
+	uint32_t h = 2166136261u;
+
+	for (; *name != 0; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*** First multiple of FS_ALIGN_SECTORS from LBA on ***/
+uint32_t align(uint32_t LBA) {
+	return (LBA + FS_ALIGN_SECTORS - 1) / FS_ALIGN_SECTORS * FS_ALIGN_SECTORS;
+}
+
+/*** Write sectors at LBA of the image ***/
+// bytes of data, then zeros to the end of the last sector
+void write_sectors(FILE *disk, uint32_t LBA, const void *data, uint32_t bytes) {
+	static const char zeros[512];
+	uint32_t tail = (512 - bytes % 512) % 512;
+
+	fseek(disk, (long)LBA*512, SEEK_SET);
+	fwrite(data, 1, bytes, disk);
+	fwrite(zeros, 1, tail, disk);
+}
+
+/*** Enter a file in the directory ***/
+// Returns 0, or -1 if the name is taken or there is no room
+int add_entry(const char *name, uint32_t LBA, uint32_t size) {
+	uint32_t h = fs_hash(name);
+	uint32_t slot = h % N_SLOTS, i;
+
+	for (i=0; i<N_SLOTS; i++, slot=(slot+1)%N_SLOTS) {
+		if (dir[slot].name[0] == 0) break;
+		if (strcmp(dir[slot].name, name) == 0) return -1;
+	}
+	if (i == N_SLOTS) return -1;
+
+	strcpy(dir[slot].name, name);
+	dir[slot].hash = h;
+	dir[slot].LBA = LBA;
+	dir[slot].size = size;
+	dir[slot].sectors = (size + 511) / 512;
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	FILE *disk, *list, *f;
+	FS_SUPER super;
+	char line[1024], path[2048], *word, *name, *end, *data;
+	const char *slash;
+	uint32_t LBA, size, disk_sectors;
+	int dir_length;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <disk image> <list of files>\n", argv[0]);
+		return 1;
+	}
+
+	if ((disk = fopen(argv[1], "r+b")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(disk, 0, SEEK_END);
+	disk_sectors = (uint32_t)(ftell(disk) / 512);
+
+	if ((list = fopen(argv[2], "r")) == NULL) {
+		perror(argv[2]);
+		return 1;
+	}
+	slash = strrchr(argv[2], '/');
+	dir_length = (slash == NULL ? 0 : (int)(slash - argv[2]) + 1);
+
+	memset(dir, 0, sizeof(dir));
+	memset(&super, 0, sizeof(super));
+	super.magic = FS_MAGIC;
+	super.dir_LBA = FS_SUPER_LBA + 1;
+	super.dir_sectors = FS_DIR_SECTORS;
+	super.data_LBA = align(super.dir_LBA + super.dir_sectors);
+
+	LBA = super.data_LBA;
+	while (fgets(line, sizeof(line), list) != NULL) {
+		// the first word of the line; blank lines and # comments are skipped
+		for (word=line; *word==' ' || *word=='\t'; word++);
+		for (end=word; *end!=0 && *end!=' ' && *end!='\t' && *end!='\n' && *end!='\r'; end++);
+		*end = 0;
+		if (*word == 0 || *word == '#') continue;
+
+		// entered under the name without its directory
+		name = (strrchr(word, '/') != NULL ? strrchr(word, '/') + 1 : word);
+		if (strlen(name) >= FS_NAME_LEN) {
+			fprintf(stderr, "%s: Name too long.\n", name);
+			return 1;
+		}
+
+		snprintf(path, sizeof(path), "%.*s%s", dir_length, argv[2], word);
+		if ((f = fopen(path, "rb")) == NULL) {
+			perror(path);
+			return 1;
+		}
+		fseek(f, 0, SEEK_END);
+		size = (uint32_t)ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		data = malloc(size == 0 ? 1 : size);
+		if (data == NULL || fread(data, 1, size, f) != size) {
+			fprintf(stderr, "%s: Cannot read.\n", path);
+			return 1;
+		}
+		fclose(f);
+
+		if (LBA + (size + 511) / 512 > disk_sectors) {
+			fprintf(stderr, "%s: Disk full.\n", name);
+			return 1;
+		}
+		if (add_entry(name, LBA, size) != 0) {
+			fprintf(stderr, "%s: Duplicate name or directory full.\n", name);
+			return 1;
+		}
+
+		write_sectors(disk, LBA, data, size);
+		printf("%s @ %u (%u bytes)\n", name, LBA, size);
+		free(data);
+
+		super.n_files++;
+		LBA = align(LBA + (size + 511) / 512);
+	}
+	fclose(list);
+
+	super.end_LBA = LBA;
+	write_sectors(disk, super.dir_LBA, dir, sizeof(dir));
+	write_sectors(disk, FS_SUPER_LBA, &super, sizeof(super));
+
+	fclose(disk);
+	return 0;
+}
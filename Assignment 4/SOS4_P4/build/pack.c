@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////
+// Packs a program image (see pack.h)
+//
+// Usage: pack <program> <packed image>
+//
+// Each block is compressed greedily: the last place each
+// 4-byte string was seen in the block is kept in a hash table,
+// and a string seen before becomes a match as long as it goes
+// on. Blocks that do not get smaller are stored as they are.
+// Runs on the host
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../pack.h"
+
+#define HASH_BITS	12
+
+/*** Hash of the 4 bytes at p ***/
+uint32_t hash4(const uint8_t *p) {
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*** Write a length beyond the 15 of its token ***/
+uint8_t *put_length(uint8_t *out, uint32_t n) {
+	for (; n >= 255; n -= 255) *out++ = 255;
+	*out++ = (uint8_t)n;
+	return out;
+}
+
+/*** Write a sequence: literals, then a match if length != 0 ***/
+uint8_t *put_sequence(uint8_t *out, const uint8_t *literals, uint32_t n_literals,
+		      uint32_t offset, uint32_t length) {
+	uint32_t m = (length != 0 ? length - PACK_MIN_MATCH : 0);
+
+	*out++ = (uint8_t)(((n_literals < 15 ? n_literals : 15) << 4) | (m < 15 ? m : 15));
+	if (n_literals >= 15) out = put_length(out, n_literals - 15);
+	memcpy(out, literals, n_literals);
+	out += n_literals;
+
+	if (length != 0) {
+		*out++ = (uint8_t)offset;
+		*out++ = (uint8_t)(offset >> 8);
+		if (m >= 15) out = put_length(out, m - 15);
+	}
+
+	return out;
+}
+
+/*** Compress a block ***/
+// Returns the bytes written to out, which has room for twice n
+uint32_t compress_block(const uint8_t *in, uint32_t n, uint8_t *out) {
+	int32_t last[1 << HASH_BITS];
+	uint32_t i = 0, anchor = 0, length, h;
+	uint8_t *o = out;
+
+	memset(last, 0xFF, sizeof(last)); // -1: not seen
+
+	while (i + PACK_MIN_MATCH <= n) {
+		h = hash4(in + i);
+		if (last[h] < 0 || memcmp(in + last[h], in + i, PACK_MIN_MATCH) != 0) {
+			last[h] = (int32_t)i;
+			i++;
+			continue;
+		}
+
+		for (length=PACK_MIN_MATCH; i+length<n && in[last[h]+length]==in[i+length]; length++);
+		o = put_sequence(o, in + anchor, i - anchor, i - (uint32_t)last[h], length);
+		last[h] = (int32_t)i;
+		i += length;
+		anchor = i;
+	}
+
+	o = put_sequence(o, in + anchor, n - anchor, 0, 0); // the rest as literals
+	return (uint32_t)(o - out);
+}
+
+int main(int argc, char *argv[]) {
+	FILE *in, *out;
+	PACK_HEADER header;
+	uint8_t *data, packed[2*PACK_BLOCK_SIZE + 16];
+	uint32_t size, i, n, length, total;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <program> <packed image>\n", argv[0]);
+		return 1;
+	}
+
+	if ((in = fopen(argv[1], "rb")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	fseek(in, 0, SEEK_END);
+	size = (uint32_t)ftell(in);
+	fseek(in, 0, SEEK_SET);
+
+	data = malloc(size == 0 ? 1 : size);
+	if (data == NULL || fread(data, 1, size, in) != size) {
+		fprintf(stderr, "%s: Cannot read.\n", argv[1]);
+		return 1;
+	}
+	fclose(in);
+
+	if ((out = fopen(argv[2], "wb")) == NULL) {
+		perror(argv[2]);
+		return 1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PACK_MAGIC;
+	header.size = size;
+	header.blocks = (size + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE;
+	fwrite(&header, sizeof(header), 1, out);
+	total = sizeof(header);
+
+	for (i=0; i<size; i+=n) {
+		n = (size - i > PACK_BLOCK_SIZE ? PACK_BLOCK_SIZE : size - i);
+
+		length = compress_block(data + i, n, packed);
+		if (length >= n) { // no smaller: stored
+			length = n | PACK_STORED;
+			fwrite(&length, 4, 1, out);
+			fwrite(data + i, 1, n, out);
+			total += 4 + n;
+		}
+		else {
+			fwrite(&length, 4, 1, out);
+			fwrite(packed, 1, length, out);
+			total += 4 + length;
+		}
+	}
+	fclose(out);
+
+	printf("%s: %u -> %u bytes\n", argv[2], size, total);
+	free(data);
+	return 0;
+}
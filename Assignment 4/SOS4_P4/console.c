@@ -8,6 +8,22 @@
 #include "kernel_only.h"
 
 extern PCB *processq_next; 	// in scheduler.c
+extern PCB console;		// in scheduler.c
+extern bool sync_handoff;	// in scheduler.c
+extern MUTEX mx[MUTEX_MAXNUMBER];	// in mutex.c
+extern SEMAPHORE sem[SEM_MAXNUMBER];	// in semaphore.c
+extern spinlock_t sched_lock;	// in scheduler.c
+
+/*** Process listings ***/
+// The process queue changes under sched_lock on every CPU (and
+// the reaper frees PCBs), so the commands copy what they show
+// while holding it, and print once it is dropped
+#define LIST_MAX_PROCESSES	64	// processes copied by ps, shares and rt
+
+/*** top ***/
+#define TOP_MAX_PROCESSES	32	// processes considered by top
+#define TOP_MAX_ROWS		14	// processes shown by top (fits below the logo)
+#define TOP_REFRESH_MS		1000	// top refresh interval
 
 char prompt[32] = {"% "};	// the command prompt
 
@@ -110,7 +126,7 @@ void command_diskdump(char *args) {
 
 	// read one sector at a time and display
 	for (; n_sectors>0; n_sectors--,LBA++) {
-		status = read_disk(LBA,1,a_sector);
+		status = bcache_read(LBA,1,a_sector);
 		
 		if (status == DISK_ERROR_LBA_OUTSIDE_RANGE
 			|| status == DISK_ERROR_SECTORCOUNT_TOO_BIG) {
@@ -131,75 +147,1038 @@ void command_diskdump(char *args) {
 	}
 }
 
+/*** bcache Command ***/
+// Size of the buffer cache, its hit rate and evictions, and
+// how many of the blocks read ahead were then asked for
+void command_bcache() {
+	extern uint32_t bcache_size;
+	extern BCACHE_STATS bcache_stats;
+	uint32_t lookups = bcache_stats.hits + bcache_stats.misses;
+
+	sys_printf("Blocks: %d (%d KB)\tEvictions: %d\n",bcache_size,bcache_size*BCACHE_BLOCK_SECTORS/2,bcache_stats.evictions);
+	sys_printf("Hits: %d\tMisses: %d",bcache_stats.hits,bcache_stats.misses);
+	if (lookups != 0) sys_printf("\tHit rate: %d%%",bcache_stats.hits*100/lookups);
+	sys_printf("\nSequential reads: %d\tRead ahead: %d, used %d, wasted %d\n",
+		   bcache_stats.sequential,bcache_stats.ra_issued,bcache_stats.ra_used,bcache_stats.ra_wasted);
+}
+
+/*** iosched Command ***/
+// Format: iosched [noop|deadline|clook]
+// Switches the I/O scheduler; with no argument, shows its
+// statistics: requests and how many were merged into others,
+// the queue depth each request found, and the latency from
+// submission to done
+void command_iosched(char *args) {
+	extern IO_SCHEDULER io_schedulers[N_IO_SCHEDULERS];
+	extern IO_SCHEDULER *io_scheduler;
+	extern IO_STATS io_stats;
+	uint32_t i, elapsed_ms, seen, p99;
+	uint64_t v;
+
+	if (*args != 0) {
+		if (!set_io_scheduler(args)) {
+			puts("Usage: iosched [");
+			for (i=0; i<N_IO_SCHEDULERS; i++)
+				sys_printf("%s%s",io_schedulers[i].name,(i==N_IO_SCHEDULERS-1?"]\n":"|"));
+		}
+		return;
+	}
+
+	disable_interrupts();
+
+	elapsed_ms = ns_to_ms(get_uptime_ns() - io_stats.since);
+	if (elapsed_ms == 0) elapsed_ms = 1;
+
+	sys_printf("Scheduler: %s (for %d s)\n",io_scheduler->name,elapsed_ms/1000);
+
+	v = (uint64_t)io_stats.completed*1000;
+	div64_32(&v, elapsed_ms);
+	sys_printf("Requests: %d (%d/s)\tMerged: %d\tCommands: %d\tPast deadline: %d\n",
+			io_stats.requests,(uint32_t)v,io_stats.merges,io_stats.dispatches,io_stats.expired);
+
+	puts("Queue depth:");
+	for (i=0; i<IO_DEPTH_BUCKETS; i++) {
+		if (io_stats.depth_hist[i] == 0) continue;
+		sys_printf(" %d%s:%d",i,(i==IO_DEPTH_BUCKETS-1?"+":""),io_stats.depth_hist[i]);
+	}
+	puts("\n");
+
+	if (io_stats.completed == 0) puts("Latency: no requests done.\n");
+	else {
+		v = io_stats.lat_ns;
+		div64_32(&v, io_stats.completed);
+
+		// smallest bucket bound covering 99% of the requests
+		seen = 0;
+		for (i=0; i<IO_LAT_BUCKETS-1; i++) {
+			seen += io_stats.lat_hist[i];
+			if ((uint64_t)seen*100 >= (uint64_t)io_stats.completed*99) break;
+		}
+		p99 = 1 << i;
+
+		sys_printf("Latency: mean %d us, p99 < %d us\n",ns_to_us(v),p99);
+		puts("Latency (us):");
+		for (i=0; i<IO_LAT_BUCKETS; i++) {
+			if (io_stats.lat_hist[i] == 0) continue;
+			sys_printf(" <%d:%d",1 << i,io_stats.lat_hist[i]);
+		}
+		puts("\n");
+	}
+
+	enable_interrupts();
+}
+
+/*** disk Command ***/
+// Format: disk [pio|multiple|dma|virtio|ahci]
+// Chooses how sectors are read; with no argument, shows the
+// mode and for each of them the sectors read, the throughput,
+// and how much of the read time the CPU was busy (the rest the
+// reader waited for the drive while other processes ran)
+void command_disk(char *args) {
+	extern uint8_t disk_mode;
+	extern DISK_STATS disk_stats[N_DISK_MODES];
+	extern char *disk_mode_names[N_DISK_MODES];
+	extern uint16_t virtio_base;
+	extern uint8_t virtio_irq;
+	extern uint32_t virtio_sectors, virtio_in_flight, virtio_max_in_flight;
+	extern volatile uint8_t *ahci_port;
+	extern uint8_t ahci_port_number, ahci_irq;
+	extern bool ahci_ncq;
+	extern uint32_t ahci_sectors, ahci_slots, ahci_in_flight, ahci_max_in_flight, ahci_errors;
+	DISK_STATS *d;
+	uint64_t v, total_us;
+	int i;
+
+	if (*args != 0) {
+		for (i=0; i<N_DISK_MODES; i++)
+			if (strcmp(args,disk_mode_names[i])==0) break;
+
+		if (i == N_DISK_MODES) {
+			puts("Usage: disk [pio|multiple|dma|virtio|ahci]\n");
+			return;
+		}
+		if (!set_disk_mode(i)) sys_printf("disk: The drive cannot do %s.\n",disk_mode_names[i]);
+	}
+
+	if (virtio_base != 0)
+		sys_printf("virtio: %d sectors, IRQ %d, %d requests in flight (most %d)\n",
+			   virtio_sectors,virtio_irq,virtio_in_flight,virtio_max_in_flight);
+	if (ahci_port != NULL)
+		sys_printf("ahci: %d sectors on port %d, IRQ %d, %s depth %d, %d commands in flight (most %d), %d errors\n",
+			   ahci_sectors,ahci_port_number,ahci_irq,ahci_ncq ? "NCQ" : "no NCQ,",ahci_slots,
+			   ahci_in_flight,ahci_max_in_flight,ahci_errors);
+
+	sys_printf("Mode: %s\n",disk_mode_names[disk_mode]);
+	puts("Mode\t\tReads\tSectors\tKB/s\tBusy%\n");
+
+	for (i=0; i<N_DISK_MODES; i++) {
+		d = &disk_stats[i];
+		sys_printf("%s\t%s%d\t%d",disk_mode_names[i],i == DISK_PIO_MULTIPLE ? "" : "\t",d->reads,(uint32_t)d->sectors);
+
+		total_us = ns_to_us(d->busy_ns + d->wait_ns);
+		if (total_us == 0) {
+			puts("\t-\t-\n");
+			continue;
+		}
+
+		v = d->sectors*512*1000000; // bytes per second
+		div64_32(&v, (uint32_t)total_us);
+		sys_printf("\t%d",(uint32_t)v/1024);
+
+		v = (uint64_t)ns_to_us(d->busy_ns)*100;
+		div64_32(&v, (uint32_t)total_us);
+		sys_printf("\t%d\n",(uint32_t)v);
+	}
+}
+
+/*** diskbench Command ***/
+// Format: diskbench [start LBA] [sector count]
+// Reads the sectors (past the buffer cache) once in each mode
+// the drive can do, and shows how long it took, the throughput
+// and how much of it the CPU was busy. Reads by others at the
+// same time are counted in too
+void command_diskbench(char *args) {
+	extern PDE *k_page_directory;	// from lmemman.c
+	extern DISK_STATS disk_stats[N_DISK_MODES];
+	extern char *disk_mode_names[N_DISK_MODES];
+	uint32_t LBA, n_sectors, done, n;
+	uint64_t start, elapsed, busy, v;
+	uint8_t *buffer;
+	uint8_t status = NO_ERROR;
+	int mode;
+
+	if (*args==0 || !is_pos_number(args)) {
+		puts("Usage: diskbench [start LBA] [sector count]\n");
+		return;
+	}
+	LBA = atoi(args);
+
+	while (*args!=0 && *args!=' ') args++;	// goto end of first argument
+	if (*args!=0) args++;			// second argument from next position
+	if (*args==0 || !is_pos_number(args) || (n_sectors = atoi(args)) == 0) {
+		puts("Usage: diskbench [start LBA] [sector count]\n");
+		return;
+	}
+
+	buffer = (uint8_t *)alloc_kernel_pages(32); // 256 sectors
+	if (buffer == NULL) {
+		puts("diskbench: Out of memory.\n");
+		return;
+	}
+
+	puts("Mode\t\tus\tKB/s\tBusy%\n");
+	for (mode=0; mode<N_DISK_MODES && status==NO_ERROR; mode++) {
+		if (!disk_mode_available(mode)) continue;
+
+		busy = disk_stats[mode].busy_ns;
+		start = get_uptime_ns();
+		for (done=0; done<n_sectors && status==NO_ERROR; done+=n) {
+			n = (n_sectors - done > 256 ? 256 : n_sectors - done);
+			status = read_disk_with(mode, LBA + done, (uint8_t)n, buffer);
+		}
+		elapsed = get_uptime_ns() - start;
+		busy = disk_stats[mode].busy_ns - busy;
+
+		if (status != NO_ERROR) {
+			puts("diskbench: Disk read error.\n");
+			break;
+		}
+
+		sys_printf("%s\t%s%d",disk_mode_names[mode],mode == DISK_PIO_MULTIPLE ? "" : "\t",ns_to_us(elapsed));
+
+		v = (uint64_t)n_sectors*512*1000000; // bytes per second
+		div64_32(&v, ns_to_us(elapsed) == 0 ? 1 : ns_to_us(elapsed));
+		sys_printf("\t%d",(uint32_t)v/1024);
+
+		v = (uint64_t)ns_to_us(busy)*100;
+		div64_32(&v, ns_to_us(elapsed) == 0 ? 1 : ns_to_us(elapsed));
+		sys_printf("\t%d\n",(uint32_t)v);
+	}
+
+	for (n=0; n<32; n++)
+		dealloc_page(buffer + n*4096, k_page_directory);
+}
+
+/*** diskiops Command ***/
+// Format: diskiops [read count] [queue depth]
+// Reads 4KB blocks at random places of the disk (past the
+// buffer cache) in each mode the drive can do, keeping up to
+// queue depth reads (32 at most; the default) on their way, and
+// shows the reads per second, the throughput and how much of
+// the time the CPU was busy. The PIO and DMA reads go through
+// the I/O scheduler one command at a time; AHCI with NCQ and
+// virtio give the drive all of them at once
+void command_diskiops(char *args) {
+	extern PDE *k_page_directory;	// from lmemman.c
+	extern DISK_STATS disk_stats[N_DISK_MODES];
+	extern char *disk_mode_names[N_DISK_MODES];
+	static DISK_REQUEST reqs[IOPS_MAX_DEPTH];
+	bool in_flight[IOPS_MAX_DEPTH];
+	uint32_t n_reads, depth = IOPS_MAX_DEPTH, blocks = 0xFFFFFFFF;
+	uint32_t issued, completed, seed, i, us;
+	uint64_t start, busy, v;
+	uint8_t *buffer;
+	uint8_t status = NO_ERROR;
+	int mode;
+
+	if (*args==0 || !is_pos_number(args) || (n_reads = atoi(args)) == 0) {
+		puts("Usage: diskiops [read count] [queue depth]\n");
+		return;
+	}
+
+	while (*args!=0 && *args!=' ') args++;	// goto end of first argument
+	if (*args!=0) args++;			// second argument from next position
+	if (*args!=0) {
+		if (!is_pos_number(args) || (depth = atoi(args)) == 0 || depth > IOPS_MAX_DEPTH) {
+			puts("Usage: diskiops [read count] [queue depth]\n");
+			return;
+		}
+	}
+
+	// the same places in every mode: on all of their disks
+	for (mode=0; mode<N_DISK_MODES; mode++)
+		if (disk_mode_available(mode) && disk_capacity(mode)/8 < blocks) blocks = disk_capacity(mode)/8;
+	if (blocks == 0) {
+		puts("diskiops: The disk is too small.\n");
+		return;
+	}
+
+	buffer = (uint8_t *)alloc_kernel_pages(depth); // a block per read
+	if (buffer == NULL) {
+		puts("diskiops: Out of memory.\n");
+		return;
+	}
+
+	puts("Mode\t\tIOPS\tKB/s\tBusy%\n");
+	for (mode=0; mode<N_DISK_MODES && status==NO_ERROR; mode++) {
+		if (!disk_mode_available(mode)) continue;
+
+		for (i=0; i<depth; i++) in_flight[i] = FALSE;
+		issued = completed = 0;
+		seed = 1;
+
+		busy = disk_stats[mode].busy_ns;
+		start = get_uptime_ns();
+		// round the slots: wait for the read of one, then give it the next
+		for (i=0; completed<issued || (issued<n_reads && status==NO_ERROR); i=(i+1)%depth) {
+			if (in_flight[i]) {
+				wait_disk_request(&reqs[i]);
+				if (reqs[i].status != NO_ERROR) status = reqs[i].status;
+				in_flight[i] = FALSE;
+				completed++;
+			}
+			if (issued == n_reads || status != NO_ERROR) continue;
+
+			seed = seed*1103515245 + 12345;
+			reqs[i].waiter = current_process;
+			submit_disk_request(&reqs[i], mode, (seed >> 8) % blocks * 8, 8, buffer + i*4096);
+			in_flight[i] = TRUE;
+			issued++;
+		}
+		us = ns_to_us(get_uptime_ns() - start);
+		busy = disk_stats[mode].busy_ns - busy;
+
+		if (status != NO_ERROR) {
+			puts("diskiops: Disk read error.\n");
+			break;
+		}
+		if (us == 0) us = 1;
+
+		v = (uint64_t)n_reads*1000000; // reads per second
+		div64_32(&v, us);
+		sys_printf("%s\t%s%d",disk_mode_names[mode],mode == DISK_PIO_MULTIPLE ? "" : "\t",(uint32_t)v);
+		sys_printf("\t%d",(uint32_t)v*4);
+
+		v = (uint64_t)ns_to_us(busy)*100;
+		div64_32(&v, us);
+		sys_printf("\t%d\n",(uint32_t)v);
+	}
+
+	for (i=0; i<depth; i++)
+		dealloc_page(buffer + i*4096, k_page_directory);
+}
+
 /*** ps Command ***/
 void command_ps() {
-	PCB *p = processq_next;
-	PCB *begin_queue = p;
+	PS_ROW rows[LIST_MAX_PROCESSES];
+	uint32_t flags, n = 0, total = 0, i;
+	PCB *p;
 
-	uint8_t s;
+	flags = spin_lock_irqsave(&sched_lock);
+	p = processq_next;
+	if (p != NULL) do {
+		if (n < LIST_MAX_PROCESSES) {
+			rows[n].pid = p->pid;
+			switch(p->state) {
+				case 0: rows[n].state = 'N'; break; // new
+				case 1: rows[n].state = 'Q'; break; // queued (ready)
+				case 2: rows[n].state = 'R'; break; // running
+				case 3: rows[n].state = 'W'; break; // waiting (blocked)
+				case 4: rows[n].state = 'T'; break; // terminated
+				case 5: rows[n].state = 'L'; break; // loading
+			}
+			rows[n].page_directory = (uint32_t)p->mem.page_directory;
+			rows[n].text = p->mem.end_code - p->mem.start_code + 1;
+			rows[n].stack = (p->ring0 ? 0 : p->mem.start_stack - p->regs->esp);
+			rows[n].heap = p->mem.brk - p->mem.start_brk;
+			n++;
+		}
+		total++;
+		p = p->next_PCB;
+	} while (p != processq_next);
+	spin_unlock_irqrestore(&sched_lock, flags);
 
-	if (p == NULL) {
+	if (total == 0) {
 		puts("ps: No running processes.\n");
 		return;
 	}
 
 	puts("PID\tState\tPgDir\tText\tStack\tHeap\n");
+	for (i=0; i<n; i++)
+		sys_printf("%d\t%c\t%x\t%x\t%x\t%x\n",
+					rows[i].pid,
+					rows[i].state,
+					rows[i].page_directory,
+					rows[i].text,
+					rows[i].stack,
+					rows[i].heap);
+	if (total > n) sys_printf("(%d more)\n",total - n);
+}
+
+
+/*** Fill in a top row for a process ***/
+// interval_us is the time since the last refresh; called with
+// sched_lock held
+void top_row(TOP_ROW *r, PCB *p, uint32_t interval_us) {
+	uint64_t cpu_ns = p->stats.user_ns + p->stats.kernel_ns;
+	uint64_t usage = (uint64_t)ns_to_us(cpu_ns - p->stats.last_cpu_ns)*1000;
+
+	div64_32(&usage, (interval_us == 0 ? 1 : interval_us));
+	p->stats.last_cpu_ns = cpu_ns;
+
+	r->is_console = (p == &console);
+	r->pid = p->pid;
+	switch(p->state) {
+		case NEW: r->state = 'N'; break;
+		case READY: r->state = 'Q'; break;
+		case RUNNING: r->state = 'R'; break;
+		case WAITING: r->state = 'W'; break;
+		case TERMINATED: r->state = 'T'; break;
+		case LOADING: r->state = 'L'; break;
+	}
+	r->usage = (uint32_t)usage;
+	r->user_ms = ns_to_ms(p->stats.user_ns);
+	r->kernel_ms = ns_to_ms(p->stats.kernel_ns);
+	r->voluntary_switches = p->stats.voluntary_switches;
+	r->involuntary_switches = p->stats.involuntary_switches;
+	r->syscalls = p->stats.syscalls;
+	r->page_faults = p->stats.page_faults;
+	r->mutex_wait_ms = ns_to_ms(p->stats.mutex_wait_ns);
+	r->sem_wait_ms = ns_to_ms(p->stats.sem_wait_ns);
+}
+
+/*** Print a load average (fixed point, 11 fraction bits) ***/
+void put_load(uint32_t load) {
+	uint32_t frac = ((load & 0x7FF)*100) >> 11;
+
+	sys_printf("%d.",load >> 11);
+	if (frac < 10) putc('0');
+	sys_printf("%d",frac);
+}
+
+/*** top Command ***/
+// Shows processes sorted by CPU usage during the last second;
+// the view is redrawn in place until a key is pressed.
+// The console itself is shown as PID "-"
+void command_top() {
+	TOP_ROW rows[TOP_MAX_PROCESSES+1], tmp;
+	PCB *p;
+	uint32_t n, i, j, flags;
+	uint32_t load[3];
+	uint64_t now, last;
+	KEYCODE key;
+
+	get_key(); // discard earlier key press
+	last = get_uptime_ns();
+
 	do {
-		sys_printf("%d\t",p->pid);
-		switch(p->state) {
-			case 0: s = 'N'; break; // new
-			case 1: s = 'Q'; break; // queued (ready)
-			case 2: s = 'R'; break; // running
-			case 3: s = 'W'; break; // waiting (blocked)
-			case 4: s = 'T'; break; // terminated
+		// wait for next refresh or a key press
+		do {
+			key = get_key();
+		} while (key == KEY_UNKNOWN && get_uptime_ns() - last < (uint64_t)TOP_REFRESH_MS*1000000);
+
+		// processes may come and go while we walk the queue
+		flags = spin_lock_irqsave(&sched_lock);
+		now = get_uptime_ns();
+		top_row(&rows[0], &console, ns_to_us(now - last));
+		n = 1;
+		p = processq_next;
+		if (p != NULL) do {
+			top_row(&rows[n++], p, ns_to_us(now - last));
+			p = p->next_PCB;
+		} while (p != processq_next && n <= TOP_MAX_PROCESSES);
+		for (i=0; i<3; i++) load[i] = get_load_average()[i];
+		spin_unlock_irqrestore(&sched_lock, flags);
+		last = now;
+
+		// sort by CPU usage (highest first)
+		for (i=1; i<n; i++) {
+			tmp = rows[i];
+			for (j=i; j>0 && rows[j-1].usage < tmp.usage; j--) rows[j] = rows[j-1];
+			rows[j] = tmp;
+		}
+
+		cls();
+		sys_printf("top - up %d s, %d processes, load average: ", get_uptime()/1000, n-1);
+		put_load(load[0]); puts(", ");
+		put_load(load[1]); puts(", ");
+		put_load(load[2]); putc('\n');
+		puts("PID S\t%CPU\tUser\tSys\tVol\tInvol\tSysc\tPgF\tMxWait\tSemWait\n");
+
+		for (i=0; i<n && i<TOP_MAX_ROWS; i++) {
+			if (rows[i].is_console) puts("- R\t"); 
+			else sys_printf("%d %c\t",rows[i].pid,rows[i].state);
+			sys_printf("%d.%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n",
+					rows[i].usage/10, rows[i].usage%10,
+					rows[i].user_ms, rows[i].kernel_ms,
+					rows[i].voluntary_switches, rows[i].involuntary_switches,
+					rows[i].syscalls, rows[i].page_faults,
+					rows[i].mutex_wait_ms, rows[i].sem_wait_ms);
+		}
+	} while (key == KEY_UNKNOWN);
+}
+
+/*** syncstat Command ***/
+// Wait statistics of the mutexes and semaphores in use
+void command_syncstat() {
+	int i;
+	bool found = FALSE;
+
+	for (i=1; i<MUTEX_MAXNUMBER; i++) {
+		if (mx[i].available) continue;
+		if (!found) puts("Object\tKey\tCreator\tWaits\tWait(ms)\tWakeups\tLat(us)\tMax(us)\n");
+		found = TRUE;
+		sys_printf("mutex\t%d\t%d\t%d\t%d\t\t",i,mx[i].creator,mx[i].waits,ns_to_ms(mx[i].wait_ns));
+		put_wake_latency(&mx[i].latency);
+	}
+	for (i=1; i<SEM_MAXNUMBER; i++) {
+		if (sem[i].available) continue;
+		if (!found) puts("Object\tKey\tCreator\tWaits\tWait(ms)\tWakeups\tLat(us)\tMax(us)\n");
+		found = TRUE;
+		sys_printf("sem\t%d\t%d\t%d\t%d\t\t",i,sem[i].creator,sem[i].waits,ns_to_ms(sem[i].wait_ns));
+		put_wake_latency(&sem[i].latency);
+	}
+
+	if (!found) puts("syncstat: No mutexes or semaphores in use.\n");
+	else sys_printf("Handoff is %s.\n",sync_handoff?"on":"off");
+}
+
+/*** Print wake up to run latency: count, mean and maximum ***/
+void put_wake_latency(WAKE_LATENCY *l) {
+	uint64_t mean = l->total_ns;
+
+	div64_32(&mean, (l->count == 0 ? 1 : l->count));
+	sys_printf("%d\t%d\t%d\n",l->count,ns_to_us(mean),ns_to_us(l->max_ns));
+}
+
+/*** handoff Command ***/
+// Format: handoff [on|off]
+// With handoff on, a process woken up by a mutex unlock or a
+// semaphore UP runs right away, in the rest of the epoch of
+// the process that woke it
+void command_handoff(char *args) {
+	if (strcmp(args,"on")==0) sync_handoff = TRUE;
+	else if (strcmp(args,"off")==0) sync_handoff = FALSE;
+	else if (*args != 0) {
+		puts("Usage: handoff [on|off]\n");
+		return;
+	}
+
+	sys_printf("Handoff is %s.\n",sync_handoff?"on":"off");
+}
+
+/*** Print target and achieved share of a process ***/
+// Shares are shown in 0.1% units
+void put_share(SHARE_ROW *r, uint32_t total_tickets, uint32_t total_us) {
+	uint64_t share;
+
+	if (r->is_console) puts("-\t");
+	else sys_printf("%d\t",r->pid);
+
+	share = (uint64_t)r->tickets*1000;
+	div64_32(&share, total_tickets);
+	sys_printf("%d\t%d.%d%%\t",r->tickets,(uint32_t)share/10,(uint32_t)share%10);
+
+	share = (uint64_t)ns_to_us(r->window_ns)*1000;
+	div64_32(&share, total_us);
+	sys_printf("%d.%d%%\n",(uint32_t)share/10,(uint32_t)share%10);
+}
+
+/*** shares Command ***/
+// Format: shares [reset]
+// Compares each process's ticket share (target) with the share
+// of CPU time it received since the last reset (achieved)
+void command_shares(char *args) {
+	SHARE_ROW rows[LIST_MAX_PROCESSES+1];
+	PCB *p;
+	uint32_t total_tickets;
+	uint64_t total_ns;
+	uint32_t total_us;
+	uint32_t flags, n, i;
+
+	if (strcmp(args,"reset")==0) {
+		flags = spin_lock_irqsave(&sched_lock);
+		console.stride.window_ns = 0;
+		p = processq_next;
+		if (p != NULL) do {
+			p->stride.window_ns = 0;
+			p = p->next_PCB;
+		} while (p != processq_next);
+		spin_unlock_irqrestore(&sched_lock, flags);
+		return;
+	}
+	if (*args != 0) {
+		puts("Usage: shares [reset]\n");
+		return;
+	}
+
+	flags = spin_lock_irqsave(&sched_lock);
+
+	total_tickets = console.stride.tickets;
+	total_ns = console.stride.window_ns;
+	rows[0].is_console = TRUE;
+	rows[0].tickets = console.stride.tickets;
+	rows[0].window_ns = console.stride.window_ns;
+	n = 1;
+	p = processq_next;
+	if (p != NULL) do {
+		total_tickets += p->stride.tickets;
+		total_ns += p->stride.window_ns;
+		if (n <= LIST_MAX_PROCESSES) {
+			rows[n].is_console = FALSE;
+			rows[n].pid = p->pid;
+			rows[n].tickets = p->stride.tickets;
+			rows[n].window_ns = p->stride.window_ns;
+			n++;
+		}
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	total_us = ns_to_us(total_ns);
+	if (total_us == 0) total_us = 1;
+
+	puts("PID\tTickets\tTarget\tAchieved\n");
+	for (i=0; i<n; i++) put_share(&rows[i], total_tickets, total_us);
+}
+
+/*** rt Command ***/
+// Parameters, jobs and deadline misses of real-time processes
+void command_rt() {
+	RT_ROW rows[LIST_MAX_PROCESSES];
+	uint32_t flags, n = 0, util, i;
+	PCB *p;
+
+	flags = spin_lock_irqsave(&sched_lock);
+
+	p = processq_next;
+	if (p != NULL) do {
+		if (p->rt.enabled && n < LIST_MAX_PROCESSES) {
+			rows[n].pid = p->pid;
+			rows[n].period_us = ns_to_us(p->rt.period_ns);
+			rows[n].budget_us = ns_to_us(p->rt.budget_ns);
+			rows[n].deadline_us = ns_to_us(p->rt.deadline_ns);
+			rows[n].jobs = p->rt.jobs;
+			rows[n].misses = p->rt.misses;
+			n++;
 		}
-		
-		sys_printf("%c\t%x\t%x\t%x\t%x\n",
-					s,
-					p->mem.page_directory,	
-					(p->mem.end_code - p->mem.start_code + 1),
-					(p->mem.start_stack - p->cpu.esp),
-					(p->mem.brk - p->mem.start_brk));
 		p = p->next_PCB;
-	} while (p != begin_queue);
+	} while (p != processq_next);
+	util = rt_utilization(NULL);
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	if (n == 0) {
+		puts("rt: No real-time processes.\n");
+		return;
+	}
+
+	puts("PID\tPeriod\tBudget\tDeadln\tJobs\tMisses\t(us)\n");
+	for (i=0; i<n; i++)
+		sys_printf("%d\t%d\t%d\t%d\t%d\t%d\n",rows[i].pid,
+				rows[i].period_us, rows[i].budget_us, rows[i].deadline_us,
+				rows[i].jobs, rows[i].misses);
+	sys_printf("Utilization: %d/%d per mille\n",util,RT_MAX_UTIL);
+}
+
+/*** cpus Command ***/
+// Per-CPU view: what runs where and how often the CPUs switch or
+// steal; then the timer ticks, the share of them that returned at
+// once (fast), the mean cost of a tick in TSC cycles, for fast
+// ticks and for ticks that went on to schedule (full), and the
+// mean cost of a context switch (switch_context) in TSC cycles
+void command_cpus() {
+	extern CPU cpus[];
+	uint32_t pids[MAX_CPUS];
+	uint32_t i, flags;
+	uint64_t fast, full, pct, sw;
+	CPU *c;
+
+	// what runs where; the current process of another CPU may
+	// end and be freed unless sched_lock is held
+	flags = spin_lock_irqsave(&sched_lock);
+	for (i=0; i<get_cpu_count(); i++)
+		pids[i] = (cpus[i].current == NULL ? 0 : cpus[i].current->pid);
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	puts("CPU\tAPIC\tPID\tSwitch\tSteals\tIdle(ms)\n");
+	for (i=0; i<get_cpu_count(); i++) {
+		c = &cpus[i];
+		sys_printf("%d\t%d\t%d\t%d\t%d\t",c->id,c->apic_id,pids[i],
+				c->stats.switches,c->stats.steals);
+		// the BSP idles in the console, which is not idle time,
+		// except while the console waits (see idle_context)
+		sys_printf("%d\n",ns_to_ms(c->idle_pcb.stats.user_ns));
+	}
+
+	puts("CPU\tTicks\tFast\tCycles/tick (fast, full)\tCycles/switch\n");
+	for (i=0; i<get_cpu_count(); i++) {
+		c = &cpus[i];
+		flags = spin_lock_irqsave(&sched_lock);
+		fast = c->stats.fast_cycles;
+		full = c->stats.full_cycles;
+		if (c->stats.fast_ticks != 0) div64_32(&fast, c->stats.fast_ticks);
+		if (c->stats.ticks != c->stats.fast_ticks) div64_32(&full, c->stats.ticks - c->stats.fast_ticks);
+		pct = (uint64_t)c->stats.fast_ticks*100;
+		if (c->stats.ticks != 0) div64_32(&pct, c->stats.ticks);
+		sw = c->stats.switch_cycles;
+		if (c->stats.switches != 0) div64_32(&sw, c->stats.switches);
+		spin_unlock_irqrestore(&sched_lock, flags);
+		sys_printf("%d\t%d\t%d%%\t%d, %d\t\t%d\n",c->id,c->stats.ticks,(uint32_t)pct,
+				(uint32_t)fast,(uint32_t)full,(uint32_t)sw);
+	}
 }
 
+/*** gangs Command ***/
+// Format: gangs [reset]
+// Per gang: members, rounds on a CPU, member dispatches, CPU time
+// and throughput (mutex unlocks and semaphore UPs per second)
+// since the last reset
+void command_gangs(char *args) {
+	extern GANG_STATS gang_stats[MAX_GANGS];
+	extern uint64_t gang_stats_since;
+	uint32_t members[MAX_GANGS];
+	uint32_t ids[LIST_MAX_PROCESSES];
+	GANG_STATS rows[LIST_MAX_PROCESSES];
+	uint32_t g, n, i, elapsed_ms, flags;
+	uint64_t rate;
+	PCB *p;
+
+	if (strcmp(args,"reset")==0) {
+		flags = spin_lock_irqsave(&sched_lock);
+		for (g=0; g<MAX_GANGS; g++) {
+			gang_stats[g].rounds = 0;
+			gang_stats[g].dispatches = 0;
+			gang_stats[g].sync_ops = 0;
+			gang_stats[g].cpu_ns = 0;
+		}
+		gang_stats_since = get_uptime_ns();
+		spin_unlock_irqrestore(&sched_lock, flags);
+		return;
+	}
+	if (*args != 0) {
+		puts("Usage: gangs [reset]\n");
+		return;
+	}
+
+	flags = spin_lock_irqsave(&sched_lock);
+
+	for (g=0; g<MAX_GANGS; g++) members[g] = 0;
+	p = processq_next;
+	if (p != NULL) do {
+		if (p->state != TERMINATED) members[gang_of(p)]++;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	n = 0;
+	for (g=1; g<MAX_GANGS && n<LIST_MAX_PROCESSES; g++) {
+		if (members[g] == 0 && gang_stats[g].rounds == 0) continue;
+		ids[n] = g;
+		rows[n].rounds = gang_stats[g].rounds;
+		rows[n].dispatches = gang_stats[g].dispatches;
+		rows[n].sync_ops = gang_stats[g].sync_ops;
+		rows[n].cpu_ns = gang_stats[g].cpu_ns;
+		n++;
+	}
+
+	elapsed_ms = ns_to_ms(get_uptime_ns() - gang_stats_since);
+	if (elapsed_ms == 0) elapsed_ms = 1;
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	if (n == 0) {
+		puts("gangs: No process groups.\n");
+		return;
+	}
+
+	puts("Gang\tMembers\tRounds\tDisp\tCPU(ms)\tOps\tOps/s\n");
+	for (i=0; i<n; i++) {
+		g = ids[i];
+		if (g >= GANG_SHM) sys_printf("shm %d\t",g-GANG_SHM);
+		else sys_printf("%d\t",g);
+
+		rate = (uint64_t)rows[i].sync_ops*1000;
+		div64_32(&rate, elapsed_ms);
+		sys_printf("%d\t%d\t%d\t%d\t%d\t%d\n",members[g],rows[i].rounds,
+				rows[i].dispatches,ns_to_ms(rows[i].cpu_ns),
+				rows[i].sync_ops,(uint32_t)rate);
+	}
+}
+
+/*** sched Command ***/
+// Format: sched [policy]
+// Switches the scheduling policy and resets its statistics; with
+// no policy, shows the current one: throughput (processes ended
+// per minute), mean and 99th percentile wake up to run latency,
+// and context switches per second, since the last switch
+void command_sched(char *args) {
+	extern SCHED_POLICY sched_policies[N_SCHED_POLICIES];
+	extern SCHED_POLICY *sched_policy;
+	extern SCHED_STATS sched_stats;
+	SCHED_STATS st;
+	uint32_t i, elapsed_ms, seen, p99, flags;
+	uint64_t v;
+
+	if (*args != 0) {
+		if (!set_sched_policy(args)) {
+			puts("Usage: sched [");
+			for (i=0; i<N_SCHED_POLICIES; i++)
+				sys_printf("%s%s",sched_policies[i].name,(i==N_SCHED_POLICIES-1?"]\n":"|"));
+		}
+		return;
+	}
+
+	// a copy, taken under sched_lock (the CPUs update it there)
+	flags = spin_lock_irqsave(&sched_lock);
+	st.since = sched_stats.since;
+	st.completed = sched_stats.completed;
+	st.switches = sched_stats.switches;
+	st.wakeups = sched_stats.wakeups;
+	st.wake_ns = sched_stats.wake_ns;
+	for (i=0; i<WAKE_HIST_BUCKETS; i++) st.wake_hist[i] = sched_stats.wake_hist[i];
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	elapsed_ms = ns_to_ms(get_uptime_ns() - st.since);
+	if (elapsed_ms == 0) elapsed_ms = 1;
+
+	sys_printf("Policy: %s (for %d s)\n",sched_policy->name,elapsed_ms/1000);
+
+	v = (uint64_t)st.completed*60000;
+	div64_32(&v, elapsed_ms);
+	sys_printf("Throughput: %d processes/min (%d ended)\n",(uint32_t)v,st.completed);
+
+	v = (uint64_t)st.switches*1000;
+	div64_32(&v, elapsed_ms);
+	sys_printf("Switches: %d/s\n",(uint32_t)v);
+
+	if (st.wakeups == 0) puts("Wake up latency: no wake ups.\n");
+	else {
+		v = st.wake_ns;
+		div64_32(&v, st.wakeups);
+
+		// smallest bucket bound covering 99% of the wake ups
+		seen = 0;
+		for (i=0; i<WAKE_HIST_BUCKETS-1; i++) {
+			seen += st.wake_hist[i];
+			if ((uint64_t)seen*100 >= (uint64_t)st.wakeups*99) break;
+		}
+		p99 = 1 << i;
+
+		sys_printf("Wake up latency: mean %d us, p99 < %d us (%d wake ups)\n",
+				ns_to_us(v),p99,st.wakeups);
+	}
+}
+
+/*** quantum Command ***/
+// Format: quantum [microseconds]
+// Sets the default time slice of the current policy; with no
+// argument, shows it. Processes that chose their own slice
+// (setquantum) keep it
+void command_quantum(char *args) {
+	extern SCHED_POLICY *sched_policy;
+	uint32_t us;
+
+	if (*args != 0) {
+		if (!is_pos_number(args) || (us = atoi(args)) == 0 || us > MAX_QUANTUM_US) {
+			sys_printf("Usage: quantum [1-%d us]\n",MAX_QUANTUM_US);
+			return;
+		}
+		sched_policy->quantum_us = us;
+	}
+
+	sys_printf("Quantum of %s: %d us\n",sched_policy->name,sched_policy->quantum_us);
+}
+
+/*** loader Command ***/
+// Programs waiting for the loader, and for the images read so
+// far: how long they were queued before the read started (mean
+// and longest), how long the read took (unpacking included),
+// the read throughput, and the bytes read against the bytes of
+// program they gave (packed images are smaller, see unpack.c)
+void command_loader() {
+	extern LOAD_STATS load_stats;
+	LOAD_STATS st;
+	uint32_t waiting = 0, flags;
+	uint64_t v;
+	PCB *p;
+
+	// the loader updates its statistics under sched_lock
+	flags = spin_lock_irqsave(&sched_lock);
+
+	p = processq_next;
+	if (p != NULL) do {
+		if (p->state == NEW || p->state == LOADING) waiting++;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	st.loads = load_stats.loads;
+	st.failures = load_stats.failures;
+	st.queue_ns = load_stats.queue_ns;
+	st.max_queue_ns = load_stats.max_queue_ns;
+	st.read_ns = load_stats.read_ns;
+	st.sectors = load_stats.sectors;
+	st.bytes = load_stats.bytes;
+	st.packed = load_stats.packed;
+	st.unpack_ns = load_stats.unpack_ns;
+	st.elf = load_stats.elf;
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	sys_printf("Waiting: %d\tLoaded: %d\tFailed: %d\n",waiting,st.loads,st.failures);
+
+	if (st.loads != 0) {
+		v = st.queue_ns;
+		div64_32(&v, st.loads);
+		sys_printf("Queued: mean %d us, max %d us\n",ns_to_us(v),ns_to_us(st.max_queue_ns));
+
+		v = st.read_ns;
+		div64_32(&v, st.loads);
+		sys_printf("Read: mean %d us",ns_to_us(v));
+
+		v = st.sectors*512*1000000; // bytes per second
+		div64_32(&v, ns_to_us(st.read_ns) == 0 ? 1 : ns_to_us(st.read_ns));
+		sys_printf(", %d KB/s\n",(uint32_t)v/1024);
+
+		// packed and ELF images take fewer sectors than they fill
+		sys_printf("Bytes: %d KB read for %d KB of programs\n",
+			   (uint32_t)(st.sectors/2),(uint32_t)(st.bytes/1024));
+		if (st.packed != 0) {
+			v = st.unpack_ns;
+			div64_32(&v, st.packed);
+			sys_printf("Packed: %d images, unpacking mean %d us\n",st.packed,ns_to_us(v));
+		}
+		if (st.elf != 0) sys_printf("ELF: %d images\n",st.elf);
+	}
+}
+
+/*** reaper Command ***/
+// Processes freed by the reaper, in how many batches (and the
+// largest), the frames of their address spaces and the bitmap
+// updates that freed them, and the time spent per process
+void command_reaper() {
+	extern REAP_STATS reap_stats;
+	uint64_t v;
+
+	sys_printf("Reaped: %d\tBatches: %d\tLargest: %d\n",reap_stats.reaped,reap_stats.batches,reap_stats.max_batch);
+	sys_printf("Frames: %d in %d runs\n",reap_stats.frames,reap_stats.runs);
+
+	if (reap_stats.reaped != 0) {
+		v = reap_stats.free_ns;
+		div64_32(&v, reap_stats.reaped);
+		sys_printf("Free: mean %d us, max %d us\n",ns_to_us(v),ns_to_us(reap_stats.max_free_ns));
+	}
+}
+
+/*** lspci Command ***/
+// The PCI functions found at boot (see init_pci)
+void command_lspci() {
+	extern PCI_FUNCTION pci_functions[MAX_PCI_FUNCTIONS];
+	extern uint32_t n_pci_functions;
+	PCI_FUNCTION *p;
+	uint32_t i;
+
+	puts("Bus:Dev.Fn\tVendor:Device\tClass\tIRQ\n");
+	for (i=0; i<n_pci_functions; i++) {
+		p = &pci_functions[i];
+		sys_printf("%d:%d.%d\t\t%x:%x\t%x.%x",p->bus,p->dev,p->fn,p->vendor,p->device,p->class,p->subclass);
+		if (p->irq == 0 || p->irq > 15) puts("\t-\n");
+		else sys_printf("\t%d\n",p->irq);
+	}
+}
+
+/*** ls Command ***/
+// Files on the disk, with their size and extent
+void command_ls() {
+	extern FS_SUPER fs_super;
+	extern bool fs_mounted;
+	FS_DIRENT dir[FS_DIRENTS_PER_SECTOR];
+	uint32_t i, j;
+
+	if (!fs_mounted) {
+		puts("ls: No filesystem on the disk.\n");
+		return;
+	}
+
+	puts("Name\t\tBytes\tLBA\tSectors\n");
+	for (i=0; i<fs_super.dir_sectors; i++) {
+		if (bcache_read(fs_super.dir_LBA + i, 1, (uint8_t *)dir) != NO_ERROR) {
+			puts("ls: Error reading the directory.\n");
+			return;
+		}
+		for (j=0; j<FS_DIRENTS_PER_SECTOR; j++) {
+			if (dir[j].name[0] == 0) continue;
+			// names are padded with zeros: short ones get another tab
+			sys_printf("%s\t%s%d\t%d\t%d\n",dir[j].name,(dir[j].name[7] == 0 ? "\t" : ""),
+				   dir[j].size,dir[j].LBA,dir[j].sectors);
+		}
+	}
+	sys_printf("%d files\n",fs_super.n_files);
+}
 
 /*** run Command ***/
-// Format: run [start LBA] [sector count]
+// Format: run [program] [tickets]
+//     or: run [start LBA] [sector count] [tickets]
+// A program is a file on the disk (see fs.c); exactly its
+// sectors are loaded. tickets is optional (default
+// DEFAULT_TICKETS)
 void command_run(char *args) {
-	uint32_t LBA;
+	char name[FS_NAME_LEN];
+	uint32_t LBA, size, i;
 	uint32_t n_sectors;
+	uint32_t tickets = DEFAULT_TICKETS;
 	
-	// get start LBA
 	if (*args==0 || *args==' ') {
-		puts("Usage: run [start LBA] [sector count]\n");
+		puts("Usage: run [program | start LBA sector count] [tickets]\n");
 		return;
 	}
+
+	// a program by name
 	if (is_pos_number(args)==FALSE) {
-		puts("run: Invalid start LBA.\n");
-		return;
-	}
-	LBA = atoi(args);
+		for (i=0; args[i]!=0 && args[i]!=' '; i++) {
+			if (i == FS_NAME_LEN-1) {
+				puts("run: Program name too long.\n");
+				return;
+			}
+			name[i] = args[i];
+		}
+		name[i] = 0;
 
-	// get sector count
-	while (*args!=0 && *args!=' ') args++;	// goto end of first argument
-	args++;					// second argument from next position
-	if (*args==0 || *args==' ') {
-		puts("Usage: run [start LBA] [sector count]\n");
-		return;
+		if (!fs_lookup(name, &LBA, &size)) {
+			sys_printf("run: %s: No such program.\n",name);
+			return;
+		}
+		if (size == 0) {
+			sys_printf("run: %s is empty.\n",name);
+			return;
+		}
+		n_sectors = (size + 511)/512;
+		args += i;
 	}
-	if (!is_pos_number(args)) {
-		puts("run: Invalid sector count.\n");
-		return;
+	else {
+		// a program by LBA and sector count
+		LBA = atoi(args);
+
+		// get sector count
+		while (*args!=0 && *args!=' ') args++;	// goto end of first argument
+		args++;					// second argument from next position
+		if (*args==0 || *args==' ') {
+			puts("Usage: run [program | start LBA sector count] [tickets]\n");
+			return;
+		}
+		if (!is_pos_number(args)) {
+			puts("run: Invalid sector count.\n");
+			return;
+		}
+		n_sectors = atoi(args);
+		if (n_sectors == 0) {
+			puts("run: Invalid sector count.\n");
+			return;
+		}
 	}
-	n_sectors = atoi(args);
-	if (n_sectors == 0) {
-		puts("run: Invalid sector count.\n");
-		return;
+
+	// get tickets, if any
+	while (*args!=0 && *args!=' ') args++;	// goto end of the program argument(s)
+	if (*args==' ') {
+		args++;				// third argument from next position
+		if (!is_pos_number(args) || atoi(args) == 0 || atoi(args) > MAX_TICKETS) {
+			sys_printf("run: Tickets must be 1 to %d.\n",MAX_TICKETS);
+			return;
+		}
+		tickets = atoi(args);
 	}
 
-	run(LBA,n_sectors);	// in runprogram.c
+	run(LBA,n_sectors,tickets);	// in runprogram.c
 }
 
 /*** Process a command typed by the user ***/
@@ -236,6 +1215,93 @@ uint8_t process_command(char *cmd_buffer, uint16_t cmd_length) {
 		else command_ps(); 
 	}
 
+	// top: live view of CPU usage
+	else if (strcmp(cmd,"top")==0) {
+		if (*args != 0) puts("top: What to do with the arguments?\n");
+		else command_top(); 
+	}
+
+	// shares: target vs achieved CPU shares
+	else if (strcmp(cmd,"shares")==0) {
+		command_shares(args);
+	}
+
+	// rt: real-time processes and deadline misses
+	else if (strcmp(cmd,"rt")==0) {
+		if (*args != 0) puts("rt: What to do with the arguments?\n");
+		else command_rt(); 
+	}
+
+	// cpus: per-CPU scheduling counters
+	else if (strcmp(cmd,"cpus")==0) {
+		if (*args != 0) puts("cpus: What to do with the arguments?\n");
+		else command_cpus(); 
+	}
+
+	// handoff: directed yield to woken mutex/semaphore waiters
+	else if (strcmp(cmd,"handoff")==0) {
+		command_handoff(args);
+	}
+
+	// gangs: groups of cooperating processes
+	else if (strcmp(cmd,"gangs")==0) {
+		command_gangs(args);
+	}
+
+	// sched: scheduling policy and its statistics
+	else if (strcmp(cmd,"sched")==0) {
+		command_sched(args);
+	}
+
+	// loader: programs waiting to be read from disk
+	else if (strcmp(cmd,"loader")==0) {
+		if (*args != 0) puts("loader: What to do with the arguments?\n");
+		else command_loader(); 
+	}
+
+	// diskbench: time the read modes against each other
+	else if (strcmp(cmd,"diskbench")==0) {
+		command_diskbench(args);
+	}
+
+	// diskiops: random reads per second in each mode
+	else if (strcmp(cmd,"diskiops")==0) {
+		command_diskiops(args);
+	}
+
+	// iosched: I/O scheduler and its statistics
+	else if (strcmp(cmd,"iosched")==0) {
+		command_iosched(args);
+	}
+
+	// bcache: buffer cache statistics
+	else if (strcmp(cmd,"bcache")==0) {
+		if (*args != 0) puts("bcache: What to do with the arguments?\n");
+		else command_bcache(); 
+	}
+
+	// disk: PIO or DMA reads, and their statistics
+	else if (strcmp(cmd,"disk")==0) {
+		command_disk(args);
+	}
+
+	// reaper: processes freed in the background
+	else if (strcmp(cmd,"reaper")==0) {
+		if (*args != 0) puts("reaper: What to do with the arguments?\n");
+		else command_reaper(); 
+	}
+
+	// quantum: default time slice of the policy
+	else if (strcmp(cmd,"quantum")==0) {
+		command_quantum(args);
+	}
+
+	// syncstat: mutex and semaphore wait times
+	else if (strcmp(cmd,"syncstat")==0) {
+		if (*args != 0) puts("syncstat: What to do with the arguments?\n");
+		else command_syncstat(); 
+	}
+
 	// shutdown
 	else if (strcmp(cmd,"shutdown")==0) {
 		if (*args != 0) puts("shutdown: What to do with the arguments?\n");
@@ -255,6 +1321,16 @@ uint8_t process_command(char *cmd_buffer, uint16_t cmd_length) {
 	else if (strcmp(cmd,"diskdump")==0) {
 		command_diskdump(args);	
 	}
+	// lspci: PCI functions
+	else if (strcmp(cmd,"lspci")==0) {
+		if (*args != 0) puts("lspci: What to do with the arguments?\n");
+		else command_lspci();
+	}
+	// ls: files on the disk
+	else if (strcmp(cmd,"ls")==0) {
+		if (*args != 0) puts("ls: What to do with the arguments?\n");
+		else command_ls();
+	}
 	// run: run a program in the backgroun
 	else if (strcmp(cmd,"run")==0) {
 		command_run(args);	
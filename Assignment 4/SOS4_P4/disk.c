@@ -2,13 +2,41 @@
 // Everything about reading/writing to the disk
 // We are implementing the very basic PIO method
 // as explained in http://wiki.osdev.org/ATA_PIO_Mode
-// On the real world, DMA is the preferred method
+// and, when the IDE controller is a PCI bus master (the
+// PIIX of QEMU is), DMA as explained in
+// http://wiki.osdev.org/ATA/ATAPI_using_DMA
 //
-// We will use the LBA28 addressing mode 
+// We will use the LBA28 addressing mode, and LBA48 for the
+// sectors beyond its reach
+//
+// Requests wait for the channel in the I/O scheduler (see
+// iosched.c), which also merges neighbouring ones
 
 #include "kernel_only.h"
 
-uint32_t total_sectors;	// total number of LBA28 addressable sectors
+extern spinlock_t sched_lock;	// from scheduler.c
+extern PDE *k_page_directory;	// from lmemman.c
+extern uint16_t virtio_base;	// from virtio.c
+extern uint32_t virtio_sectors;	// from virtio.c
+extern volatile uint8_t *ahci_port;	// from ahci.c
+extern uint32_t ahci_sectors;	// from ahci.c
+
+uint32_t total_sectors;	// total number of addressable sectors (LBA48 ones too, up to 2TB)
+bool lba48 = FALSE;	// the drive has the LBA48 (EXT) commands
+uint8_t multiple_sectors = 0;	// sectors per DRQ block of READ MULTIPLE; 0 if not set up
+spinlock_t disk_lock;	// one command at a time on the ATA channel
+
+uint16_t bmide_base = 0;	// bus master registers of the primary channel; 0 if no DMA
+uint8_t disk_mode = DISK_PIO;	// how read_disk moves the data (see set_disk_mode)
+DISK_STATS disk_stats[N_DISK_MODES];	// reads done in each mode
+char *disk_mode_names[N_DISK_MODES] = {"pio", "dma", "multiple", "virtio", "ahci"};
+
+DISK_REQUEST *disk_active = NULL;	// the chain on the channel; NULL if idle
+bool disk_irq = FALSE;			// requests complete through IRQ 14 (see init_disk_interrupts)
+
+// physical region descriptors of a DMA read; the table must
+// not cross a 64KB boundary, which the alignment ensures
+PRD prd_table[MAX_PRDS] __attribute__ ((aligned (MAX_PRDS*sizeof(PRD))));
 
 /*** Initialize the disk (get total_sectors) ***/
 // Disk I/O port address on primary ATA bus
@@ -57,6 +85,16 @@ void init_disk(void) {
 		}
 		// no. of LBA 28-bit addressable sectors
 		total_sectors = ((uint32_t)data[60] | ((uint32_t)data[61]<<16)); 
+
+		// LBA48 (word 83, bit 10): words 100-103 count the sectors
+		if (data[83] & 0x0400) {
+			lba48 = TRUE;
+			if (data[102] != 0 || data[103] != 0) total_sectors = 0xFFFFFFFF;
+			else total_sectors = ((uint32_t)data[100] | ((uint32_t)data[101]<<16));
+		}
+
+		init_disk_multiple(data[47] & 0xFF); // largest DRQ block of READ MULTIPLE
+		if (data[49] & 0x0100) init_disk_dma(); // drive can do DMA
 	}
 	else {
 		total_sectors = 0;
@@ -64,7 +102,113 @@ void init_disk(void) {
 	
 }
 
-/*** Read up to 256 sectors starting from given 28-bit LBA ***/
+/*** Wait 400ns ***/
+// The time the drive may take to put up a valid status after a
+// command; reading the alternate status register (0x3F6) four
+// times does it, without acknowledging an interrupt
+void ata_delay_400ns(void) {
+	port_read_byte(0x3F6); port_read_byte(0x3F6); port_read_byte(0x3F6); port_read_byte(0x3F6);
+}
+
+/*** Set up READ MULTIPLE ***/
+// SET MULTIPLE MODE (0xC6) tells the drive how many sectors to
+// move per DRQ block; max is what IDENTIFY allows (0: none)
+void init_disk_multiple(uint8_t max) {
+	uint8_t n = (max > MAX_MULTIPLE_SECTORS ? MAX_MULTIPLE_SECTORS : max);
+	uint8_t status;
+
+	// a power of two no larger than max
+	while (n & (n - 1)) n &= n - 1;
+	if (n < 2) return; // no better than READ SECTORS
+
+	port_write_byte(0x1F6, 0xA0);	// select master on primary bus
+	port_write_byte(0x1F2, n);	// sectors per block
+	port_write_byte(0x1F7, 0xC6);	// send SET MULTIPLE MODE command
+	ata_delay_400ns();
+
+	do {
+		status = port_read_byte(0x1F7);
+	} while (status & 0x80); // until BSY (busy) bit is cleared
+
+	if (status & 0x21) return; // ERR or DF: not taken
+
+	multiple_sectors = n;
+	disk_mode = DISK_PIO_MULTIPLE;
+}
+
+/*** Find the bus master IDE controller ***/
+// A PCI mass storage controller (class 0x01) of the IDE kind
+// (subclass 0x01); BAR4 holds the I/O port base of the bus
+// master registers, eight ports per channel:
+// base+0: Command (bit 0 starts/stops, bit 3 set = write to memory)
+// base+2: Status (bit 0 active, bit 1 error, bit 2 interrupt;
+//	   bits 1 and 2 are cleared by writing 1 to them)
+// base+4: Physical address of the PRD table
+void init_disk_dma(void) {
+	uint8_t bus, dev, fn;
+	uint32_t bar4, command;
+
+	if (!pci_find_class(0x01, 0x01, &bus, &dev, &fn)) return;
+
+	bar4 = pci_config_read(bus, dev, fn, 0x20);
+	if (!(bar4 & 0x1)) return; // not in I/O space
+
+	// I/O space (bit 0) and bus master (bit 2) enable
+	command = pci_config_read(bus, dev, fn, 0x04);
+	pci_config_write(bus, dev, fn, 0x04, command | 0x5);
+
+	bmide_base = (uint16_t)(bar4 & 0xFFFC);
+	disk_mode = DISK_DMA;
+}
+
+/*** Is a mode usable? ***/
+bool disk_mode_available(uint8_t mode) {
+	if (mode == DISK_DMA) return (bmide_base != 0);
+	if (mode == DISK_PIO_MULTIPLE) return (multiple_sectors != 0);
+	if (mode == DISK_VIRTIO) return (virtio_base != 0);
+	if (mode == DISK_AHCI) return (ahci_port != NULL);
+	return (mode == DISK_PIO);
+}
+
+/*** Sectors of the disk a mode reads from ***/
+// DISK_DEFAULT is disk_mode
+uint32_t disk_capacity(uint8_t mode) {
+	if (mode == DISK_DEFAULT) mode = disk_mode;
+	if (mode == DISK_VIRTIO) return virtio_sectors;
+	if (mode == DISK_AHCI) return ahci_sectors;
+	return total_sectors;
+}
+
+/*** Do reads in a mode complete through an interrupt? ***/
+// virtio and AHCI have their own; the ATA channel once
+// init_disk_interrupts has run. DISK_DEFAULT is disk_mode
+bool disk_irq_ready(uint8_t mode) {
+	if (mode == DISK_DEFAULT) mode = disk_mode;
+	if (mode == DISK_VIRTIO || mode == DISK_AHCI) return disk_mode_available(mode);
+	return disk_irq;
+}
+
+/*** Choose how read_disk moves the data ***/
+// Returns FALSE if the drive or controller cannot do mode. The
+// buffer cache knows blocks by LBA only, so it is emptied when
+// the disk behind read_disk may have changed
+bool set_disk_mode(uint8_t mode) {
+	uint32_t flags;
+	uint8_t old;
+
+	if (!disk_mode_available(mode)) return FALSE;
+
+	flags = spin_lock_irqsave(&disk_lock);
+	old = disk_mode;
+	disk_mode = mode;
+	spin_unlock_irqrestore(&disk_lock, flags);
+
+	if (mode != old) bcache_flush(); // takes bcache_lock, which comes before disk_lock
+
+	return TRUE;
+}
+
+/*** Read up to 256 sectors starting from given LBA ***/
 // n_sectors = 0 means 256
 // buffer must be able to hold the data; otherwise overflow (DANGER!)
 // return codes: DISK_ERROR_ERR, DISK_ERROR_DF and NO_ERROR,
@@ -81,14 +225,179 @@ void init_disk(void) {
 //	7: 	BSY (indicates the drive is preparing to send/receive data
 //		(wait for it to clear);in case of 'hang' (it never clears),
 //		do a software reset) 
+//
+// buffer is a logical address in the current address space;
+// a buffer at an odd address is never read with DMA
+//
+// The request is queued (see elevator_add) and the caller
+// waits (WAITING) until the IRQ 14 handler reports it done;
+// other processes run
+// meanwhile. Must be called where the caller can block: in a
+// kernel thread, the console or a system call
 uint8_t read_disk(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
+	return read_disk_with(DISK_DEFAULT, LBA, n_sectors, buffer);
+}
+
+/*** Read sectors in a given mode ***/
+// As read_disk, but mode (if not DISK_DEFAULT) is used instead
+// of disk_mode; for comparing the modes (see command_diskbench).
+// The range is checked against the disk the mode reads from
+// (virtio, AHCI or the ATA drive); polled reads are ATA only
+uint8_t read_disk_with(uint8_t mode, uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
+	DISK_REQUEST req;
+	uint32_t capacity;
+	bool irq;
+
+	if (mode == DISK_DEFAULT) mode = disk_mode;
+	if (!disk_mode_available(mode)) mode = DISK_PIO;
+	irq = disk_irq_ready(mode);
+	capacity = (irq ? disk_capacity(mode) : total_sectors);
+
+	if (LBA >= capacity) return DISK_ERROR_LBA_OUTSIDE_RANGE;
+	if (LBA + (n_sectors == 0 ? 256 : n_sectors) > capacity) return DISK_ERROR_SECTORCOUNT_TOO_BIG;
+
+	if (!irq) return read_disk_polled(mode, LBA, n_sectors, buffer);
+
+	req.waiter = current_process;
+	submit_disk_request(&req, mode, LBA, n_sectors, buffer);
+	wait_disk_request(&req);
+
+	return req.status;
+}
+
+/*** Queue a read without waiting for it ***/
+// req must stay where it is until done is set; req->waiter
+// (NULL if nobody waits yet) is woken up when it is. mode is
+// as in read_disk_with. The range must have been checked
+void submit_disk_request(DISK_REQUEST *req, uint8_t mode, uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
+	uint32_t flags;
+
+	req->LBA = LBA;
+	req->n_sectors = n_sectors;
+	req->buffer = buffer;
+	// kernel memory is in every address space; the kernel's
+	// own cannot go away before the read starts
+	if ((uint32_t)buffer >= KERNEL_BASE) req->page_directory = (uint32_t)k_page_directory - KERNEL_BASE;
+	else req->page_directory = read_CR3();
+	req->sectors_left = (n_sectors == 0 ? 256 : n_sectors);
+	req->done = FALSE;
+	req->status = DISK_ERROR;
+	req->busy_ns = 0;
+	req->queued_at = get_uptime_ns();
+	req->chain_sectors = req->sectors_left;
+	req->merged = NULL;
+	req->next = NULL;
+	req->waiters = NULL;
+
+	flags = spin_lock_irqsave(&disk_lock);
+	req->mode = (mode == DISK_DEFAULT ? disk_mode : mode);
+	if (!disk_mode_available(req->mode)) req->mode = DISK_PIO;
+	if (req->mode == DISK_DMA && ((uint32_t)buffer & 0x1)) req->mode = DISK_PIO;
+	if (req->mode == DISK_VIRTIO) virtio_submit(req); // not on the ATA channel
+	else if (req->mode == DISK_AHCI) ahci_submit(req);
+	else {
+		elevator_add(req);
+		if (disk_active == NULL) start_next_disk_request();
+	}
+	spin_unlock_irqrestore(&disk_lock, flags);
+}
+
+/*** Wait until a request is done ***/
+// The calling process becomes the waiter if there is none, or
+// joins the other waiters (a node on its stack); it is then
+// WAITING until the handler that completes the request wakes
+// them all up
+void wait_disk_request(DISK_REQUEST *req) {
+	uint32_t flags = spin_lock_irqsave(&disk_lock);
+	DISK_WAITER w;
+	bool linked = FALSE;
+
+	if (req->waiter == NULL) req->waiter = current_process;
+	else if (req->waiter != current_process && !req->done) {
+		w.process = current_process;
+		w.next = req->waiters;
+		req->waiters = &w;
+		linked = TRUE;
+	}
+	spin_unlock_irqrestore(&disk_lock, flags);
+
+	// the handler sets done before waking the waiters up; a
+	// wake up for anything else just goes round the loop
+	while (!req->done) kthread_wait();
+
+	// the handler walks the waiters with disk_lock held; w must
+	// stay where it is until it is done
+	if (linked) {
+		flags = spin_lock_irqsave(&disk_lock);
+		spin_unlock_irqrestore(&disk_lock, flags);
+	}
+}
+
+/*** Wake up the processes waiting for a request ***/
+// Both are read from the request before done is set, since its
+// owner may go on then. Called with disk_lock and sched_lock
+// held
+void wake_disk_waiters(PCB *waiter, DISK_WAITER *waiters) {
+	kthread_wake(waiter);
+	for (; waiters != NULL; waiters = waiters->next) kthread_wake(waiters->process);
+}
+
+/*** Read sectors by polling the drive ***/
+// What read_disk does until the IRQ 14 handler is in place;
+// the CPU waits for the drive the whole time
+uint8_t read_disk_polled(uint8_t mode, uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
+	uint32_t flags = spin_lock_irqsave(&disk_lock);
 	uint8_t status;
-	int i;
-	uint16_t sectors_to_read;
-	uint16_t *data = (uint16_t *)buffer;
+	uint64_t start, wait_ns = 0;
 
-	if (LBA >= total_sectors) return DISK_ERROR_LBA_OUTSIDE_RANGE;
-	if (LBA + n_sectors > total_sectors) return DISK_ERROR_SECTORCOUNT_TOO_BIG;
+	if (mode == DISK_DEFAULT) mode = disk_mode;
+	// virtio and AHCI reads complete only through their interrupts
+	if (!disk_mode_available(mode) || mode == DISK_VIRTIO || mode == DISK_AHCI) mode = DISK_PIO;
+	if (mode == DISK_DMA && ((uint32_t)buffer & 0x1)) mode = DISK_PIO;
+
+	start = get_uptime_ns();
+	if (mode == DISK_DMA) status = read_sectors_dma(LBA, n_sectors, buffer, &wait_ns);
+	else if (mode == DISK_PIO_MULTIPLE) status = read_sectors_multiple(LBA, n_sectors, buffer, &wait_ns);
+	else status = read_sectors_pio(LBA, n_sectors, buffer, &wait_ns);
+
+	if (status == NO_ERROR) {
+		disk_stats[mode].reads++;
+		disk_stats[mode].sectors += (n_sectors == 0 ? 256 : n_sectors);
+		disk_stats[mode].wait_ns += wait_ns;
+		disk_stats[mode].busy_ns += get_uptime_ns() - start - wait_ns;
+	}
+
+	spin_unlock_irqrestore(&disk_lock, flags);
+	return status;
+}
+
+/*** Send a read command to the drive ***/
+// command is 0x20 (READ SECTORS), 0xC4 (READ MULTIPLE) or 0xC8
+// (READ DMA); sectors LBA28 cannot reach are read with the EXT
+// version of the command, which takes each address and count
+// register twice: the high ("previous") bytes first
+void send_read_command(uint32_t LBA, uint8_t n_sectors, uint8_t command) {
+	uint32_t count = (n_sectors == 0 ? 256 : n_sectors);
+
+	if (lba48 && LBA + count > LBA28_LIMIT) {
+		port_write_byte(0x1F6, 0x40);			// LBA mode, master
+		port_write_byte(0x1F2,(uint8_t)(count>>8));	// high 8 bits of sector count
+		port_write_byte(0x1F3,(uint8_t)(LBA>>24));	// LBA bits 24-31
+		port_write_byte(0x1F4,0x00);			// LBA bits 32-39
+		port_write_byte(0x1F5,0x00);			// LBA bits 40-47
+		port_write_byte(0x1F2,(uint8_t)count);		// low 8 bits of sector count
+		port_write_byte(0x1F3,(uint8_t)LBA);		// LBA bits 0-7
+		port_write_byte(0x1F4,(uint8_t)(LBA>>8));	// LBA bits 8-15
+		port_write_byte(0x1F5,(uint8_t)(LBA>>16));	// LBA bits 16-23
+
+		switch (command) {
+			case 0x20: command = 0x24; break;	// READ SECTORS EXT
+			case 0xC4: command = 0x29; break;	// READ MULTIPLE EXT
+			case 0xC8: command = 0x25; break;	// READ DMA EXT
+		}
+		port_write_byte(0x1F7,command);
+		return;
+	}
 
 	// LBA mode (bit 6) and highest four bits of LBA (bit 7 and 5 are always set)
 	port_write_byte(0x1F6, 0xE0 | ((LBA >> 24) & 0x0F)); 
@@ -98,15 +407,244 @@ uint8_t read_disk(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
 	port_write_byte(0x1F3,(uint8_t)LBA);		// low 8 bits of LBA
 	port_write_byte(0x1F4,(uint8_t)(LBA>>8));	// next 8 bits of LBA
 	port_write_byte(0x1F5,(uint8_t)(LBA>>16));	// next 8 bits of LBA
-	port_write_byte(0x1F7,0x20);			// send READ SECTORS command
+	port_write_byte(0x1F7,command);			// send the command
+}
+
+/*** Put a chain of requests on the channel ***/
+// One command reads the sectors of all the requests merged
+// into req. A DMA chain whose buffers cannot be described by
+// the PRD table is read with READ MULTIPLE (or READ SECTORS)
+// instead. Called with disk_lock held
+void start_disk_request(DISK_REQUEST *req) {
+	uint64_t start = get_uptime_ns();
+	uint8_t mode = req->mode;
+	uint8_t count = (uint8_t)req->chain_sectors; // 256 is written as 0
+	uint32_t n = 0;
+	DISK_REQUEST *r;
+
+	if (mode == DISK_DMA) {
+		for (r=req; r!=NULL; r=r->merged)
+			if (!add_prd_entries(&n, r->buffer, r->sectors_left*512, r->page_directory)) break;
+
+		if (r == NULL) prd_table[n-1].flags = 0x8000; // end of table
+		else mode = (multiple_sectors != 0 ? DISK_PIO_MULTIPLE : DISK_PIO);
+	}
+	for (r=req; r!=NULL; r=r->merged) r->mode = mode;
+
+	if (mode == DISK_DMA) {
+		port_write_byte(bmide_base, 0x00);	// stop any previous transfer
+		port_write_dword(bmide_base+4, (uint32_t)prd_table - KERNEL_BASE);
+		port_write_byte(bmide_base+2, 0x06);	// clear error and interrupt bits
+		port_write_byte(bmide_base, 0x08);	// transfer direction: into memory
+		send_read_command(req->LBA, count, 0xC8);
+		port_write_byte(bmide_base, 0x09);	// start, into memory
+	}
+	else if (mode == DISK_PIO_MULTIPLE) send_read_command(req->LBA, count, 0xC4);
+	else send_read_command(req->LBA, count, 0x20);
+
+	req->busy_ns += get_uptime_ns() - start;
+}
+
+/*** Start the next chain the I/O scheduler picks ***/
+// Called with disk_lock held, when the channel is idle
+void start_next_disk_request(void) {
+	disk_active = elevator_next();
+	if (disk_active != NULL) start_disk_request(disk_active);
+}
+
+/*** Take the finished chain off the channel ***/
+// Every request of the chain gets the status of req, is
+// accounted for and its waiter woken up; then the next chain
+// starts, if any. The owner of a request may go on as soon as
+// done is set, so the request is not used after that. Called
+// with disk_lock held
+void complete_disk_request(DISK_REQUEST *req) {
+	DISK_REQUEST *next;
+	DISK_WAITER *waiters;
+	PCB *waiter;
+	uint8_t mode = req->mode, status = req->status;
+	uint64_t busy = req->busy_ns, now = get_uptime_ns();
+
+	disk_active = NULL;
+	if (status == NO_ERROR) disk_stats[mode].busy_ns += busy;
+
+	spin_lock(&sched_lock);
+	for (; req != NULL; req = next) {
+		next = req->merged;
+		waiter = req->waiter;
+		waiters = req->waiters;
+
+		if (status == NO_ERROR) {
+			disk_stats[mode].reads++;
+			disk_stats[mode].sectors += (req->n_sectors == 0 ? 256 : req->n_sectors);
+			disk_stats[mode].wait_ns += now - req->queued_at - busy;
+		}
+		elevator_done(req, now);
+
+		req->status = status;
+		req->done = TRUE;
+		wake_disk_waiters(waiter, waiters);
+	}
+	spin_unlock(&sched_lock);
+
+	start_next_disk_request();
+}
+
+/*** Copy the sectors the drive has ready (PIO) ***/
+// One sector per DRQ with READ SECTORS, a block of them with
+// READ MULTIPLE; a block may end in one request of the chain
+// and go on in the next. Each buffer is in the address space
+// of its requester, which is loaded for the copy; the drive
+// interrupts again once the data is read. Returns TRUE when
+// the whole chain is read. Called with disk_lock held
+bool copy_sectors(DISK_REQUEST *req) {
+	uint32_t cr3 = read_CR3();
+	uint64_t start = get_uptime_ns();
+	uint32_t n = (req->mode == DISK_PIO_MULTIPLE ? multiple_sectors : 1);
+	uint32_t k;
+	uint16_t *data;
+	DISK_REQUEST *r = req;
+	int i;
+
+	while (n > 0) {
+		while (r != NULL && r->sectors_left == 0) r = r->merged;
+		if (r == NULL) break; // the last block is a short one
+
+		k = (r->sectors_left < n ? r->sectors_left : n);
+		data = (uint16_t *)r->buffer;
+		if (read_CR3() != r->page_directory) load_CR3(r->page_directory);
+		if (req->mode == DISK_PIO_MULTIPLE) port_read_words(0x1F0, data, k*256);
+		else {
+			for (i=0; i<256; i++) {
+				data[i] = port_read_word(0x1F0); // read one word (2 bytes)
+			}
+		}
+
+		r->buffer += k*512;
+		r->sectors_left -= k;
+		n -= k;
+	}
+	if (read_CR3() != cr3) load_CR3(cr3);
+
+	req->busy_ns += get_uptime_ns() - start;
+
+	while (r != NULL && r->sectors_left == 0) r = r->merged;
+	return (r == NULL);
+}
+
+/*** The disk (IRQ14) handler ***/
+asm("handler_disk_entry: \n"
+	"pushal\n"
+	// must reset the segment selectors before
+	// accessing any kernel data
+	"movl $0x10, %eax\n"
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"movl %eax, %fs\n"
+	"movl %eax, %gs\n"
+	"call disk_interrupt_handler\n"
+	"testl %eax, %eax\n"
+	"jz return_from_trap\n"
+	// a woken process should run here now (see timer.c)
+	"pushl %esp\n"
+	"call timer_interrupt_handler\n"
+	"addl $4, %esp\n"
+	"jmp return_from_trap\n"
+);
+
+// The drive raises the interrupt when a DMA transfer is over,
+// when PIO data is ready (it is copied right here), or on
+// an error. Reading the
+// status register acknowledges it. Returns TRUE if this CPU
+// must run the scheduler
+uint32_t disk_interrupt_handler() {
+	extern bool ioapic_active;	// from smp.c
+	DISK_REQUEST *req;
+	uint8_t status, bm_status = 0;
+
+	spin_lock(&disk_lock);
+
+	req = disk_active;
+	if (bmide_base != 0) bm_status = port_read_byte(bmide_base+2);
+
+	if (req != NULL && req->mode == DISK_DMA && (bm_status & 0x04)) {
+		port_write_byte(bmide_base, 0x00);	// stop
+		status = port_read_byte(0x1F7);
+		port_write_byte(bmide_base+2, 0x06);	// clear error and interrupt bits
+
+		if (bm_status & 0x02) req->status = DISK_ERROR;		// bus error
+		else if (status & 0x01) req->status = DISK_ERROR_ERR;	// ERR bit set
+		else if (status & 0x20) req->status = DISK_ERROR_DF;	// DF bit set
+		else req->status = NO_ERROR;
+
+		complete_disk_request(req);
+	}
+	else {
+		status = port_read_byte(0x1F7);
+		if (req != NULL && req->mode != DISK_DMA) {
+			if (status & 0x21) { // ERR or DF bit set
+				req->status = (status & 0x01) ? DISK_ERROR_ERR : DISK_ERROR_DF;
+				complete_disk_request(req);
+			}
+			else if (status & 0x08) { // DRQ bit set
+				if (copy_sectors(req)) {
+					req->status = NO_ERROR;
+					complete_disk_request(req);
+				}
+			}
+		}
+	}
+
+	spin_unlock(&disk_lock);
+
+	if (!ioapic_active) port_write_byte(0xA0,0x20); // IRQ14 is on the slave PIC
+	end_of_interrupt();
+
+	return this_cpu()->need_resched;
+}
+
+/*** Complete disk reads through IRQ 14 ***/
+// IRQ14 is mapped to interrupt 46 (see setup_PIC); smp.c
+// routes it through the I/O APIC when that is in use
+void init_disk_interrupts(void) {
+	if (total_sectors == 0) return;
+
+	install_interrupt_handler(46,handler_disk_entry,0x0008,0x8E);
+
+	port_write_byte(0x3F6, 0x00); // device control: nIEN clear, the drive interrupts
+
+	// unmask IRQ14 on the slave PIC and the cascade (IRQ2) on the master
+	port_write_byte(0xA1, port_read_byte(0xA1) & ~0x40);
+	port_write_byte(0x21, port_read_byte(0x21) & ~0x04);
+
+	disk_irq = TRUE;
+}
+
+/*** The READ SECTORS command ***/
+// Called with disk_lock held; *wait_ns is increased by the
+// time spent waiting for the drive (BSY set), the rest is
+// the CPU moving the data
+uint8_t read_sectors_pio(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer, uint64_t *wait_ns) {
+	uint8_t status;
+	int i;
+	uint16_t sectors_to_read;
+	uint16_t *data = (uint16_t *)buffer;
+	uint64_t start;
+
+	if (LBA >= total_sectors) return DISK_ERROR_LBA_OUTSIDE_RANGE;
+	if (LBA + n_sectors > total_sectors) return DISK_ERROR_SECTORCOUNT_TOO_BIG;
+
+	send_read_command(LBA, n_sectors, 0x20);	// READ SECTORS
 
 	sectors_to_read = (n_sectors==0)?256:n_sectors;
 
 	for (; sectors_to_read>0; sectors_to_read--) {
 		// poll for readiness
+		start = get_uptime_ns();
 		do {
 			status = port_read_byte(0x1F7);
 		} while (status & 0x80); // until BSY (busy) bit is cleared
+		*wait_ns += get_uptime_ns() - start;
 		while(1) {
 			if (status & 0x01) return DISK_ERROR_ERR; // ERR bit set
 			if (status & 0x02) return DISK_ERROR_DF;  // DF bit set
@@ -124,3 +662,135 @@ uint8_t read_disk(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer) {
 	}
 	return NO_ERROR;
 }
+
+/*** The READ MULTIPLE command ***/
+// The drive raises DRQ once per block of multiple_sectors
+// sectors, which is read with a single rep insw; the status
+// is polled through the alternate status register so that it
+// does not acknowledge the interrupt. Called with disk_lock
+// held; *wait_ns as in read_sectors_pio
+uint8_t read_sectors_multiple(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer, uint64_t *wait_ns) {
+	uint8_t status;
+	uint32_t sectors_to_read = (n_sectors==0)?256:n_sectors;
+	uint32_t n;
+	uint64_t start;
+
+	if (LBA >= total_sectors) return DISK_ERROR_LBA_OUTSIDE_RANGE;
+	if (LBA + sectors_to_read > total_sectors) return DISK_ERROR_SECTORCOUNT_TOO_BIG;
+
+	send_read_command(LBA, n_sectors, 0xC4);	// READ MULTIPLE
+
+	while (sectors_to_read > 0) {
+		ata_delay_400ns();
+
+		start = get_uptime_ns();
+		do {
+			status = port_read_byte(0x3F6);
+		} while (status & 0x80); // until BSY (busy) bit is cleared
+		*wait_ns += get_uptime_ns() - start;
+
+		if (status & 0x01) return DISK_ERROR_ERR; // ERR bit set
+		if (status & 0x20) return DISK_ERROR_DF;  // DF bit set
+		if (!(status & 0x08)) return DISK_ERROR;  // no DRQ
+
+		n = (sectors_to_read < multiple_sectors ? sectors_to_read : multiple_sectors);
+		port_read_words(0x1F0, buffer, n*256);
+
+		buffer += n*512;
+		sectors_to_read -= n;
+	}
+
+	port_read_byte(0x1F7); // acknowledge the interrupt
+	return NO_ERROR;
+}
+
+/*** Build the PRD table for a DMA read into buffer ***/
+// buffer is in the address space of page_directory (physical
+// address). Returns FALSE if some page of the buffer is not
+// mapped or the table is too small
+bool build_prd_table(uint8_t *buffer, uint32_t bytes, uint32_t page_directory) {
+	uint32_t n = 0;
+
+	if (!add_prd_entries(&n, buffer, bytes, page_directory)) return FALSE;
+
+	prd_table[n-1].flags = 0x8000; // end of table
+	return TRUE;
+}
+
+/*** Describe buffer in the PRD table from entry *n on ***/
+// Each descriptor is a physically contiguous region that does
+// not cross a 64KB boundary; pages that follow each other in
+// physical memory share one, also across the buffers of a
+// merged chain. *n is set to the number of entries in use; the
+// last one is not marked. Returns FALSE as build_prd_table
+bool add_prd_entries(uint32_t *n_entries, uint8_t *buffer, uint32_t bytes, uint32_t page_directory) {
+	uint32_t n = *n_entries, phys, length, size;
+
+	while (bytes > 0) {
+		phys = get_physical_address(page_directory, buffer);
+		if (phys == 0) return FALSE;
+
+		length = 4096 - (phys & 0xFFF); // to the end of the page
+		if (length > bytes) length = bytes;
+
+		size = (n == 0 ? 0 : (prd_table[n-1].count == 0 ? 0x10000 : prd_table[n-1].count));
+		if (n != 0 && prd_table[n-1].base + size == phys && (phys & 0xFFFF) != 0) {
+			prd_table[n-1].count = (uint16_t)(size + length); // 64KB is written as 0
+		}
+		else {
+			if (n == MAX_PRDS) return FALSE;
+			prd_table[n].base = phys;
+			prd_table[n].count = (uint16_t)length;
+			prd_table[n].flags = 0;
+			n++;
+		}
+
+		buffer += length;
+		bytes -= length;
+	}
+
+	*n_entries = n;
+	return TRUE;
+}
+
+/*** The READ DMA command ***/
+// The drive writes the sectors straight into the frames of
+// buffer; the CPU only sets up the transfer and (before the
+// IRQ 14 handler is in place) polls the bus master status
+// until it is over. Called with disk_lock held;
+// *wait_ns is increased by the time spent polling
+uint8_t read_sectors_dma(uint32_t LBA, uint8_t n_sectors, uint8_t *buffer, uint64_t *wait_ns) {
+	uint8_t status, bm_status;
+	uint32_t sectors_to_read = (n_sectors==0)?256:n_sectors;
+	uint64_t start;
+
+	if (LBA >= total_sectors) return DISK_ERROR_LBA_OUTSIDE_RANGE;
+	if (LBA + n_sectors > total_sectors) return DISK_ERROR_SECTORCOUNT_TOO_BIG;
+
+	if (!build_prd_table(buffer, sectors_to_read*512, read_CR3())) return DISK_ERROR;
+
+	port_write_byte(bmide_base, 0x00);	// stop any previous transfer
+	port_write_dword(bmide_base+4, (uint32_t)prd_table - KERNEL_BASE);
+	port_write_byte(bmide_base+2, 0x06);	// clear error and interrupt bits
+	port_write_byte(bmide_base, 0x08);	// transfer direction: into memory
+	send_read_command(LBA, n_sectors, 0xC8);	// READ DMA
+
+	port_write_byte(bmide_base, 0x09);	// start, into memory
+
+	// the drive raises its interrupt line when done (or on error)
+	start = get_uptime_ns();
+	do {
+		bm_status = port_read_byte(bmide_base+2);
+		if (get_uptime_ns() - start > DMA_TIMEOUT_NS) break;
+	} while (!(bm_status & 0x06));
+	*wait_ns += get_uptime_ns() - start;
+
+	port_write_byte(bmide_base, 0x00);		// stop
+	status = port_read_byte(0x1F7);			// also acknowledges the drive interrupt
+	port_write_byte(bmide_base+2, 0x06);		// clear error and interrupt bits
+
+	if (!(bm_status & 0x04) || (bm_status & 0x02)) return DISK_ERROR; // timed out or bus error
+	if (status & 0x01) return DISK_ERROR_ERR;	// ERR bit set
+	if (status & 0x20) return DISK_ERROR_DF;	// DF bit set
+	return NO_ERROR;
+}
@@ -15,6 +15,43 @@ uint8_t cursor_y;		// current cursor Y position
 uint8_t color;			// current color
 uint16_t *video_memory;		// pointer to video memory
 
+/*** Display lock ***/
+// Held for a whole message so that CPUs do not mix up their
+// output (or the cursor); a CPU may take it again while holding it
+spinlock_t display_lock;
+volatile int display_owner = -1;	// CPU holding display_lock; -1 if none
+uint32_t display_depth;			// times the owner took the lock
+
+/*** Take the display lock ***/
+// Returns the EFLAGS to give to unlock_display
+uint32_t lock_display() {
+	uint32_t flags;
+	int id;
+
+	asm volatile ("pushfl\n"
+		      "popl %0\n"
+		      "cli\n": "=r"(flags));
+
+	id = this_cpu()->id;
+	if (display_owner != id) {
+		spin_lock(&display_lock);
+		display_owner = id;
+	}
+	display_depth++;
+
+	return flags;
+}
+
+/*** Release the display lock ***/
+void unlock_display(uint32_t flags) {
+	if (--display_depth == 0) {
+		display_owner = -1;
+		spin_unlock(&display_lock);
+	}
+	asm volatile ("pushl %0\n"
+		      "popfl\n": :"r"(flags));
+}
+
 /*** Initialize the display ***/
 void init_display() {
 	int i;
@@ -46,6 +83,7 @@ void init_display() {
 /*** Write a character at current cursor position ***/
 // 2 bytes are written: <color> then <character>
 void display_character(uint8_t c) {
+	uint32_t flags = lock_display();
 	uint16_t attr = color << 8; // first byte is color
 	uint16_t *loc = video_memory + (80*cursor_y + cursor_x);
 
@@ -84,6 +122,7 @@ void display_character(uint8_t c) {
 	}
 
 	set_cursor(cursor_x,cursor_y);
+	unlock_display(flags);
 }
 
 /*** Update uptime on screen ***/
@@ -94,7 +133,8 @@ void update_display_time() {
 	time = time % (60*60);
 	uint16_t mins = time / 60;
 	uint16_t secs = time % 60;
-	
+
+	uint32_t flags = lock_display();
 	uint8_t x=cursor_x, y=cursor_y;
 
 	x = cursor_x; y = cursor_y;
@@ -111,6 +151,7 @@ void update_display_time() {
 	cursor_x=x; cursor_y=y;
 	set_color(LIGHT_GRAY,BLACK);
 	set_cursor(cursor_x,cursor_y);
+	unlock_display(flags);
 }
 
 /*** Scroll the screen up by moving the contents up by one line ***/
@@ -176,9 +217,13 @@ void putc(char c) {
 
 /*** Write a character string ***/
 void puts(char *s) {
+	uint32_t flags = lock_display();
+
 	while (*s!=0) {
 		putc(*s++);
 	}
+
+	unlock_display(flags);
 }
 
 /*** Write a unsigned integer ***/
@@ -236,6 +281,7 @@ void sys_printf(const char *format, ...) {
 void _printf(const char *format, va_list args, uint32_t offset) {
 	int i=0;
 	char c;
+	uint32_t flags = lock_display();
 
 	format += offset;
 	args += offset;
@@ -271,6 +317,8 @@ void _printf(const char *format, va_list args, uint32_t offset) {
 		}
 		i++;
 	}					
+
+	unlock_display(flags);
 }
 
 
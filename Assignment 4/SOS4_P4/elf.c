@@ -0,0 +1,211 @@
+////////////////////////////////////////////////////////
+// Loading ELF programs
+//
+// A static ELF32 executable (see userprogs/gcc2elf) says where
+// each of its segments goes: the PT_LOAD program headers give
+// the logical address, the bytes in the file and the bytes in
+// memory; the rest of a segment (bss) is not in the file, and
+// the kernel zeroes it. Segments that are not writable become
+// read-only once loaded, and the program starts at the entry
+// point of the header.
+//
+// The file header and the program headers must be in the first
+// sector of the image, which is all ld writes before the first
+// segment.
+
+#include "kernel_only.h"
+
+extern PDE *k_page_directory;	// from lmemman.c
+
+/*** Is this the first sector of an ELF program we can run? ***/
+// A 32-bit little endian i386 executable, whose PT_LOAD
+// segments come in increasing address order, are in the image
+// (n_sectors long) and below the shared memory; the entry
+// point must be in an executable one
+bool is_elf_image(ELF_HEADER *h, uint32_t n_sectors) {
+	ELF_PHDR *ph;
+	uint32_t bytes = n_sectors*512, end = 0, loads = 0, i;
+	bool entry_ok = FALSE;
+
+	if (h->ident[0] != 0x7F || h->ident[1] != 'E' || h->ident[2] != 'L' || h->ident[3] != 'F') return FALSE;
+	if (h->ident[4] != 1 || h->ident[5] != 1) return FALSE;	// 32-bit, little endian
+	if (h->type != 2 || h->machine != 3) return FALSE;		// executable, i386
+	if (h->phentsize != sizeof(ELF_PHDR) || h->phnum == 0 || h->phoff > 512 ||
+	    h->phnum > (512 - h->phoff)/sizeof(ELF_PHDR)) return FALSE;	// headers in the first sector
+
+	ph = (ELF_PHDR *)((uint8_t *)h + h->phoff);
+	for (i=0; i<h->phnum; i++) {
+		if (ph[i].type != ELF_PT_LOAD) continue;
+
+		if (ph[i].filesz > ph[i].memsz || ph[i].filesz > bytes || ph[i].offset > bytes - ph[i].filesz) return FALSE;
+		if (ph[i].memsz > SHM_BEGIN || ph[i].vaddr > SHM_BEGIN - ph[i].memsz) return FALSE;
+		if (ph[i].vaddr < end) return FALSE; // out of order, or overlapping
+
+		if ((ph[i].flags & ELF_PF_X) && h->entry >= ph[i].vaddr && h->entry - ph[i].vaddr < ph[i].memsz)
+			entry_ok = TRUE;
+		end = ph[i].vaddr + ph[i].memsz;
+		loads++;
+	}
+
+	return (loads != 0 && entry_ok);
+}
+
+/*** Initialize logical memory for an ELF program ***/
+// As init_logical_memory, but the pages are those of the
+// segments: where the header puts them, and only as many as
+// they take in memory. Two segments may share a page. All
+// pages are writable until the loader has filled them (see
+// elf_protect)
+bool init_elf_memory(PCB *p, ELF_HEADER *h) {
+	ELF_PHDR *ph = (ELF_PHDR *)((uint8_t *)h + h->phoff);
+	uint32_t low = 0xFFFFFFFF, high = 0, mapped = 0, first, last, i;
+
+	// page directory; must come from the first 4MB so that
+	// the kernel can reach it at +KERNEL_BASE
+	PDE *page_directory = (PDE *)alloc_kernel_pages(1);
+	if (page_directory == NULL) return FALSE;
+
+	// kernel address space (including the APIC registers, see
+	// smp.c) is the same in every process
+	for (i=768; i<1024; i++) page_directory[i] = k_page_directory[i];
+
+	// alloc_user_pages zeroes the pages through their logical
+	// address, so the new address space must be the active one
+	load_CR3((uint32_t)page_directory-KERNEL_BASE);
+
+	for (i=0; i<h->phnum; i++) {
+		if (ph[i].type != ELF_PT_LOAD || ph[i].memsz == 0) continue;
+
+		first = ph[i].vaddr & 0xFFFFF000;
+		last = (ph[i].vaddr + ph[i].memsz + 4095) & 0xFFFFF000;
+		if (first < mapped) first = mapped; // the page of the segment before
+
+		if (first < last && alloc_user_pages((last-first)/4096, first, page_directory, PTE_READ_WRITE) == NULL) {
+			load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+			dealloc_all_pages(page_directory, NULL);
+			dealloc_page(page_directory, k_page_directory);
+			return FALSE;
+		}
+		if (last > mapped) mapped = last;
+
+		if (ph[i].vaddr < low) low = ph[i].vaddr;
+		if (ph[i].vaddr + ph[i].memsz > high) high = ph[i].vaddr + ph[i].memsz;
+	}
+
+	if (alloc_user_pages(USER_STACK_PAGES, USER_STACK_BASE, page_directory, PTE_READ_WRITE) == NULL) {
+		load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+		dealloc_all_pages(page_directory, NULL);
+		dealloc_page(page_directory, k_page_directory);
+		return FALSE;
+	}
+
+	load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+
+	p->mem.start_code = low;
+	p->mem.end_code = high - 1;
+	p->mem.start_brk = mapped;
+	p->mem.brk = p->mem.start_brk;
+	p->mem.start_stack = USER_STACK_BASE + USER_STACK_PAGES*4096; // stack grows downwards
+	p->mem.page_directory = (PDE *)((uint32_t)page_directory-KERNEL_BASE);
+
+	return TRUE;
+}
+
+/*** Read a segment into the address space of a process ***/
+// Its bytes in the file go through staging (LOAD_CHUNK_SECTORS
+// sectors), a piece at a time, and are copied to their logical
+// address with the address space of p loaded and interrupts
+// off (as load_program reads). The bss after them is zeroed
+// here to the end of their last page; the pages after that are
+// zero already (see alloc_user_pages)
+bool load_elf_segment(PCB *p, ELF_PHDR *ph, uint8_t *staging) {
+	uint8_t *mem = (uint8_t *)ph->vaddr;
+	uint32_t done = 0, skip, count, n, end, flags, i;
+
+	while (done < ph->filesz) {
+		skip = (ph->offset + done) % 512;
+		count = (skip + ph->filesz - done + 511) / 512;
+		if (count > LOAD_CHUNK_SECTORS) count = LOAD_CHUNK_SECTORS;
+
+		if (bcache_read(p->cold.disk.LBA + (ph->offset + done)/512, (uint8_t)count, staging) != NO_ERROR)
+			return FALSE;
+
+		n = count*512 - skip;
+		if (n > ph->filesz - done) n = ph->filesz - done;
+
+		flags = save_and_disable_interrupts();
+		load_CR3((uint32_t)p->mem.page_directory);
+		for (i=0; i<n; i++) mem[done + i] = staging[skip + i];
+		load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+		restore_interrupts(flags);
+
+		done += n;
+	}
+
+	end = (ph->vaddr + ph->filesz + 4095) & 0xFFFFF000;
+	if (end > ph->vaddr + ph->memsz) end = ph->vaddr + ph->memsz;
+
+	flags = save_and_disable_interrupts();
+	load_CR3((uint32_t)p->mem.page_directory);
+	for (i=ph->vaddr + ph->filesz; i<end; i++) *(uint8_t *)i = 0;
+	load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+	restore_interrupts(flags);
+
+	return TRUE;
+}
+
+/*** Make the segments that are not writable read-only ***/
+// Except the pages they share with a writable one. The process
+// has not run yet, so none of its pages are in a TLB
+void elf_protect(PCB *p, ELF_HEADER *h) {
+	ELF_PHDR *ph = (ELF_PHDR *)((uint8_t *)h + h->phoff);
+	PDE *pd = (PDE *)((uint32_t)p->mem.page_directory + KERNEL_BASE);
+	uint32_t page, i, j;
+	PTE *pt;
+	bool writable;
+
+	for (i=0; i<h->phnum; i++) {
+		if (ph[i].type != ELF_PT_LOAD || ph[i].memsz == 0 || (ph[i].flags & ELF_PF_W)) continue;
+
+		for (page=ph[i].vaddr & 0xFFFFF000; page<ph[i].vaddr + ph[i].memsz; page+=4096) {
+			writable = FALSE;
+			for (j=0; j<h->phnum; j++)
+				if (ph[j].type == ELF_PT_LOAD && (ph[j].flags & ELF_PF_W) && ph[j].memsz != 0 &&
+				    page < ph[j].vaddr + ph[j].memsz && page + 4096 > ph[j].vaddr) writable = TRUE;
+			if (writable) continue;
+
+			pt = (PTE *)((pd[page >> 22] & 0xFFFFF000) + KERNEL_BASE);
+			pt[(page >> 12) & 0x3FF] &= ~PTE_READ_WRITE;
+		}
+	}
+}
+
+/*** Read an ELF program into the address space of a process ***/
+// The headers are read again (from the buffer cache, where
+// load_image left them); the image must not have changed since
+bool load_elf_program(PCB *p) {
+	uint8_t headers[512];
+	ELF_HEADER *h = (ELF_HEADER *)headers;
+	ELF_PHDR *ph;
+	uint8_t *staging;
+	uint32_t i;
+	bool loaded;
+
+	if (bcache_read(p->cold.disk.LBA, 1, headers) != NO_ERROR) return FALSE;
+	if (!is_elf_image(h, p->cold.disk.n_sectors)) return FALSE;
+
+	staging = (uint8_t *)alloc_kernel_pages(LOAD_CHUNK_SECTORS*512/4096);
+	if (staging == NULL) return FALSE;
+
+	ph = (ELF_PHDR *)(headers + h->phoff);
+	loaded = TRUE;
+	for (i=0; i<h->phnum && loaded; i++)
+		if (ph[i].type == ELF_PT_LOAD && ph[i].memsz != 0) loaded = load_elf_segment(p, &ph[i], staging);
+
+	if (loaded) elf_protect(p, h);
+
+	for (i=0; i<LOAD_CHUNK_SECTORS*512/4096; i++)
+		dealloc_page(staging + i*4096, k_page_directory);
+
+	return loaded;
+}
@@ -5,8 +5,6 @@
 
 #include "kernel_only.h"
 
-extern PCB *current_process;		// from scheduler.c
-extern PCB console;			// from scheduler.c
 
 /*** The all purpose exception handler ***/
 // Simply kills the current process and schedules something
@@ -50,19 +48,129 @@ void page_fault_exception_handler(void) {
 	asm volatile ("movl %%eax, %0\n": "=r"(pf_address));
 	
 	puts("\n");
-	if (current_process == &console) {
+	if (current_process->ring0) { // console, kernel thread or idle context
 		sys_printf("Kernel page fault @ 0x%x...SYSTEM HALTED!!\n",pf_address);
 		disable_interrupts();
 		asm volatile("hlt\n");
 	}
 
-	sys_printf("Page fault: %d (%d,%d) @ 0x%x.\n",current_process->pid, current_process->disk.LBA,
-						  current_process->disk.n_sectors,pf_address);
+	current_process->stats.page_faults++;
+
+	sys_printf("Page fault: %d (%d,%d) @ 0x%x.\n",current_process->pid, current_process->cold.disk.LBA,
+						  current_process->cold.disk.n_sectors,pf_address);
 
 	current_process->state = TERMINATED;
 	schedule_something();
 }
 
+/*** Lazy FPU/SSE switching ***/
+// CR0.TS is set whenever the FPU registers may belong to a process
+// other than the running one; the first FPU/SSE instruction of the
+// process then raises #NM (device not available), and only then is
+// its state loaded. A process that used the FPU has its state saved
+// when it leaves the CPU (see switch_fpu), so it can resume on any
+// CPU. Processes that never touch the FPU cost nothing. The kernel
+// itself is built without FPU/SSE code (see build/Makefile).
+bool fpu_fxsr = FALSE;	// FXSAVE/FXRSTOR (and SSE) available
+
+/*** Address of the 16-byte aligned save area of a process ***/
+uint8_t *fpu_area(PCB *p) {
+	return p->cold.fpu.area;
+}
+
+/*** The #NM exception handler ***/
+// Returns to the faulting instruction, so all registers are kept
+asm("handler_fpu_entry: \n"
+	"pushal\n"
+	"pushl %ds\n"
+	"pushl %es\n"
+	"movl $0x10, %eax\n"
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"call fpu_not_available_handler\n"
+	"popl %es\n"
+	"popl %ds\n"
+	"popal\n"
+	"iretl\n"
+);
+void fpu_not_available_handler(void) {
+	CPU *c = this_cpu();
+	PCB *p = c->current;
+	uint32_t mxcsr = MXCSR_DEFAULT;
+
+	if (p->ring0) { // the kernel does not use the FPU
+		puts("\nKernel FPU access...SYSTEM HALTED!!\n");
+		disable_interrupts();
+		asm volatile("hlt\n");
+	}
+
+	asm volatile ("clts\n");
+	c->fpu_live = TRUE;
+
+	// the registers still hold p's state if nobody else loaded
+	// theirs here since p last did
+	if (c->fpu_owner == p && p->cold.fpu.loaded_on == c->id) return;
+
+	if (!p->cold.fpu.used) { // first use: a clean FPU
+		asm volatile ("fninit\n");
+		if (fpu_fxsr) asm volatile ("ldmxcsr %0\n": :"m"(mxcsr));
+		p->cold.fpu.used = TRUE;
+	}
+	else {
+		if (fpu_fxsr) asm volatile ("fxrstor (%0)\n": :"r"(fpu_area(p)));
+		else asm volatile ("frstor (%0)\n": :"r"(fpu_area(p)));
+		p->cold.fpu.restores++;
+	}
+
+	c->fpu_owner = p;
+	p->cold.fpu.loaded_on = c->id;
+}
+
+/*** Give up the FPU of CPU c ***/
+// Called when c switches to another process: saves the FPU state
+// of the process that used it in its slice and sets CR0.TS again
+void switch_fpu(CPU *c) {
+	uint32_t cr0;
+
+	if (!c->fpu_live) return;
+
+	if (fpu_fxsr) asm volatile ("fxsave (%0)\n": :"r"(fpu_area(c->fpu_owner)): "memory");
+	else asm volatile ("fnsave (%0)\n"
+			   "fwait\n": :"r"(fpu_area(c->fpu_owner)): "memory");
+
+	// FNSAVE reinitializes the FPU; the registers no longer
+	// hold the owner's state
+	if (!fpu_fxsr) c->fpu_owner = NULL;
+
+	asm volatile ("movl %%cr0, %0\n": "=r"(cr0));
+	asm volatile ("movl %0, %%cr0\n": :"r"(cr0 | CR0_TS));
+	c->fpu_live = FALSE;
+}
+
+/*** Set up the FPU of the calling CPU ***/
+// CR0.EM is off and CR0.MP/NE on from startup.S; SSE is enabled
+// if the CPU can save its state with FXSAVE
+void init_fpu(void) {
+	uint32_t edx, cr0, cr4;
+
+	// CPUID function 1: EDX bit 24 is FXSR, bit 25 is SSE
+	asm volatile ("cpuid\n": "=d"(edx): "a"(1): "ebx", "ecx");
+	fpu_fxsr = ((edx & (1 << 24)) != 0);
+
+	if (fpu_fxsr) {
+		asm volatile ("movl %%cr4, %0\n": "=r"(cr4));
+		cr4 |= CR4_OSFXSR;
+		if (edx & (1 << 25)) cr4 |= CR4_OSXMMEXCPT;
+		asm volatile ("movl %0, %%cr4\n": :"r"(cr4));
+	}
+
+	asm volatile ("fninit\n");
+
+	// nobody owns the FPU yet
+	asm volatile ("movl %%cr0, %0\n": "=r"(cr0));
+	asm volatile ("movl %0, %%cr0\n": :"r"(cr0 | CR0_TS));
+}
+
 /*** Initialize exception handlers ***/
 void init_exceptions(void) {
 	int i;
@@ -71,5 +179,8 @@ void init_exceptions(void) {
 	for (i=0; i<32; i++) // all of these are exceptions
 		install_interrupt_handler(i,default_exception_handler,0x0008,0x8E);
 
+	install_interrupt_handler(7,handler_fpu_entry,0x0008,0x8E);
 	install_interrupt_handler(14,page_fault_exception_handler,0x0008,0x8E);
+
+	init_fpu(); // the BSP; APs in ap_main
 }
@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////
+// The SOS filesystem
+//
+// Read-only, and laid out for reading (see fs.h): a file is
+// one contiguous extent, so a program is loaded with one
+// sequential read of exactly its sectors; the directory is a
+// hash table, so finding a name usually takes one sector.
+// The disk is made on the host by build/mkfs.
+
+#include "kernel_only.h"
+
+FS_SUPER fs_super;
+bool fs_mounted = FALSE;	// a filesystem was found on the disk
+
+/*** Look for the filesystem ***/
+// Must run before disk reads go through IRQ 14 (see
+// init_disk_interrupts): nothing can wait for them yet
+void init_fs(void) {
+	uint32_t sector[128];
+	FS_SUPER *s = (FS_SUPER *)sector;
+
+	if (read_disk(FS_SUPER_LBA, 1, (uint8_t *)sector) != NO_ERROR) return;
+	if (s->magic != FS_MAGIC || s->dir_sectors == 0) return;
+
+	fs_super = *s;
+	fs_mounted = TRUE;
+}
+
+/*** Hash of a file name ***/
+// 32-bit FNV-1a; build/mkfs uses the same
+uint32_t fs_hash(char *name) {
+	uint32_t h = 2166136261u;
+
+	for (; *name != 0; name++) {
+		h ^= (uint8_t)*name;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*** Find a file ***/
+// Probes the directory from the slot of the name until it
+// finds the name or a free slot; a sector is read only when
+// the probe enters it. Returns FALSE if there is no such file
+// (or no filesystem); otherwise *LBA and *size are set
+bool fs_lookup(char *name, uint32_t *LBA, uint32_t *size) {
+	FS_DIRENT dir[FS_DIRENTS_PER_SECTOR];
+	uint32_t n_slots = fs_super.dir_sectors * FS_DIRENTS_PER_SECTOR;
+	uint32_t h, slot, i, loaded = 0xFFFFFFFF;
+	FS_DIRENT *e;
+
+	if (!fs_mounted) return FALSE;
+
+	h = fs_hash(name);
+	slot = h % n_slots;
+
+	for (i=0; i<n_slots; i++, slot=(slot+1)%n_slots) {
+		if (slot/FS_DIRENTS_PER_SECTOR != loaded) {
+			loaded = slot/FS_DIRENTS_PER_SECTOR;
+			if (bcache_read(fs_super.dir_LBA + loaded, 1, (uint8_t *)dir) != NO_ERROR) return FALSE;
+		}
+
+		e = &dir[slot % FS_DIRENTS_PER_SECTOR];
+		if (e->name[0] == 0) return FALSE; // the name would be here
+		if (e->hash == h && strcmp(e->name, name) == 0) {
+			*LBA = e->LBA;
+			*size = e->size;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
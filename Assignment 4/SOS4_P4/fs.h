@@ -0,0 +1,39 @@
+////////////////////////////////////////////////////////
+// On-disk layout of the SOS filesystem
+//
+// Shared by the kernel (see fs.c) and the host tool that
+// makes the filesystem (see build/mkfs.c); whoever includes
+// it provides the uintN_t types
+//
+// FS_SUPER_LBA: the superblock
+// then dir_sectors sectors: the directory, a hash table of
+//	FS_DIRENT (open addressing, linear probing; the slot of
+//	a name is its FNV-1a hash modulo the number of slots)
+// from data_LBA on: the files, each in one contiguous extent
+//	starting at a multiple of FS_ALIGN_SECTORS
+
+#define FS_MAGIC		0x46534F53	// "SOSF"
+#define FS_SUPER_LBA		1032		// the kernel is in LBA 1 to 1024 (see MBR.S)
+#define FS_DIR_SECTORS		8		// directory size; 64 files at most
+#define FS_DIRENTS_PER_SECTOR	8
+#define FS_NAME_LEN		48		// longest name, with the terminating 0
+#define FS_ALIGN_SECTORS	8		// a file starts in a block of its own (see bcache.c)
+
+/*** The superblock ***/
+typedef struct {
+	uint32_t magic;			// FS_MAGIC
+	uint32_t dir_LBA;		// first sector of the directory
+	uint32_t dir_sectors;		// sectors of the directory
+	uint32_t n_files;
+	uint32_t data_LBA;		// first sector of the first file
+	uint32_t end_LBA;		// the sector after the last file
+} FS_SUPER;
+
+/*** A directory slot (64 bytes) ***/
+typedef struct {
+	char name[FS_NAME_LEN];		// empty if the slot is free
+	uint32_t hash;			// FNV-1a hash of name
+	uint32_t LBA;			// first sector of the extent
+	uint32_t size;			// in bytes
+	uint32_t sectors;		// of the extent
+} FS_DIRENT;
@@ -62,23 +62,44 @@ void disable_interrupts() {
 	asm volatile ("cli");
 }
 
+/*** Disable interrupts, returning the previous EFLAGS ***/
+uint32_t save_and_disable_interrupts() {
+	uint32_t flags;
+
+	asm volatile ("pushfl\n"
+		      "popl %0\n"
+		      "cli\n": "=r"(flags));
+	return flags;
+}
+
+/*** Restore interrupts as saved by save_and_disable_interrupts ***/
+void restore_interrupts(uint32_t flags) {
+	asm volatile ("pushl %0\n"
+		      "popfl\n": :"r"(flags));
+}
+
 /*** Set up the Interrupt Descriptor Table ***/
 void setup_IDT() {
 	int i;
 
-	// where does the IDT begin (base) and where does it end (base+limit)
-	uint32_t base  = (uint32_t)(&IDT[0]);
-	uint16_t limit = (uint16_t)(sizeof(IDT_DESCRIPTOR) * 256 - 1);
-	// collapsing base and limit into one value
-	uint64_t operand = limit | ((uint64_t) (uint32_t) base << 16); 
-
 	// set up a default handler for each interrupt
 	// we should install proper handlers as and when devices are initialized
 	for (i=0; i<256; i++) {
 		install_interrupt_handler(i,handler_default_entry,0x0008,0x8E);
 	}
 
-	// load IDT
+	load_IDT();
+}
+
+/*** Load the IDT into this CPU ***/
+// All CPUs share one IDT
+void load_IDT() {
+	// where does the IDT begin (base) and where does it end (base+limit)
+	uint32_t base  = (uint32_t)(&IDT[0]);
+	uint16_t limit = (uint16_t)(sizeof(IDT_DESCRIPTOR) * 256 - 1);
+	// collapsing base and limit into one value
+	uint64_t operand = limit | ((uint64_t) (uint32_t) base << 16); 
+
 	asm volatile ("lidt %0" : : "m" (operand));
 }
 
@@ -0,0 +1,194 @@
+////////////////////////////////////////////////////////
+// The I/O scheduler (elevator)
+//
+// Requests submitted to the disk (see submit_disk_request)
+// wait here while the channel is busy; when it becomes free,
+// the policy picks the one to start next.
+//
+// A request for the sectors right after, or right before,
+// those of a waiting request joins it: both are read with one
+// command, each into its own buffer (see start_disk_request),
+// as long as the command is no longer than MAX_MERGE_SECTORS.
+// The requests of one command form a chain through merged, in
+// LBA order; the first one stands for the chain in the queue.
+//
+// The policies (see IO_SCHEDULER) are
+//	noop:	  in the order they came
+//	clook:	  in increasing LBA from where the last command
+//		  ended, then back to the lowest LBA (circular LOOK)
+//	deadline: as clook, unless the oldest request has waited
+//		  longer than IO_DEADLINE_NS; that one goes first
+//
+// Everything here is protected by disk_lock.
+
+#include "kernel_only.h"
+
+extern spinlock_t disk_lock;	// from disk.c
+
+DISK_REQUEST *io_queue = NULL;		// chains waiting for the channel, in the order they came
+DISK_REQUEST *io_queue_tail = NULL;
+uint32_t io_depth = 0;			// requests submitted and not done yet (the ones on the channel too)
+uint32_t head_LBA = 0;			// the sector after those of the last command started
+
+/*** I/O scheduling policies ***/
+// deadline is the default; "iosched <name>" on the console
+// switches policy
+IO_SCHEDULER io_schedulers[N_IO_SCHEDULERS] = {
+	{"noop", noop_pick},
+	{"deadline", deadline_pick},
+	{"clook", clook_pick}
+};
+IO_SCHEDULER *io_scheduler = &io_schedulers[1];
+IO_STATS io_stats;	// since the policy was last switched
+
+/*** Queue a request ***/
+// The request joins a waiting chain if it can; otherwise it
+// goes to the end of the queue. req->mode must be final and
+// req->chain_sectors its sector count. Called with disk_lock
+// held
+void elevator_add(DISK_REQUEST *req) {
+	DISK_REQUEST *c, *prev = NULL, *last;
+	uint32_t count = req->chain_sectors;
+
+	io_stats.depth_hist[io_depth < IO_DEPTH_BUCKETS ? io_depth : IO_DEPTH_BUCKETS-1]++;
+	io_stats.requests++;
+	io_depth++;
+
+	for (c=io_queue; c!=NULL; prev=c, c=c->next) {
+		if (c->mode != req->mode || c->chain_sectors + count > MAX_MERGE_SECTORS) continue;
+
+		if (c->LBA + c->chain_sectors == req->LBA) { // back merge
+			for (last=c; last->merged!=NULL; last=last->merged);
+			last->merged = req;
+			c->chain_sectors += count;
+			io_stats.merges++;
+			return;
+		}
+
+		if (req->LBA + count == c->LBA) { // front merge; req takes the place of c
+			req->merged = c;
+			req->chain_sectors += c->chain_sectors;
+			req->next = c->next;
+			if (prev == NULL) io_queue = req;
+			else prev->next = req;
+			if (io_queue_tail == c) io_queue_tail = req;
+			io_stats.merges++;
+			return;
+		}
+	}
+
+	req->next = NULL;
+	if (io_queue_tail == NULL) io_queue = req;
+	else io_queue_tail->next = req;
+	io_queue_tail = req;
+}
+
+/*** Take the next chain off the queue ***/
+// Returns NULL if nothing is waiting. Called with disk_lock
+// held
+DISK_REQUEST *elevator_next(void) {
+	DISK_REQUEST *req, *c, *prev = NULL;
+
+	if (io_queue == NULL) return NULL;
+
+	req = io_scheduler->pick();
+	for (c=io_queue; c!=req; c=c->next) prev = c;
+
+	if (prev == NULL) io_queue = req->next;
+	else prev->next = req->next;
+	if (io_queue_tail == req) io_queue_tail = prev;
+	req->next = NULL;
+
+	head_LBA = req->LBA + req->chain_sectors;
+	io_stats.dispatches++;
+
+	return req;
+}
+
+/*** A request is done ***/
+// Accounts for its latency, from submission to now; called
+// with disk_lock held, before done is set
+void elevator_done(DISK_REQUEST *req, uint64_t now) {
+	uint64_t t = (now > req->queued_at ? now - req->queued_at : 0);
+	uint32_t us = ns_to_us(t), b = 0;
+
+	while (us != 0 && b < IO_LAT_BUCKETS-1) { // bucket b: below 2^b us
+		us >>= 1;
+		b++;
+	}
+	io_stats.lat_hist[b]++;
+	io_stats.lat_ns += t;
+	io_stats.completed++;
+	io_depth--;
+}
+
+/*** noop: the oldest chain ***/
+DISK_REQUEST *noop_pick(void) {
+	return io_queue;
+}
+
+/*** C-LOOK: the lowest LBA ahead of the head ***/
+// Once nothing is ahead, the head goes back to the lowest LBA
+DISK_REQUEST *clook_pick(void) {
+	DISK_REQUEST *c, *ahead = NULL, *lowest = NULL;
+
+	for (c=io_queue; c!=NULL; c=c->next) {
+		if (lowest == NULL || c->LBA < lowest->LBA) lowest = c;
+		if (c->LBA >= head_LBA && (ahead == NULL || c->LBA < ahead->LBA)) ahead = c;
+	}
+
+	return (ahead != NULL ? ahead : lowest);
+}
+
+/*** deadline: C-LOOK, but no request waits too long ***/
+// The chain at the front of the queue holds the oldest
+// request: chains keep the place of their first request, and
+// a request joining one is newer
+DISK_REQUEST *deadline_pick(void) {
+	DISK_REQUEST *c;
+	uint64_t oldest = io_queue->queued_at;
+
+	for (c=io_queue->merged; c!=NULL; c=c->merged)
+		if (c->queued_at < oldest) oldest = c->queued_at;
+
+	if (get_uptime_ns() - oldest > IO_DEADLINE_NS) {
+		io_stats.expired++;
+		return io_queue;
+	}
+
+	return clook_pick();
+}
+
+/*** Switch the I/O scheduling policy ***/
+// Returns FALSE if there is no policy of that name; requests
+// already waiting are started by the new one
+bool set_io_scheduler(char *name) {
+	uint32_t i, flags;
+
+	for (i=0; i<N_IO_SCHEDULERS; i++) {
+		if (strcmp(name, io_schedulers[i].name) != 0) continue;
+
+		flags = spin_lock_irqsave(&disk_lock);
+		io_scheduler = &io_schedulers[i];
+		reset_io_stats();
+		spin_unlock_irqrestore(&disk_lock, flags);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*** Clear the I/O scheduler statistics ***/
+void reset_io_stats(void) {
+	uint32_t i;
+
+	io_stats.since = get_uptime_ns();
+	io_stats.requests = 0;
+	io_stats.completed = 0;
+	io_stats.merges = 0;
+	io_stats.dispatches = 0;
+	io_stats.expired = 0;
+	io_stats.lat_ns = 0;
+	for (i=0; i<IO_DEPTH_BUCKETS; i++) io_stats.depth_hist[i] = 0;
+	for (i=0; i<IO_LAT_BUCKETS; i++) io_stats.lat_hist[i] = 0;
+}
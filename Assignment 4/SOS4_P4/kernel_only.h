@@ -5,11 +5,116 @@
 //
 
 #include "lib.h"
+#include "fs.h"
+#include "pack.h"
 
 #define KERNEL_BASE	0xC0000000
 #define KERNEL_ALLOC	0
 #define USER_ALLOC	1
 
+/*** Stride scheduling ***/
+#define STRIDE1		(1 << 20)	// stride of a process with one ticket
+#define DEFAULT_TICKETS	100		// tickets of the console and of new processes
+#define MAX_TICKETS	10000		// upper limit on tickets of a process
+#define DEFAULT_QUANTUM_US	10000		// time slice of the policies (one epoch)
+#define MAX_QUANTUM_US		1000000		// longest time slice a process may ask for
+
+/*** Scheduling policies ***/
+#define N_SCHED_POLICIES	2		// stride, rr (see scheduler.c)
+#define WAKE_HIST_BUCKETS	24		// wake up latency histogram; bucket i holds latencies below 2^i us
+
+/*** Gang scheduling ***/
+#define MAX_GANG_ID	255		// explicit group ids are 1..MAX_GANG_ID
+#define GANG_SHM	256		// gang of the processes attached to shm[key] is GANG_SHM+key
+#define MAX_GANGS	512		// explicit groups and shared memory groups
+
+/*** Real-time (EDF) scheduling ***/
+#define RT_MAX_UTIL	900		// admission limit on total real-time utilization (per mille)
+
+/*** User address space ***/
+#define USER_STACK_PAGES	4		// user-mode stack size (in 4KB pages)
+#define USER_STACK_BASE		0xBFBFB000	// lowest stack page; the stack ends at 0xBFBFF000
+#define MAX_THREADS		16		// threads (user stacks) per address space
+
+/*** Multiprocessing ***/
+#define MAX_CPUS		8		// CPUs we will bring up (TSS slots in the GDT of startup.S)
+#define AP_TRAMPOLINE		0x7000		// physical address of AP start-up code (page aligned, below 1MB)
+#define APIC_WINDOW		0xFEC00000	// 4MB page mapped 1:1 holding the IOAPIC and local APIC registers
+#define PHYS_WINDOW		0xFF000000	// 4MB page used to peek at firmware tables anywhere in memory
+#define LAPIC_TIMER_VECTOR	0x40		// local APIC timer (scheduling epochs on APs)
+#define WAKE_TIMER_VECTOR	0x41		// BSP local APIC timer, one-shot (sleeps ending between epochs)
+#define SPURIOUS_VECTOR		0x4F		// local APIC spurious interrupt
+
+/*** FPU ***/
+#define CR0_TS			0x00000008	// Task Switched: next FPU/SSE instruction raises #NM
+#define CR4_OSFXSR		0x00000200	// OS supports FXSAVE/FXRSTOR (enables SSE)
+#define CR4_OSXMMEXCPT		0x00000400	// OS handles SIMD floating-point exceptions (#XM)
+#define MXCSR_DEFAULT		0x1F80		// all SIMD exceptions masked, round to nearest
+
+/*** Kernel threads ***/
+#define KTHREAD_STACK_PAGES	2		// Ring 0 stack size of a kernel thread (in 4KB pages)
+
+/*** Program loading ***/
+#define LOAD_CHUNK_SECTORS	16		// sectors the loader asks the disk for at a time
+#define PACK_STAGING_PAGES	4		// buffer a packed image is read into (see unpack_fill)
+#define IMAGE_FLAT		0		// the program as it is in memory, from logical address 0
+#define IMAGE_PACKED		1		// a packed image (see unpack.c)
+#define IMAGE_ELF		2		// a static ELF32 executable (see elf.c)
+#define ELF_PT_LOAD		1		// program header of a segment to load
+#define ELF_PF_X		1		// segment flags: executable,
+#define ELF_PF_W		2		// writable,
+#define ELF_PF_R		4		// readable
+
+/*** Disk ***/
+#define DISK_PIO		0		// the CPU moves every word, one sector per DRQ (see read_sectors_pio)
+#define DISK_PIO_MULTIPLE	2		// READ MULTIPLE: a block of sectors per DRQ, rep insw (see read_sectors_multiple)
+#define DISK_DMA		1		// the IDE bus master does (see read_sectors_dma)
+#define DISK_VIRTIO		3		// a virtio-blk disk instead of the ATA one (see virtio.c)
+#define DISK_AHCI		4		// a SATA drive on an AHCI controller (see ahci.c)
+#define N_DISK_MODES		5
+#define DISK_DEFAULT		0xFF		// whatever disk_mode is (see read_disk_with)
+#define MAX_MULTIPLE_SECTORS	16		// largest block we ask for in SET MULTIPLE MODE
+#define LBA28_LIMIT		0x10000000	// sectors an LBA28 command can reach; LBA48 beyond
+#define MAX_PRDS		64		// entries of the PRD table; 256 sectors need at most 33
+#define DMA_TIMEOUT_NS		1000000000ULL	// a DMA read that takes longer has failed
+
+/*** PCI ***/
+#define MAX_PCI_FUNCTIONS	64		// functions remembered by init_pci
+#define MAX_PCI_ROUTES		32		// PCI interrupts of the MP table remembered (see find_cpus_mp)
+
+/*** virtio-blk ***/
+#define VIRTIO_MAX_QUEUE	256		// largest virtqueue we set up
+#define VIRTIO_MAX_SEGMENTS	33		// data descriptors of a request; 256 sectors span at most 33 pages
+
+/*** AHCI ***/
+#define AHCI_MAX_SLOTS		32		// command slots of a port; also the deepest NCQ queue
+#define AHCI_MAX_PRDS		56		// PRD table entries per command; a table is then 1KB
+#define IOPS_MAX_DEPTH		32		// requests diskiops keeps in flight at most
+
+/*** I/O scheduling ***/
+#define N_IO_SCHEDULERS		3		// noop, deadline, clook (see iosched.c)
+#define IO_DEADLINE_NS		50000000ULL	// a request waiting longer goes next under deadline
+#define MAX_MERGE_SECTORS	256		// longest command merged requests may make
+#define IO_DEPTH_BUCKETS	16		// queue depth histogram; the last bucket holds the deeper queues
+#define IO_LAT_BUCKETS		24		// request latency histogram; bucket i holds latencies below 2^i us
+
+/*** Block buffer cache ***/
+#define BCACHE_BLOCK_SECTORS	8		// sectors in a block (one page)
+#define BCACHE_FRACTION		16		// the cache takes 1/16 of the free memory...
+#define BCACHE_MAX_BLOCKS	256		// ...but no more than 1MB of the kernel's first 4MB
+#define BCACHE_HASH_SIZE	64		// hash buckets; a power of 2
+#define BCACHE_READ_AHEAD	4		// blocks read ahead of a sequential reader
+#define BLOCK_EMPTY		0		// holds nothing
+#define BLOCK_READING		1		// on its way from the disk (see bcache_settle)
+#define BLOCK_VALID		2		// holds the sectors from LBA on
+
+/*** Context switching ***/
+#define KSTACK_PAGES		1		// kernel stack size of a user process (in 4KB pages)
+#define CACHE_LINE		64		// PCBs are laid out in cache lines of this size
+
+/*** Current process of the CPU executing this code ***/
+#define current_process	(this_cpu()->current)
+
 /*** Debugging ***/
 #define STOP	asm("cli\n hlt\n");
 
@@ -174,35 +279,57 @@ typedef uint32_t PDE;
 //   bit 9-11: set 0
 typedef uint32_t PTE;
 
+/*** Statistics of a gang ***/
+typedef struct {
+	uint32_t rounds;	// times the gang got a CPU
+	uint32_t dispatches;	// members dispatched in those rounds
+	uint32_t sync_ops;	// mutex unlocks and semaphore UPs by members (work handed on)
+	uint64_t cpu_ns;	// CPU time used by members
+} GANG_STATS;
+
+/*** Wake up to run latency of a synchronization object ***/
+typedef struct {
+	uint32_t count;		// wake ups that have been dispatched
+	uint64_t total_ns;	// sum of the times from wake up to run
+	uint64_t max_ns;	// longest time from wake up to run
+} WAKE_LATENCY;
+
+/*** Registers of a process on entry to the kernel ***/
+// Pushed on its kernel stack by the CPU and the pushal of the
+// entry code; esp and ss are only there if it came from Ring 3
+typedef struct {
+	uint32_t edi;
+	uint32_t esi;
+	uint32_t ebp;
+	uint32_t kernel_esp;	// stack pointer of the pushal; not restored
+	uint32_t ebx;
+	uint32_t edx;
+	uint32_t ecx;
+	uint32_t eax;
+	uint32_t eip;
+	uint32_t cs;
+	uint32_t eflags;
+	uint32_t esp;
+	uint32_t ss;
+} TRAP_FRAME;
+
 /*** Process Control Block (everything about a process) ***/
+// The first cache line holds what a context switch and a walk of
+// the process queue touch; the rest follows in order of use, and
+// what only system calls and the console read is kept in the cold
+// part, in cache lines of its own
 typedef struct process_control_block {
-	struct {
-		uint32_t ss;         
-		uint32_t cs;     
-		uint32_t esp; 
-		uint32_t ebp;      
-		uint32_t eip;
-		uint32_t eflags;
-		uint32_t eax;
-		uint32_t ebx;
-		uint32_t ecx;
-		uint32_t edx;
-		uint32_t esi;
-		uint32_t edi;
-	} cpu;   
-
-	uint32_t pid;
+	uint32_t kesp;			// kernel stack pointer while switched out; must come first (see switch_context)
+	TRAP_FRAME *regs;		// registers saved on the last entry to the kernel
+	uint32_t kstack;		// lowest address of the kernel stack; 0 for the console and idle contexts
+	bool ring0;			// runs in Ring 0 (console, kernel threads, idle contexts)
 
-	// Do not need the following any more (flat segmentation model)
-	//uint32_t memory_base; 
-	//uint32_t memory_limit;
+	enum {NEW, READY, RUNNING, WAITING, TERMINATED, LOADING} state;
 
-	enum {NEW, READY, RUNNING, WAITING, TERMINATED} state;
-	
-	uint32_t sleep_end;
+	uint32_t cpu_id;		// CPU whose run queue holds the process
+	int on_cpu;			// CPU running the process right now; -1 if none
 
 	struct process_control_block *prev_PCB, *next_PCB;
- 
 
 	struct {			// all addresses are logical
 		uint32_t start_code;	// start address of code
@@ -213,28 +340,100 @@ typedef struct process_control_block {
 		PDE *page_directory;	// page directory
 	} mem;
 
-	struct {
-		uint32_t LBA;
-		uint32_t n_sectors;
-	} disk;
+	uint32_t pid;
+	uint32_t quantum_us;		// time slice; 0 for the default of the policy (see slice_length)
+	
+	uint64_t sleep_end;		// wake up time (nanoseconds since start) of a sleeping process
+	struct process_control_block *prev_sleeper, *next_sleeper; // timer wheel links; NULL if not sleeping
 
+	struct {			// stride scheduling (see scheduler.c)
+		uint32_t tickets;		// CPU share relative to other processes
+		uint32_t stride;		// STRIDE1/tickets
+		uint64_t pass;			// virtual time; the lowest pass runs next
+		uint64_t slice_start;		// when the process last got the CPU
+		uint64_t window_ns;		// CPU time since shares were last reset
+	} stride;
 
-	struct {	
-		bool created;			// a process is allowed to create only one shared memory object
-		uint8_t key;			// which shared memory object is being used, if any
-	} shared_memory;
+	struct {			// real-time (EDF) class; times in nanoseconds (see scheduler.c)
+		bool enabled;			// process is in the real-time class
+		bool active;			// a job has been released and has not completed
+		bool missed;			// the current job has been counted as a miss
+		uint64_t period_ns;		// minimum time between job releases
+		uint64_t budget_ns;		// CPU time allowed per job
+		uint64_t deadline_ns;		// relative to the job release
+		uint64_t release;		// release time of the current job
+		uint64_t abs_deadline;		// deadline of the current job
+		uint64_t used_ns;		// CPU time used by the current job
+		uint32_t jobs;			// jobs released
+		uint32_t misses;		// jobs that missed their deadline
+	} rt;
 
-	struct {
-		int wait_on;			// the mutex on which this process is waiting; -1 if none
-		uint32_t queue_index;		// the index in the wait queue if waiting on a mutex
-	} mutex;
+	struct {			// gang scheduling (see scheduler.c)
+		uint32_t id;			// explicit group (setgroup); 0 if none
+		uint32_t round;			// last gang round the process was dispatched in
+	} gang;
 
-	struct {
-		int wait_on;			// the semaphore on which this process is waiting; -1 if none
-		uint32_t queue_index;		// the index in the wait queue if waiting on a semaphore
-	} semaphore;
+	struct {			// wake up by a mutex or semaphore (see wake_process)
+		uint64_t at;			// when the process was made READY
+		WAKE_LATENCY *latency;		// where to record the time until it runs; NULL if none
+	} wake;
+
+	struct {			// user threads (see create_thread in runprogram.c)
+		uint32_t slot;			// user stack slot; 0 for the initial thread
+		struct process_control_block *join;	// thread waited for in thread_join; NULL if none
+		bool shares_mm;			// other threads kept the address space when reaped (see remove_from_processq)
+	} thread;
+
+	struct {			// kthread_wait/kthread_wake (kernel threads, and anyone waiting in read_disk)
+		bool wakeup;			// woken up while not waiting; the next kthread_wait returns at once
+	} kthread;
+
+	struct {			// CPU accounting; all times in nanoseconds
+		uint64_t user_ns;		// time spent running (outside system calls)
+		uint64_t kernel_ns;		// time spent in system calls (execute_0x94)
+		uint64_t dispatched_at;		// when the process last got the CPU
+		uint64_t wait_start;		// when the current mutex/semaphore wait began
+		uint64_t mutex_wait_ns;		// time spent waiting on mutexes
+		uint64_t sem_wait_ns;		// time spent waiting on semaphores
+		uint64_t last_cpu_ns;		// user_ns+kernel_ns at last top refresh
+		uint32_t voluntary_switches;	// gave up the CPU (blocked, slept or ended)
+		uint32_t involuntary_switches;	// CPU taken away while still READY
+		uint32_t syscalls;		// number of 0x94 system calls
+		uint32_t page_faults;		// number of page faults
+	} stats;
+
+	struct {			// cold: system calls, the console and the FPU trap
+		struct {
+			uint32_t LBA;
+			uint32_t n_sectors;
+			uint8_t image;			// IMAGE_FLAT, IMAGE_PACKED or IMAGE_ELF
+			uint64_t queued_at;		// when run queued the image for the loader
+		} disk;
+
+		struct {	
+			bool created;			// a process is allowed to create only one shared memory object
+			uint8_t key;			// which shared memory object is being used, if any
+		} shared_memory;
 
-} __attribute__ ((packed)) PCB;
+		struct {
+			int wait_on;			// the mutex on which this process is waiting; -1 if none
+			uint32_t queue_index;		// the index in the wait queue if waiting on a mutex
+		} mutex;
+
+		struct {
+			int wait_on;			// the semaphore on which this process is waiting; -1 if none
+			uint32_t queue_index;		// the index in the wait queue if waiting on a semaphore
+		} semaphore;
+
+		struct {			// FPU/SSE state, switched lazily (see exceptions.c)
+			bool used;			// the process has used the FPU; area holds its state
+			uint32_t loaded_on;		// CPU whose FPU was last loaded with this state
+			uint32_t restores;		// times the state had to be loaded after a #NM
+			uint8_t area[512] __attribute__ ((aligned (16)));	// FXSAVE (or FNSAVE) image
+		} fpu;
+	} cold __attribute__ ((aligned (CACHE_LINE)));
+
+} __attribute__ ((aligned (CACHE_LINE))) PCB;
 
 /*** Queue ***/
 typedef struct {
@@ -250,6 +449,9 @@ typedef struct {
 	uint32_t creator;	// pid of process who created the mutex object
 	PCB *lock_with;		// PCB of process who currently owns the lock
 	QUEUE waitq;		// the waiting queue
+	uint32_t waits;		// number of lock requests that had to wait
+	uint64_t wait_ns;	// total time processes spent waiting for the lock
+	WAKE_LATENCY latency;	// from unlock to the next owner running
 } MUTEX;
 
 /*** Semaphore ***/
@@ -258,6 +460,9 @@ typedef struct {
 	uint32_t creator;	// pid of process who created the semaphore object
 	int value;		// current value of semaphore
 	QUEUE waitq;		// the waiting queue
+	uint32_t waits;		// number of DOWN operations that had to wait
+	uint64_t wait_ns;	// total time processes spent waiting in DOWN
+	WAKE_LATENCY latency;	// from UP to the woken process running
 } SEMAPHORE;
 
 /*** Shared memory ***/
@@ -267,6 +472,331 @@ typedef struct {
 	uint32_t size;		// size (in bytes) of shared memory area
 } SHMEM;
 
+/*** Spinlock ***/
+// Take with interrupts disabled on the local CPU (or use the
+// _irqsave variants), otherwise an interrupt handler may spin
+// on a lock its own CPU holds
+typedef struct {
+	volatile uint32_t locked;
+} spinlock_t;
+
+/*** Per-CPU state ***/
+typedef struct {
+	uint32_t id;			// index in cpus[]; 0 is the bootstrap processor (BSP)
+	uint8_t apic_id;		// local APIC ID
+	volatile bool started;		// an AP sets this once it runs kernel code
+	PCB *current;			// the process running on this CPU
+	PCB *idle;			// runs when nothing else can (the console on the BSP)
+	PCB idle_pcb;			// idle context of an AP; of the BSP while the console waits (see idle_context)
+	uint64_t global_pass;		// pass of the last stride process picked here
+	PCB *handoff;			// woken up by the running process; runs next (directed yield)
+	PCB *yield_from;		// gave up the CPU with yield; runs only if nothing else can
+	uint32_t gang;			// gang whose members run back-to-back here; 0 if none
+	uint32_t gang_round;		// round of that gang
+	PCB *fpu_owner;			// process whose FPU state was last loaded here
+	bool fpu_live;			// the FPU is in use (TS clear) and must be saved on a switch
+	uint64_t slice_end;		// the current process is preempted at the first tick after this
+	volatile bool need_resched;	// a process became READY here; the next tick must schedule
+	uint64_t tick_tsc;		// TSC at the start of a tick that went on to schedule; 0 if none
+	uint32_t boot_stack;		// top of the stack an AP starts on; its idle context keeps it
+	uint64_t switch_tsc;		// TSC when the running context began to switch away; 0 if not
+	TSS_STRUCTURE tss;		// this CPU's Task State Segment
+
+	struct {
+		uint32_t switches;		// dispatches of a different process
+		uint32_t steals;		// processes taken from another CPU's queue
+		uint32_t ticks;			// timer interrupts
+		uint32_t fast_ticks;		// of those, returned at once (quantum left)
+		uint64_t fast_cycles;		// TSC cycles spent in fast ticks
+		uint64_t full_cycles;		// TSC cycles from the other ticks to the next dispatch
+		uint64_t switch_cycles;		// TSC cycles spent in switch_context, over all switches
+	} stats;
+} CPU;
+
+/*** Scheduling policy ***/
+// Hooks are called with sched_lock held; all but pick_next may be NULL
+typedef struct {
+	char *name;
+	uint32_t quantum_us;		// time slice of a process that did not ask for its own
+	void (*enqueue)(PCB *);		// p was added to the process queue
+	void (*dequeue)(PCB *);		// p is about to be removed from the process queue
+	PCB *(*pick_next)(CPU *);	// the process to run next on a CPU (its idle context if none)
+	void (*tick)(uint64_t);		// every epoch (on the BSP), with the current time
+	void (*wakeup)(PCB *);		// p became READY after waiting
+} SCHED_POLICY;
+
+/*** Statistics of the running policy ***/
+typedef struct {
+	uint64_t since;			// when the statistics were reset
+	uint32_t completed;		// processes (and threads) that ended
+	uint32_t switches;		// dispatches of a different process, all CPUs
+	uint32_t wakeups;		// woken processes that were dispatched
+	uint64_t wake_ns;		// sum of their wake up to run latencies
+	uint32_t wake_hist[WAKE_HIST_BUCKETS];	// latency histogram (see WAKE_HIST_BUCKETS)
+} SCHED_STATS;
+
+/*** Program loader statistics (see load_programs) ***/
+typedef struct {
+	uint32_t loads;			// images read into memory
+	uint32_t failures;		// images that could not be read
+	uint64_t queue_ns;		// sum of the times from run to the start of the read
+	uint64_t max_queue_ns;		// longest of those
+	uint64_t read_ns;		// sum of the times spent reading
+	uint64_t sectors;		// sectors read
+	uint64_t bytes;			// bytes of program put in memory
+	uint32_t packed;		// images that were packed (see unpack.c)
+	uint64_t unpack_ns;		// sum of the times spent unpacking them
+	uint32_t elf;			// images that were ELF executables (see elf.c)
+} LOAD_STATS;
+
+/*** ELF32 file header (first bytes of an executable) ***/
+typedef struct {
+	uint8_t ident[16];		// 0x7F 'E' 'L' 'F', class, byte order, ...
+	uint16_t type;			// 2: executable
+	uint16_t machine;		// 3: i386
+	uint32_t version;
+	uint32_t entry;			// logical address of the first instruction
+	uint32_t phoff;			// program headers, from the start of the file
+	uint32_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;		// sizeof(ELF_PHDR)
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+} __attribute__ ((packed)) ELF_HEADER;
+
+/*** ELF32 program header ***/
+typedef struct {
+	uint32_t type;			// ELF_PT_LOAD, or ignored
+	uint32_t offset;		// segment bytes in the file
+	uint32_t vaddr;			// logical address of the segment
+	uint32_t paddr;
+	uint32_t filesz;		// bytes in the file
+	uint32_t memsz;			// bytes in memory; those after filesz are zero (bss)
+	uint32_t flags;			// ELF_PF_*
+	uint32_t align;
+} __attribute__ ((packed)) ELF_PHDR;
+
+/*** Physical region descriptor of a DMA read (see build_prd_table) ***/
+typedef struct {
+	uint32_t base;			// physical address; even
+	uint16_t count;			// bytes; 0 means 64KB
+	uint16_t flags;			// bit 15 marks the last entry
+} __attribute__ ((packed)) PRD;
+
+/*** A process waiting for a read it did not submit (see wait_disk_request) ***/
+typedef struct disk_waiter {
+	struct process_control_block *process;
+	struct disk_waiter *next;
+} DISK_WAITER;
+
+/*** A read waiting for, or on, the ATA channel (see read_disk) ***/
+typedef struct disk_request {
+	uint32_t LBA;
+	uint8_t n_sectors;		// 0 means 256
+	uint8_t mode;			// DISK_PIO, DISK_PIO_MULTIPLE or DISK_DMA
+	uint8_t *buffer;		// logical address of the next byte to read into
+	uint32_t page_directory;	// CR3 of the requester; the address space of buffer
+	struct process_control_block *waiter;	// WAITING for it in wait_disk_request; NULL if none
+	DISK_WAITER *waiters;		// more processes WAITING for it (on their stacks)
+	uint32_t sectors_left;		// PIO: sectors not yet copied
+	volatile bool done;		// the read is over; status is final
+	uint8_t status;			// NO_ERROR or a DISK_ERROR code
+	uint64_t queued_at;		// when it was submitted
+	uint64_t busy_ns;		// CPU time spent on the command (first request of a chain)
+	uint32_t chain_sectors;		// sectors of the command (first request of a chain)
+	struct disk_request *merged;	// the next request read by the same command (see elevator_add)
+	struct disk_request *next;	// the chain after this one in the I/O queue
+} DISK_REQUEST;
+
+/*** A PCI function (see init_pci) ***/
+typedef struct {
+	uint8_t bus, dev, fn;
+	uint16_t vendor;
+	uint16_t device;
+	uint8_t class;
+	uint8_t subclass;
+	uint8_t irq;			// ISA IRQ of its interrupt pin, as the BIOS set it; 0xFF if none
+} PCI_FUNCTION;
+
+/*** Where the MP table sends a PCI interrupt (see route_pci_irq) ***/
+typedef struct {
+	uint8_t bus, dev;
+	uint8_t pin;			// 0 for INTA#, ... 3 for INTD#
+	uint8_t gsi;			// pin of the I/O APIC
+	uint16_t flags;			// polarity (bits 0-1) and trigger mode (bits 2-3); 0 is the PCI default
+} PCI_ROUTE;
+
+/*** virtqueue descriptor (see virtio.c) ***/
+typedef struct {
+	uint64_t addr;			// physical address
+	uint32_t len;
+	uint16_t flags;			// VRING_DESC_F_NEXT, VRING_DESC_F_WRITE
+	uint16_t next;			// the next descriptor of the chain (or of the free list)
+} __attribute__ ((packed)) VRING_DESC;
+
+#define VRING_DESC_F_NEXT	1		// the chain goes on at next
+#define VRING_DESC_F_WRITE	2		// the device writes the buffer
+
+/*** Chains given to the device ***/
+typedef struct {
+	uint16_t flags;
+	volatile uint16_t idx;		// where the next entry goes (free running)
+	uint16_t ring[];		// head descriptors
+} __attribute__ ((packed)) VRING_AVAIL;
+
+/*** Chains the device is done with ***/
+typedef struct {
+	uint16_t flags;
+	volatile uint16_t idx;		// where the device puts the next entry (free running)
+	struct {
+		uint32_t id;		// head descriptor
+		uint32_t len;		// bytes written
+	} __attribute__ ((packed)) ring[];
+} __attribute__ ((packed)) VRING_USED;
+
+/*** First descriptor of a virtio-blk request ***/
+typedef struct {
+	uint32_t type;			// 0: read (VIRTIO_BLK_T_IN)
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__ ((packed)) VIRTIO_BLK_HEADER;
+
+/*** AHCI command header: one per command slot (see ahci.c) ***/
+typedef struct {
+	uint16_t flags;			// bits 0-4: length of the command FIS in dwords; bit 6: write
+	uint16_t prdt_length;		// entries of the PRD table
+	volatile uint32_t prd_bytes;	// bytes transferred so far
+	uint32_t table;			// physical address of the command table; 128 bytes aligned
+	uint32_t table_high;
+	uint32_t reserved[4];
+} __attribute__ ((packed)) AHCI_CMD_HEADER;
+
+/*** AHCI physical region descriptor ***/
+typedef struct {
+	uint32_t base;			// physical address; even
+	uint32_t base_high;
+	uint32_t reserved;
+	uint32_t count;			// bits 0-21: bytes - 1 (an odd number); bit 31: interrupt when done
+} __attribute__ ((packed)) AHCI_PRD;
+
+/*** AHCI command table ***/
+typedef struct {
+	uint8_t fis[64];		// the command FIS
+	uint8_t atapi[16];		// ATAPI command (not used)
+	uint8_t reserved[48];
+	AHCI_PRD prdt[AHCI_MAX_PRDS];
+} __attribute__ ((packed)) AHCI_CMD_TABLE;
+
+/*** I/O scheduling policy (see iosched.c) ***/
+// pick is called with disk_lock held, with the queue not empty
+typedef struct {
+	char *name;
+	DISK_REQUEST *(*pick)(void);	// the chain to start next
+} IO_SCHEDULER;
+
+/*** Statistics of the running I/O scheduler ***/
+typedef struct {
+	uint64_t since;			// when the statistics were reset
+	uint32_t requests;		// requests submitted
+	uint32_t completed;		// requests done
+	uint32_t merges;		// requests that joined a waiting one
+	uint32_t dispatches;		// commands sent to the drive
+	uint32_t expired;		// chains started because their deadline passed
+	uint64_t lat_ns;		// sum of the submission to done latencies
+	uint32_t depth_hist[IO_DEPTH_BUCKETS];	// requests outstanding when each one was submitted
+	uint32_t lat_hist[IO_LAT_BUCKETS];	// latency histogram (see IO_LAT_BUCKETS)
+} IO_STATS;
+
+/*** A block of the buffer cache (see bcache.c) ***/
+typedef struct buffer_block {
+	uint32_t LBA;			// first sector; a multiple of BCACHE_BLOCK_SECTORS
+	uint8_t state;			// BLOCK_EMPTY, BLOCK_READING or BLOCK_VALID
+	bool read_ahead;		// brought in by read-ahead and not used yet
+	uint32_t users;			// readers copying from it or waiting for it
+	uint8_t *data;			// one page of kernel memory
+	DISK_REQUEST req;		// the read that filled it
+	struct buffer_block *hash_next;	// next block in the hash chain
+	struct buffer_block *lru_prev;	// more recently used block
+	struct buffer_block *lru_next;	// less recently used block
+} BUFFER_BLOCK;
+
+/*** Buffer cache statistics (see bcache_read) ***/
+typedef struct {
+	uint32_t hits;			// blocks found in the cache (read or on their way)
+	uint32_t misses;		// blocks that had to be read
+	uint32_t evictions;		// valid blocks given up for others
+	uint32_t sequential;		// reads that started where the previous one ended
+	uint32_t ra_issued;		// blocks read ahead
+	uint32_t ra_used;		// of those, blocks that a reader then asked for
+	uint32_t ra_wasted;		// of those, blocks evicted before anyone asked
+} BCACHE_STATS;
+
+/*** Disk statistics, per mode (see read_disk) ***/
+typedef struct {
+	uint32_t reads;			// successful read_disk calls
+	uint64_t sectors;		// sectors they read
+	uint64_t busy_ns;		// time the CPU spent driving the read or moving data
+	uint64_t wait_ns;		// time spent waiting for the drive or the bus master
+} DISK_STATS;
+
+/*** Reaper statistics (see reap_processes) ***/
+typedef struct {
+	uint32_t reaped;		// processes (and threads) freed
+	uint32_t batches;		// times the reaper found any
+	uint32_t max_batch;		// most found at once
+	uint32_t frames;		// frames of address spaces freed
+	uint32_t runs;			// bitmap updates that freed them
+	uint64_t free_ns;		// sum of the times spent freeing, per process
+	uint64_t max_free_ns;		// longest of those
+} REAP_STATS;
+
+/*** A row of top: copy of the accounting data of one process (see command_top) ***/
+typedef struct {
+	bool is_console;
+	uint32_t pid;
+	char state;
+	uint32_t usage;		// CPU usage in the last interval (in 0.1% units)
+	uint32_t user_ms;
+	uint32_t kernel_ms;
+	uint32_t voluntary_switches;
+	uint32_t involuntary_switches;
+	uint32_t syscalls;
+	uint32_t page_faults;
+	uint32_t mutex_wait_ms;
+	uint32_t sem_wait_ms;
+} TOP_ROW;
+
+/*** A row of ps (see command_ps) ***/
+typedef struct {
+	uint32_t pid;
+	char state;
+	uint32_t page_directory;
+	uint32_t text;			// bytes of program
+	uint32_t stack;			// bytes of stack in use
+	uint32_t heap;			// bytes of heap
+} PS_ROW;
+
+/*** A row of shares (see command_shares) ***/
+typedef struct {
+	bool is_console;
+	uint32_t pid;
+	uint32_t tickets;
+	uint64_t window_ns;		// CPU time since the last reset
+} SHARE_ROW;
+
+/*** A row of rt (see command_rt) ***/
+typedef struct {
+	uint32_t pid;
+	uint32_t period_us;
+	uint32_t budget_us;
+	uint32_t deadline_us;
+	uint32_t jobs;
+	uint32_t misses;
+} RT_ROW;
+
 /*** main.c ***/
 int main(void);
 
@@ -275,9 +805,22 @@ void port_write_byte(uint16_t, uint8_t);
 uint8_t port_read_byte(uint16_t);
 uint16_t port_read_word(uint16_t);
 void port_write_word(uint16_t, uint16_t);
+uint32_t port_read_dword(uint16_t);
+void port_write_dword(uint16_t, uint32_t);
+void port_read_words(uint16_t, void *, uint32_t);
+
+/*** pci.c ***/
+uint32_t pci_address(uint8_t, uint8_t, uint8_t, uint8_t);
+uint32_t pci_config_read(uint8_t, uint8_t, uint8_t, uint8_t);
+void pci_config_write(uint8_t, uint8_t, uint8_t, uint8_t, uint32_t);
+bool pci_find_class(uint8_t, uint8_t, uint8_t *, uint8_t *, uint8_t *);
+void init_pci(void);
+bool pci_find_device(uint16_t, uint16_t, uint8_t *, uint8_t *, uint8_t *);
 
 /*** display.c ***/
 void init_display(void);
+uint32_t lock_display(void);
+void unlock_display(uint32_t);
 void display_character(uint8_t);
 void scroll_screen(void);
 void update_display_time(void);
@@ -300,21 +843,29 @@ void default_interrupt_handler(void);
 void install_interrupt_handler(int, void(*)(void), uint16_t, uint8_t);
 void enable_interrupts(void);
 void disable_interrupts(void);
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t);
 void setup_IDT(void);
+void load_IDT(void);
 void setup_PIC(void);
 void init_interrupts(void);
 
 /*** systemcalls.c ***/
-void setup_TSS(void);
+void setup_TSS(CPU *);
 void init_system_calls(void);
 void handler_syscall_0XFF_entry(void);
 void handler_syscall_0X94_entry(void);
-__attribute__((fastcall)) void handler_syscall_0X94(void);
-__attribute__((fastcall)) void handler_syscall_0XFF(void);
+void handler_syscall_0X94(TRAP_FRAME *);
+void handler_syscall_0XFF(void);
 
 /*** exceptions.c ***/
 void default_exception_handler(void);
 void page_fault_exception_handler(void);
+uint8_t *fpu_area(PCB *);
+void handler_fpu_entry(void);
+void fpu_not_available_handler(void);
+void switch_fpu(CPU *);
+void init_fpu(void);
 void init_exceptions(void);
 
 /*** kernelservices.c ***/
@@ -322,6 +873,15 @@ void execute_0x94(void);
 void _0x94_getc(void);
 void _0x94_printf(void);
 void _0x94_sleep(void);
+void _0x94_gettime(void);
+void _0x94_set_tickets(void);
+void _0x94_set_realtime(void);
+void _0x94_thread_create(void);
+void _0x94_thread_join(void);
+void _0x94_yield(void);
+void _0x94_set_group(void);
+void _0x94_set_quantum(void);
+void _0x94_block_read(void);
 void _0x94_mutex_create(void);
 void _0x94_mutex_destroy(void);
 void _0x94_mutex_lock(void);
@@ -348,12 +908,158 @@ void start_console(void);
 char *read_command(char *, uint16_t *);
 void command_diskdump(char *);
 void command_run(char *);
+void command_ls(void);
+void command_lspci(void);
 void command_ps(void);
+void top_row(TOP_ROW *, PCB *, uint32_t);
+void put_load(uint32_t);
+void command_top(void);
+void command_syncstat(void);
+void put_wake_latency(WAKE_LATENCY *);
+void put_share(SHARE_ROW *, uint32_t, uint32_t);
+void command_shares(char *);
+void command_rt(void);
+void command_cpus(void);
+void command_handoff(char *);
+void command_gangs(char *);
+void command_sched(char *);
+void command_quantum(char *);
+void command_loader(void);
+void command_reaper(void);
+void command_disk(char *);
+void command_diskbench(char *);
+void command_diskiops(char *);
+void command_bcache(void);
+void command_iosched(char *);
 uint8_t process_command(char *, uint16_t);
 
+/*** smp.c ***/
+CPU *this_cpu(void);
+void spin_lock(spinlock_t *);
+void spin_unlock(spinlock_t *);
+uint32_t spin_lock_irqsave(spinlock_t *);
+void spin_unlock_irqrestore(spinlock_t *, uint32_t);
+uint32_t get_cpu_count(void);
+uint8_t *map_physical(uint32_t);
+void map_mmio(uint32_t);
+bool checksum_ok(uint8_t *, uint32_t);
+bool has_signature(uint8_t *, char *, uint32_t);
+uint8_t *scan_for_signature(uint32_t, uint32_t, char *, uint32_t);
+bool parse_madt(uint8_t *);
+bool find_cpus_acpi(void);
+bool find_cpus_mp(void);
+void add_cpu(uint8_t);
+uint32_t lapic_read(uint32_t);
+void lapic_write(uint32_t, uint32_t);
+uint32_t ioapic_read(uint32_t);
+void ioapic_write(uint32_t, uint32_t);
+void route_irq(uint8_t, uint8_t, uint8_t);
+bool route_pci_irq(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t);
+void init_lapic(void);
+void start_lapic_timer(void);
+void calibrate_lapic_timer(void);
+void start_wake_timer(uint64_t);
+void send_wake_ipi(void);
+void end_of_interrupt(void);
+void end_of_lapic_interrupt(void);
+void send_ipi(uint8_t, uint32_t);
+bool start_ap(CPU *);
+void ap_main(void);
+void cpu_idle(void);
+void handler_spurious_entry(void);
+void init_smp(void);
+
+/*** kthread.c ***/
+PCB *kthread_create(void (*)(void *), void *, uint32_t);
+void kthread_yield(void);
+void kthread_exit(void);
+void kthread_wait(void);
+void kthread_wake(PCB *);
+void reap_processes(void *);
+void init_kernel_threads(void);
+
 /*** disk.c ***/
 void init_disk(void);
 uint8_t read_disk(uint32_t, uint8_t, uint8_t *);
+void ata_delay_400ns(void);
+void init_disk_multiple(uint8_t);
+void init_disk_dma(void);
+bool disk_mode_available(uint8_t);
+uint32_t disk_capacity(uint8_t);
+bool disk_irq_ready(uint8_t);
+bool set_disk_mode(uint8_t);
+uint8_t read_sectors_pio(uint32_t, uint8_t, uint8_t *, uint64_t *);
+bool build_prd_table(uint8_t *, uint32_t, uint32_t);
+bool add_prd_entries(uint32_t *, uint8_t *, uint32_t, uint32_t);
+uint8_t read_disk_with(uint8_t, uint32_t, uint8_t, uint8_t *);
+uint8_t read_disk_polled(uint8_t, uint32_t, uint8_t, uint8_t *);
+void send_read_command(uint32_t, uint8_t, uint8_t);
+void submit_disk_request(DISK_REQUEST *, uint8_t, uint32_t, uint8_t, uint8_t *);
+void wait_disk_request(DISK_REQUEST *);
+void wake_disk_waiters(PCB *, DISK_WAITER *);
+void start_disk_request(DISK_REQUEST *);
+void complete_disk_request(DISK_REQUEST *);
+bool copy_sectors(DISK_REQUEST *);
+void start_next_disk_request(void);
+void handler_disk_entry(void);
+uint32_t disk_interrupt_handler(void);
+void init_disk_interrupts(void);
+uint8_t read_sectors_multiple(uint32_t, uint8_t, uint8_t *, uint64_t *);
+uint8_t read_sectors_dma(uint32_t, uint8_t, uint8_t *, uint64_t *);
+
+/*** fs.c ***/
+void init_fs(void);
+uint32_t fs_hash(char *);
+bool fs_lookup(char *, uint32_t *, uint32_t *);
+
+/*** virtio.c ***/
+void init_virtio(void);
+void virtio_submit(DISK_REQUEST *);
+bool virtio_start(DISK_REQUEST *);
+void virtio_reap(void);
+void virtio_finish(DISK_REQUEST *, uint8_t);
+void handler_virtio_entry(void);
+uint32_t virtio_interrupt_handler(void);
+
+/*** ahci.c ***/
+uint32_t hba_read(uint32_t);
+void hba_write(uint32_t, uint32_t);
+uint32_t ahci_read(uint32_t);
+void ahci_write(uint32_t, uint32_t);
+void init_ahci(void);
+void ahci_stop_port(void);
+void ahci_start_port(void);
+void ahci_build_fis(uint32_t, uint8_t, uint32_t, uint32_t);
+bool ahci_identify_drive(void);
+void ahci_submit(DISK_REQUEST *);
+bool ahci_start(DISK_REQUEST *);
+void ahci_reap(void);
+void ahci_finish(DISK_REQUEST *, uint8_t);
+void handler_ahci_entry(void);
+uint32_t ahci_interrupt_handler(void);
+
+/*** iosched.c ***/
+void elevator_add(DISK_REQUEST *);
+DISK_REQUEST *elevator_next(void);
+void elevator_done(DISK_REQUEST *, uint64_t);
+DISK_REQUEST *noop_pick(void);
+DISK_REQUEST *clook_pick(void);
+DISK_REQUEST *deadline_pick(void);
+bool set_io_scheduler(char *);
+void reset_io_stats(void);
+
+/*** bcache.c ***/
+void init_bcache(void);
+uint32_t bcache_hash_of(uint32_t);
+BUFFER_BLOCK *bcache_lookup(uint32_t);
+void bcache_unhash(BUFFER_BLOCK *);
+void bcache_touch(BUFFER_BLOCK *);
+void bcache_settle(BUFFER_BLOCK *);
+BUFFER_BLOCK *bcache_fill(uint32_t, bool);
+void bcache_read_ahead(uint32_t);
+void bcache_prefetch(uint32_t);
+uint8_t bcache_read(uint32_t, uint8_t, uint8_t *);
+void bcache_flush(void);
 
 /*** pmemman.c ***/
 void init_physical_memory_manager(void);
@@ -362,15 +1068,19 @@ void *alloc_frames(uint32_t, bool);
 void dealloc_frames(void *,uint32_t);
 void modify_bitmap(uint32_t, uint32_t, bool);
 uint32_t bytes_to_frames(uint32_t);
+uint32_t count_free_memory(void);
 
 /*** lmemman.c ***/
+uint32_t thread_stack_base(uint32_t);
 bool init_logical_memory(PCB*, uint32_t);
 void init_kernel_pages(void);
 void load_CR3(uint32_t);
+uint32_t read_CR3(void);
 void *alloc_kernel_pages(uint32_t);
 void *alloc_user_pages(uint32_t, uint32_t, PDE *, uint32_t); 
 void dealloc_page(void *, PDE *);
-void dealloc_all_pages(PDE *);
+uint32_t dealloc_all_pages(PDE *, uint32_t *);
+uint32_t get_physical_address(uint32_t, void *);
 void zero_out_pages(void *, uint32_t);
 
 /*** mutex.c ***/
@@ -389,25 +1099,100 @@ void free_queue(QUEUE *);
 void print_queue(QUEUE *);
 void remove_queue_item(QUEUE *, uint32_t);
 
+/*** elf.c ***/
+bool is_elf_image(ELF_HEADER *, uint32_t);
+bool init_elf_memory(PCB *, ELF_HEADER *);
+bool load_elf_segment(PCB *, ELF_PHDR *, uint8_t *);
+void elf_protect(PCB *, ELF_HEADER *);
+bool load_elf_program(PCB *);
+
+/*** unpack.c ***/
+bool is_packed_image(PACK_HEADER *);
+bool unpack_block(uint8_t *, uint32_t, uint8_t *, uint32_t);
+bool unpack_fill(uint8_t *, uint32_t *, uint32_t *, uint32_t, uint32_t *, uint32_t);
+bool load_packed_program(PCB *, uint64_t *);
+
 /*** runprogram.c ***/
-void run(uint32_t, uint32_t);
+void run(uint32_t, uint32_t, uint32_t);
+uint32_t *thread_slots_of(PCB *);
+uint32_t create_thread(PCB *, uint32_t, uint32_t, uint32_t);
+bool join_thread(PCB *, uint32_t);
 bool load_disk_to_memory(uint32_t, uint32_t, uint8_t *);
+bool load_program(PCB *);
+bool load_image(PCB *, uint64_t *);
+void load_programs(void *);
 
 /*** timer.c ***/
 void init_timer(void);
 void handler_timer_entry(void);
-__attribute__((fastcall)) void timer_interrupt_handler();
+void handler_wake_entry(void);
+uint32_t wake_timer_tick(void);
+uint32_t timer_tick(void);
+void timer_interrupt_handler(TRAP_FRAME *);
 uint32_t get_uptime(void);
+uint64_t get_uptime_ns(void);
+uint32_t ns_to_ms(uint64_t);
+uint32_t ns_to_us(uint64_t);
 uint32_t get_epochs();
 uint32_t get_epoch_length();
+uint64_t read_tsc(void);
+uint32_t div64_32(uint64_t *, uint32_t);
+void calibrate_tsc(void);
+void sleep_process(PCB *, uint64_t);
+void set_wake_timer(uint64_t, uint64_t);
+uint64_t wake_sleepers(uint32_t, uint64_t);
+uint32_t timer_wheel_slot(PCB *);
+void add_to_timer_wheel(PCB *);
+void remove_from_timer_wheel(PCB *);
+void run_timer_wheel(uint64_t);
+void wait_until(uint64_t);
 
 /*** scheduler.c ***/
 void init_scheduler(void);
+PCB *idle_context(CPU *);
 PCB *add_to_processq(PCB *p);
+void insert_into_processq(PCB *p);
 PCB *remove_from_processq(PCB *p);
+uint32_t free_process(PCB *p, uint32_t *runs);
+PCB *find_sibling_thread(PCB *);
+void wake_joiners(PCB *);
+PCB *find_terminated_process(void);
+PCB *find_new_process(void);
+uint32_t least_loaded_cpu(void);
+void account_user_time(PCB *);
+void account_switch(PCB *, PCB *);
+void update_load_average(void);
+uint32_t *get_load_average(void);
+bool set_tickets(PCB *, uint32_t);
+bool set_quantum(PCB *, uint32_t);
+uint64_t slice_length(PCB *);
+void charge_cpu(PCB *);
+uint32_t rt_utilization(PCB *);
+bool set_realtime(PCB *, uint32_t, uint32_t, uint32_t);
+void start_rt_job(PCB *, uint64_t);
+void end_rt_job(PCB *, uint64_t);
+void rt_tick(uint64_t);
+PCB *steal_process(CPU *);
+PCB *stride_pick_next(CPU *);
+void stride_enqueue(PCB *);
+PCB *rr_pick_next(CPU *);
+bool set_sched_policy(char *);
+void reset_sched_stats(void);
+void wakeup(PCB *, uint64_t);
+void wake_process(PCB *, WAKE_LATENCY *);
+void terminate_process(PCB *);
+void record_wakeup(PCB *, uint64_t);
+void reset_wake_latency(WAKE_LATENCY *);
+uint32_t gang_of(PCB *);
+PCB *next_gang_member(CPU *);
+void start_gang(CPU *, PCB *);
+void gang_sync_op(PCB *);
 void schedule_something(void);
-__attribute__((fastcall)) void switch_to_kernel_process(PCB *);
-__attribute__((fastcall)) void switch_to_user_process(PCB *);
+TRAP_FRAME *init_context(PCB *, uint32_t, bool);
+PCB *switch_context(PCB *, PCB *);
+void start_context(void);
+void finish_switch(void);
+void return_from_trap(void);
 
 /*** semaphores.c ***/
 void init_semaphores(void);
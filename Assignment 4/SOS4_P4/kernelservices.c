@@ -4,16 +4,22 @@
 
 #include "kernel_only.h"
 
-extern PCB *current_process;
+extern spinlock_t sched_lock;	// from scheduler.c
 
 /*** Process the 0x94 system call ***/
 // Context of calling process is in current_process
 // EAX always has the system call number
 void execute_0x94(void) {	
+	uint64_t start;
+
+	account_user_time(current_process);
+	start = current_process->stats.dispatched_at;
+	current_process->stats.syscalls++;
+
 	current_process->state = WAITING;
 
 	// TODO: lookup from array of function pointers
-	switch (current_process->cpu.eax) {
+	switch (current_process->regs->eax) {
 		case SYSCALL_GETC: break; //_0x94_getc();  we only allow background processes here
 		case SYSCALL_PRINTF: _0x94_printf();  break;
 		case SYSCALL_SLEEP: _0x94_sleep(); break;
@@ -28,7 +34,20 @@ void execute_0x94(void) {
 		case SYSCALL_SHM_CREATE: _0x94_shm_create(); break;
 		case SYSCALL_SHM_ATTACH: _0x94_shm_attach(); break;
 		case SYSCALL_SHM_DETACH: _0x94_shm_detach(); break;
+		case SYSCALL_GETTIME: _0x94_gettime(); break;
+		case SYSCALL_SET_TICKETS: _0x94_set_tickets(); break;
+		case SYSCALL_SET_REALTIME: _0x94_set_realtime(); break;
+		case SYSCALL_THREAD_CREATE: _0x94_thread_create(); break;
+		case SYSCALL_THREAD_JOIN: _0x94_thread_join(); break;
+		case SYSCALL_YIELD: _0x94_yield(); break;
+		case SYSCALL_SET_GROUP: _0x94_set_group(); break;
+		case SYSCALL_SET_QUANTUM: _0x94_set_quantum(); break;
+		case SYSCALL_BLOCK_READ: _0x94_block_read(); break;
 	}
+
+	// time in kernel is not charged as user time
+	current_process->stats.dispatched_at = get_uptime_ns();
+	current_process->stats.kernel_ns += current_process->stats.dispatched_at - start;
 }
 
 /*** Return the keyboard scan code and SHIFT/CAPSLOCK status ***/
@@ -40,39 +59,174 @@ void _0x94_getc(void) {
 	disable_interrupts();
 
 	// returned in EDX register
-	current_process->cpu.edx = (uint32_t)key;
+	current_process->regs->edx = (uint32_t)key;
 
 	current_process->state = READY;
 }
 
 /*** Print formatted output for the user ***/
 void _0x94_printf(void) {
-	char *format = (char *)current_process->cpu.ebx;
-	va_list args = (va_list)current_process->cpu.ecx;
+	char *format = (char *)current_process->regs->ebx;
+	va_list args = (va_list)current_process->regs->ecx;
 
 	_printf(format,args,0);
 
-	current_process->cpu.edx = 1; // success
+	current_process->regs->edx = 1; // success
 
 	current_process->state = READY;
 }
 
 /*** Make process sleep ***/
 void _0x94_sleep(void) {
-	uint32_t tts = current_process->cpu.ebx;
-	current_process->sleep_end = get_epochs() + tts/get_epoch_length(); // each epoch is 10ms long	
-	current_process->state = WAITING;
+	uint32_t tts = current_process->regs->ebx; // in milliseconds
+	sleep_process(current_process, (uint64_t)tts*1000000); // in timer.c
+}
+
+/*** Return microseconds since start ***/
+void _0x94_gettime(void) {
+	uint64_t us = get_uptime_ns();
+	div64_32(&us, 1000);
+
+	// returned in EDX (low 32 bits) and ECX (high 32 bits) registers
+	current_process->regs->edx = (uint32_t)us;
+	current_process->regs->ecx = (uint32_t)(us >> 32);
+
+	current_process->state = READY;
+}
+
+/*** Change number of tickets (CPU share) ***/
+// The pick functions of other CPUs read the stride under
+// sched_lock
+void _0x94_set_tickets(void) {
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+	uint32_t old = current_process->stride.tickets;
+
+	if (set_tickets(current_process, current_process->regs->ebx))
+		current_process->regs->edx = old; // return value
+	else
+		current_process->regs->edx = 0;
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	current_process->state = READY;
+}
+
+/*** Enter or leave the real-time (EDF) class ***/
+void _0x94_set_realtime(void) {
+	uint32_t period = current_process->regs->ebx;	// in microseconds
+	uint32_t budget = current_process->regs->ecx;
+	uint32_t deadline = current_process->regs->edx;
+
+	current_process->regs->edx = set_realtime(current_process, period, budget, deadline); // return value
+
+	current_process->state = READY;
+}
+
+/*** Give up the CPU ***/
+// The process stays READY but runs again only when nothing
+// else in the run queue can
+void _0x94_yield(void) {
+	this_cpu()->yield_from = current_process;
+
+	current_process->state = READY;
+}
+
+/*** Join or leave a scheduling group (gang) ***/
+// Under sched_lock, since other CPUs pull gang members over
+void _0x94_set_group(void) {
+	uint32_t id = current_process->regs->ebx;
+	uint32_t flags;
+
+	if (id <= MAX_GANG_ID) {
+		flags = spin_lock_irqsave(&sched_lock);
+		current_process->gang.id = id;
+		spin_unlock_irqrestore(&sched_lock, flags);
+		current_process->regs->edx = TRUE; // return value
+	}
+	else current_process->regs->edx = FALSE;
+
+	current_process->state = READY;
+}
+
+/*** Change the time slice of the calling process ***/
+void _0x94_set_quantum(void) {
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+
+	current_process->regs->edx = set_quantum(current_process, current_process->regs->ebx); // return value
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	current_process->state = READY;
+}
+
+/*** Read sectors from the disk into the calling process ***/
+// Through read_disk, in the mode the disk command chose; the
+// process waits for the drive. The buffer must be mapped user
+// memory, all of it, and writable: the kernel writes with CR0.WP
+// set, so a read-only page (see elf_protect) would fault in it
+void _0x94_block_read(void) {
+	uint32_t LBA = current_process->regs->ebx;
+	uint8_t n_sectors = (uint8_t)current_process->regs->ecx;
+	uint32_t buffer = current_process->regs->edx;
+	uint32_t end = buffer + (n_sectors == 0 ? 256 : n_sectors)*512;
+	PDE *pd = (PDE *)((read_CR3() & 0xFFFFF000) + KERNEL_BASE);
+	PTE *pt;
+	uint32_t p;
+
+	current_process->regs->edx = DISK_ERROR; // return value
+	if (end <= buffer || end > KERNEL_BASE) {
+		current_process->state = READY;
+		return;
+	}
+	for (p=buffer & 0xFFFFF000; p<end; p+=4096) {
+		if (!(pd[p >> 22] & PDE_PRESENT) || (pd[p >> 22] & PDE_SIZE)) {
+			current_process->state = READY;
+			return;
+		}
+		pt = (PTE *)((pd[p >> 22] & 0xFFFFF000) + KERNEL_BASE);
+		if ((pt[(p >> 12) & 0x3FF] & (PTE_PRESENT | PTE_READ_WRITE)) != (PTE_PRESENT | PTE_READ_WRITE)) {
+			current_process->state = READY;
+			return;
+		}
+	}
+
+	// running while the read is on its way; waiting for it
+	// makes the process WAITING again
+	current_process->state = RUNNING;
+	current_process->regs->edx = read_disk(LBA, n_sectors, (uint8_t *)buffer);
+
+	current_process->state = READY;
+}
+
+/*** Start a thread in the calling process ***/
+void _0x94_thread_create(void) {
+	uint32_t entry = current_process->regs->ebx;	// user-space start routine
+	uint32_t fn = current_process->regs->ecx;		// passed on to entry
+	uint32_t arg = current_process->regs->edx;
+
+	current_process->regs->edx = create_thread(current_process, entry, fn, arg); // return value
+
+	current_process->state = READY;
+}
+
+/*** Wait for a thread of the calling process to end ***/
+void _0x94_thread_join(void) {
+	uint32_t tid = current_process->regs->ebx;
+
+	current_process->regs->edx = (tid != current_process->pid); // return value
+
+	// stays WAITING until the thread is gone
+	if (tid == current_process->pid || !join_thread(current_process, tid))
+		current_process->state = READY;
 }
 
 /*** Create a mutex ***/
 void _0x94_mutex_create(void) {
-	current_process->cpu.edx = mutex_create(current_process); // return value
+	current_process->regs->edx = mutex_create(current_process); // return value
 	current_process->state = READY;
 }
 
 /** Destroy a mutex ***/
 void _0x94_mutex_destroy(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
 	mutex_destroy(key,current_process);
 	
 	current_process->state = READY;
@@ -80,7 +234,7 @@ void _0x94_mutex_destroy(void) {
 
 /*** Obtain lock on a mutex ***/
 void _0x94_mutex_lock(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
 
 	if (mutex_lock(key,current_process)) // lock obtained
 		current_process->state = READY;
@@ -88,23 +242,24 @@ void _0x94_mutex_lock(void) {
 
 /*** Unlock a mutex ***/
 void _0x94_mutex_unlock(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
-	current_process->cpu.edx = mutex_unlock(key,current_process); // return value
+	uint8_t key = (uint8_t)current_process->regs->ebx;
+	current_process->regs->edx = mutex_unlock(key,current_process); // return value
+	if (current_process->regs->edx) gang_sync_op(current_process);
 
 	current_process->state = READY;
 }
 
 /*** Create a sempahore ***/
 void _0x94_semaphore_create(void) {
-	uint8_t init_value = (uint8_t)current_process->cpu.ebx;
-	current_process->cpu.edx = semaphore_create(init_value, current_process); // return value
+	uint8_t init_value = (uint8_t)current_process->regs->ebx;
+	current_process->regs->edx = semaphore_create(init_value, current_process); // return value
 
 	current_process->state = READY;
 }
 
 /** Destroy a semaphore ***/
 void _0x94_semaphore_destroy(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
 	semaphore_destroy(key,current_process);
 	
 	current_process->state = READY;
@@ -112,15 +267,16 @@ void _0x94_semaphore_destroy(void) {
 
 /*** UP operation on a semaphore ***/
 void _0x94_semaphore_up(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
 	semaphore_up(key,current_process);
+	gang_sync_op(current_process);
 	
 	current_process->state = READY;
 }
 
 /*** DOWN operation on a semaphore ***/
 void _0x94_semaphore_down(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
 
 	if (semaphore_down(key,current_process)) // obtained
 		current_process->state = READY;
@@ -128,20 +284,20 @@ void _0x94_semaphore_down(void) {
 
 /*** Create shared memory area ***/
 void _0x94_shm_create(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
-	uint32_t size = (uint32_t)current_process->cpu.ecx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
+	uint32_t size = (uint32_t)current_process->regs->ecx;
 
-	current_process->cpu.edx = (uint32_t) shm_create(key, size, current_process); // return value
+	current_process->regs->edx = (uint32_t) shm_create(key, size, current_process); // return value
 
 	current_process->state = READY;
 }
 
 /*** Attach to a shared memory area ***/
 void _0x94_shm_attach(void) {
-	uint8_t key = (uint8_t)current_process->cpu.ebx;
-	uint32_t mode = (uint32_t)current_process->cpu.ecx;
+	uint8_t key = (uint8_t)current_process->regs->ebx;
+	uint32_t mode = (uint32_t)current_process->regs->ecx;
 
-	current_process->cpu.edx = (uint32_t) shm_attach(key, mode, current_process); // return value
+	current_process->regs->edx = (uint32_t) shm_attach(key, mode, current_process); // return value
 
 	current_process->state = READY;
 }
@@ -169,7 +169,7 @@ done:
 	// the PIC masks interrupts when they are being serviced;
 	// notify the PIC that interrupt has been serviced,
 	// otherwise the interrupt will be ignored in future
-	port_write_byte(0x20,0x20);	
+	end_of_interrupt();	
 }
 
 
@@ -0,0 +1,185 @@
+////////////////////////////////////////////////////////
+// Kernel threads
+//
+// A kernel thread is a PCB that runs a kernel function in
+// Ring 0 on its own stack, using the kernel page directory.
+// It is in the process queue and is scheduled like any user
+// process (same tickets, same run queues); a timer interrupt
+// preempts it the same way it preempts the console.
+//
+// A thread gives up the CPU with kthread_yield, blocks with
+// kthread_wait until another CPU calls kthread_wake on it,
+// and ends with kthread_exit (or by returning from its
+// function). The reaper thread frees its stack and PCB.
+
+#include "kernel_only.h"
+
+extern PDE *k_page_directory;	// from lmemman.c
+extern spinlock_t sched_lock;	// from scheduler.c
+extern uint32_t next_pid;	// from runprogram.c
+
+PCB *reaper = NULL;	// frees TERMINATED processes (see reap_processes)
+PCB *loader = NULL;	// reads the images of NEW processes (see load_programs)
+REAP_STATS reap_stats;	// only the reaper writes it
+
+/*** Create a kernel thread ***/
+// The thread runs fn(arg) and ends when fn returns
+// Returns the PCB of the thread; NULL if out of kernel memory
+PCB *kthread_create(void (*fn)(void *), void *arg, uint32_t tickets) {
+	PCB *t;
+	uint32_t *stack;
+	TRAP_FRAME *regs;
+
+	t = (PCB *)alloc_kernel_pages(1);
+	if (t == NULL) return NULL;
+
+	stack = (uint32_t *)alloc_kernel_pages(KTHREAD_STACK_PAGES);
+	if (stack == NULL) {
+		dealloc_page(t,k_page_directory);
+		return NULL;
+	}
+	t->kstack = (uint32_t)stack;
+
+	// fn is entered as if called by kthread_exit with arg
+	stack += KTHREAD_STACK_PAGES*1024;
+	*(--stack) = (uint32_t)arg;
+	*(--stack) = (uint32_t)kthread_exit;
+
+	// the first switch to the thread "returns" into fn
+	regs = init_context(t, (uint32_t)stack, FALSE);
+	regs->cs = 0x08; // Ring 0
+	regs->eflags = 0x00000202; // interrupts enabled
+	regs->eip = (uint32_t)fn;
+
+	t->pid = next_pid++;
+	t->mem.page_directory = (PDE *)((uint32_t)k_page_directory - KERNEL_BASE);
+	t->prev_sleeper = t->next_sleeper = NULL; // not in timer wheel
+	t->cold.mutex.wait_on = -1; // not waiting on any mutex
+	t->cold.semaphore.wait_on = -1; // not waiting on any semaphore
+
+	set_tickets(t, tickets);
+
+	t->state = READY; // nothing to load
+	add_to_processq(t);
+
+	return t;
+}
+
+/*** Give up the CPU ***/
+// The thread stays READY and runs again when scheduled; the
+// switch keeps its registers on its own stack
+void kthread_yield() {
+	uint32_t flags = save_and_disable_interrupts();
+
+	if (current_process->state == RUNNING) current_process->state = READY;
+
+	account_user_time(current_process);
+
+	schedule_something();
+
+	restore_interrupts(flags);
+}
+
+/*** End the calling kernel thread ***/
+void kthread_exit() {
+	disable_interrupts();
+	current_process->state = TERMINATED;
+	kthread_yield(); // does not return
+}
+
+/*** Block the calling kernel thread until kthread_wake ***/
+// Returns at once if the thread was woken since it last waited
+void kthread_wait() {
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+
+	if (current_process->kthread.wakeup) {
+		current_process->kthread.wakeup = FALSE;
+		spin_unlock_irqrestore(&sched_lock, flags);
+		return;
+	}
+
+	current_process->state = WAITING;
+	spin_unlock(&sched_lock);
+
+	// a wake up from here on makes the thread READY again; it
+	// cannot run elsewhere before it has switched away
+	kthread_yield();
+
+	asm volatile ("pushl %0\n"
+		      "popfl\n": :"r"(flags));
+}
+
+/*** Wake up a kernel thread ***/
+// A thread that is not waiting will not block in its next
+// kthread_wait; called with sched_lock held
+void kthread_wake(PCB *t) {
+	if (t == NULL) return;
+
+	if (t->state == WAITING) wakeup(t, get_uptime_ns());
+	else t->kthread.wakeup = TRUE;
+}
+
+/*** The reaper ***/
+// Frees TERMINATED processes whenever woken up by the
+// scheduler, so that the console does not pay for it. All
+// the processes found are taken out of the process queue in
+// one go; their memory is freed after sched_lock is dropped,
+// one process at a time with interrupts off, so that a mass
+// exit does not hold up scheduling on the other CPUs
+void reap_processes(void *arg) {
+	PCB *p, *head, *tail;
+	uint32_t flags, n, runs, frames;
+	uint64_t start, t;
+
+	(void)arg; // not used
+
+	while (1) {
+		head = tail = NULL;
+		n = 0;
+
+		flags = spin_lock_irqsave(&sched_lock);
+		while ((p = find_terminated_process()) != NULL) {
+			remove_from_processq(p);
+
+			// next_PCB is free now; keep the order of removal
+			p->next_PCB = NULL;
+			if (tail == NULL) head = p;
+			else tail->next_PCB = p;
+			tail = p;
+			n++;
+		}
+		spin_unlock_irqrestore(&sched_lock, flags);
+
+		if (n != 0) {
+			reap_stats.batches++;
+			if (n > reap_stats.max_batch) reap_stats.max_batch = n;
+		}
+
+		while ((p = head) != NULL) {
+			head = p->next_PCB; // read before the PCB page goes
+
+			flags = save_and_disable_interrupts();
+			start = get_uptime_ns();
+			frames = free_process(p, &runs);
+			t = get_uptime_ns() - start;
+			restore_interrupts(flags);
+
+			reap_stats.reaped++;
+			reap_stats.frames += frames;
+			reap_stats.runs += runs;
+			reap_stats.free_ns += t;
+			if (t > reap_stats.max_free_ns) reap_stats.max_free_ns = t;
+		}
+
+		kthread_wait();
+	}
+}
+
+/*** Set up kernel threads ***/
+void init_kernel_threads() {
+	reaper = kthread_create(reap_processes, NULL, DEFAULT_TICKETS);
+	if (reaper == NULL) puts("Could not start the reaper.\n");
+
+	loader = kthread_create(load_programs, NULL, DEFAULT_TICKETS);
+	if (loader == NULL) puts("Could not start the program loader.\n");
+}
@@ -88,6 +88,148 @@ void sleep(uint32_t tts) { // SYSTEM CALL
 	asm volatile ("int $0x94\n");
 }
 
+/*** Microseconds since system start ***/
+uint64_t gettime(void) { // SYSTEM CALL
+	uint32_t lo, hi;
+
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_GETTIME)); // time function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (lo));
+	asm volatile ("movl %%ecx, %0\n": "=m" (hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/*** Change the CPU share (tickets) of calling process ***/
+// Returns the previous number of tickets; 0 if the new
+// number is out of range
+uint32_t settickets(uint32_t tickets) { // SYSTEM CALL
+	uint32_t ret;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (tickets));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_SET_TICKETS)); // set tickets function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return ret;
+}
+
+/*** Make calling process a periodic real-time task ***/
+// Every period (microseconds) the process may use up to budget
+// microseconds of CPU, to be finished within deadline of the
+// start of the period; it completes a job by blocking (e.g. sleep).
+// Returns FALSE if the parameters are invalid or the system cannot
+// admit the task. A period of 0 leaves the real-time class.
+bool setrealtime(uint32_t period, uint32_t budget, uint32_t deadline) { // SYSTEM CALL
+	bool ret;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (period));
+	asm volatile ("movl %0, %%ecx\n": :"m" (budget));
+	asm volatile ("movl %0, %%edx\n": :"m" (deadline));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_SET_REALTIME)); // set real-time function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return ret;
+}
+
+// Gives up the CPU to any other ready process
+void yield() { // SYSTEM CALL
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_YIELD)); // yield function
+	asm volatile ("int $0x94\n");
+}
+
+// Puts the calling process in scheduling group id (1-255); the
+// members of a group are run back-to-back. Processes attached to
+// the same shared memory object form a group without this.
+// 0 leaves the group. Returns FALSE if id is out of range
+bool setgroup(uint32_t id) { // SYSTEM CALL
+	bool ret;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (id));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_SET_GROUP)); // set group function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return ret;
+}
+
+// Sets the time slice of the calling process to us microseconds
+// (up to one second); the process runs that long before another
+// process of the same CPU gets a turn; slices end on a timer tick,
+// so they are rounded up to 10ms. 0 goes back to the default
+// of the scheduling policy. Returns FALSE if us is out of range
+bool setquantum(uint32_t us) { // SYSTEM CALL
+	bool ret;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (us));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_SET_QUANTUM)); // set quantum function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return ret;
+}
+
+// Reads n_sectors sectors (0 means 256) from LBA on into
+// buffer, in the mode the disk command of the console chose
+// (e.g. with NCQ on an AHCI drive); the process waits for the
+// drive. Returns NO_ERROR or a DISK_ERROR code; the whole
+// buffer must be memory of the program
+uint8_t blockread(uint32_t LBA, uint8_t n_sectors, void *buffer) { // SYSTEM CALL
+	uint32_t ret;
+	uint32_t n = n_sectors;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (LBA));
+	asm volatile ("movl %0, %%ecx\n": :"m" (n));
+	asm volatile ("movl %0, %%edx\n": :"m" (buffer));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_BLOCK_READ)); // block read function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return (uint8_t)ret;
+}
+
+/*** Thread functions ***/
+// A new thread starts running fn(arg); the thread ends when fn
+// returns or calls thread_exit. Returns the thread ID, or
+// 0xFFFFFFFF if the thread could not be created
+uint32_t thread_create(void (*fn)(void *), void *arg) { // SYSTEM CALL
+	uint32_t ret;
+	void (*entry)(void (*)(void *), void *) = thread_start;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (entry));
+	asm volatile ("movl %0, %%ecx\n": :"m" (fn));
+	asm volatile ("movl %0, %%edx\n": :"m" (arg));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_THREAD_CREATE)); // thread create function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return ret;
+}
+
+// Where every thread but the first begins
+void thread_start(void (*fn)(void *), void *arg) {
+	fn(arg);
+	thread_exit();
+}
+
+void thread_exit() { // SYSTEM CALL
+	asm volatile ("int $0xFF\n"); // same as the end of a program
+}
+
+// Blocks until thread tid has ended; returns FALSE if tid is
+// the calling thread
+bool thread_join(uint32_t tid) { // SYSTEM CALL
+	bool ret;
+
+	asm volatile ("movl %0, %%ebx\n": :"m" (tid));
+	asm volatile ("movl %0, %%eax\n": :"i" (SYSCALL_THREAD_JOIN)); // thread join function
+	asm volatile ("int $0x94\n");
+
+	asm volatile ("movl %%edx, %0\n": "=m" (ret));
+	return ret;
+}
+
 /*** Mutex functions ***/
 mutex_t mcreate() { // SYSTEM CALL
 	uint32_t ret;
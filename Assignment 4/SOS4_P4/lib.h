@@ -35,6 +35,15 @@ typedef __builtin_va_list va_list;
 #define SYSCALL_SHM_CREATE	12
 #define SYSCALL_SHM_ATTACH	13
 #define SYSCALL_SHM_DETACH	14
+#define SYSCALL_GETTIME		15
+#define SYSCALL_SET_TICKETS	16
+#define SYSCALL_SET_REALTIME	17
+#define SYSCALL_THREAD_CREATE	18
+#define SYSCALL_THREAD_JOIN	19
+#define SYSCALL_YIELD		20
+#define SYSCALL_SET_GROUP	21
+#define SYSCALL_SET_QUANTUM	22
+#define SYSCALL_BLOCK_READ	23
 	
 /*** Shared memory access ***/
 #define SM_READ_ONLY		0x00000000
@@ -161,5 +170,20 @@ void smdetach();
 
 /*** Other functions ***/
 void sleep(uint32_t);
+uint64_t gettime(void);
+uint32_t settickets(uint32_t);
+bool setrealtime(uint32_t, uint32_t, uint32_t);
+void yield(void);
+bool setgroup(uint32_t);
+bool setquantum(uint32_t);
+uint8_t blockread(uint32_t, uint8_t, void *);
+
+/*** Thread functions ***/
+// Threads share the program's memory; the program ends when its
+// last thread does (returning from main ends only that thread)
+uint32_t thread_create(void (*)(void *), void *);
+void thread_exit(void);
+bool thread_join(uint32_t);
+void thread_start(void (*)(void *), void *);
 
 
@@ -12,6 +12,13 @@ PDE *k_page_directory = (PDE *)(0xC0101000);
 // 3GB to 3GB+4MB-1 (0xC0000000 to 0xC03FFFFF)
 PTE *pages_768 = (PTE *)(0xC0102000); 
 
+/*** Lowest address of the user stack of a thread ***/
+// Slot 0 is the stack of the initial thread; the stacks of
+// other threads follow downwards, one unmapped guard page apart
+uint32_t thread_stack_base(uint32_t slot) {
+	return USER_STACK_BASE - slot*(USER_STACK_PAGES+1)*4096;
+}
+
 /*** Initialize logical memory for a process ***/
 // Allocates physical memory and sets up page tables;
 // we need to allocate memory to hold the program code and
@@ -20,13 +27,45 @@ PTE *pages_768 = (PTE *)(0xC0102000);
 // called by runprogram.c; this function does not load the 
 // program from disk to memory (done in scheduler.c)
 
-/** DO NOT UNCOMMENT THE FOLLOWING **/
-/*
 bool init_logical_memory(PCB *p, uint32_t code_size) {
-	// you implemented this in a previous assignment
-	...
+	uint32_t n_code_pages = bytes_to_frames(code_size);
+	uint32_t i;
+
+	// page directory; must come from the first 4MB so that
+	// the kernel can reach it at +KERNEL_BASE
+	PDE *page_directory = (PDE *)alloc_kernel_pages(1);
+	if (page_directory == NULL) return FALSE;
+
+	// kernel address space (including the APIC registers, see
+	// smp.c) is the same in every process
+	for (i=768; i<1024; i++) page_directory[i] = k_page_directory[i];
+
+	// alloc_user_pages zeroes the pages through their logical
+	// address, so the new address space must be the active one
+	load_CR3((uint32_t)page_directory-KERNEL_BASE);
+
+	// program code and data start at logical address 0;
+	// user-mode stack ends at 0xBFBFF000 (the kernel-mode stack
+	// is in kernel memory, see run in runprogram.c)
+	if (alloc_user_pages(n_code_pages, 0x0, page_directory, PTE_READ_WRITE) == NULL
+	    || alloc_user_pages(USER_STACK_PAGES, USER_STACK_BASE, page_directory, PTE_READ_WRITE) == NULL) {
+		load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+		dealloc_all_pages(page_directory, NULL);
+		dealloc_page(page_directory, k_page_directory);
+		return FALSE;
+	}
+
+	load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+
+	p->mem.start_code = 0x0;
+	p->mem.end_code = code_size - 1;
+	p->mem.start_brk = n_code_pages*4096;
+	p->mem.brk = p->mem.start_brk;
+	p->mem.start_stack = USER_STACK_BASE + USER_STACK_PAGES*4096; // stack grows downwards
+	p->mem.page_directory = (PDE *)((uint32_t)page_directory-KERNEL_BASE);
+
+	return TRUE;
 }
-*/
 
 /*** Initialize kernel's page directory and table ***/
 void init_kernel_pages(void) {
@@ -50,6 +89,13 @@ void load_CR3(uint32_t pd) {
 	asm volatile ("movl %eax, %cr3\n");
 }
 
+/*** Page directory in CR3 ***/
+uint32_t read_CR3(void) {
+	uint32_t pd;
+	asm volatile ("movl %%cr3, %0\n" : "=r"(pd));
+	return pd;
+}
+
 /*** Allocate logical memory for kernel***/
 // Allocates pages for kernel and returns logical address of allocated memory
 // Note: Kernel uses 0xC0000000 to 0xC0400000 for now
@@ -173,31 +219,75 @@ void dealloc_page(void *loc, PDE *p) {
 
 /*** Deallocate all pages ***/
 // Traverses the page directory and deallocs all allocated
-// pages; p is the virtual address of page directory
-void dealloc_all_pages(PDE *p) {
+// pages; p is the virtual address of page directory. Frames
+// that follow each other in physical memory (alloc_user_pages
+// usually hands them out that way) go back to the bitmap in
+// one dealloc_frames call. Returns the number of frames freed;
+// *runs (if not NULL) is set to the number of calls made
+uint32_t dealloc_all_pages(PDE *p, uint32_t *runs) {
 	uint32_t pd_entry;
-	uint32_t pt_entry;
 	uint32_t i;
-	uint32_t loc = 0;
+	uint32_t run_start = 0, run_length = 0; // the run of frames not yet freed
+	uint32_t frame;
+	uint32_t n_frames = 0, n_runs = 0;
 	PTE *pt;
 
-	while (loc < 0xC0000000) { // only freeing user area of virtual memory
-		pd_entry = loc >> 22; // top 10 bits
+	for (pd_entry=0; pd_entry<768; pd_entry++) { // only freeing user area of virtual memory
+		if (p[pd_entry] == 0) continue; // no page table here
+
+		pt = (PTE *)((p[pd_entry] & 0xFFFFF000) + KERNEL_BASE);
+		for (i=0; i<1024; i++) { // walk through page table
+			if (pt[i] == 0) continue;
+			n_frames++;
 
-		if (p[pd_entry] != 0) { // page directory entry exists
-			pt = (PTE *)((p[pd_entry] & 0xFFFFF000) + KERNEL_BASE);
-			for (i=0; i<1024; i++) { // walk through page table
-				if (pt[i] == 0) continue;
-				dealloc_page((void *)(loc + i*4096), p);
+			frame = pt[i] & 0xFFFFF000;
+			if (run_length != 0 && frame == run_start + run_length*4096) {
+				run_length++; // the run goes on
+				continue;
 			}
 
-			// dealloc page table space and mark page directory entry not present
-			dealloc_frames((void *)(p[pd_entry] & 0xFFFFF000), 1);
-			p[pd_entry] = 0;
+			if (run_length != 0) {
+				dealloc_frames((void *)run_start, run_length);
+				n_runs++;
+			}
+			run_start = frame;
+			run_length = 1;
 		}
-		
-		loc += 0x400000; // move ahead 4MB; the next page table
+
+		// dealloc page table space and mark page directory entry not present
+		dealloc_frames((void *)(p[pd_entry] & 0xFFFFF000), 1);
+		p[pd_entry] = 0;
 	}
+
+	if (run_length != 0) {
+		dealloc_frames((void *)run_start, run_length);
+		n_runs++;
+	}
+
+	if (runs != NULL) *runs = n_runs;
+	return n_frames;
+}
+
+/*** Physical address of a logical address ***/
+// Looks loc up in the page directory at physical address
+// page_directory (a CR3 value; page directories are in the
+// first 4MB, see init_logical_memory); returns 0 if loc is
+// not mapped
+uint32_t get_physical_address(uint32_t page_directory, void *loc) {
+	uint32_t entry;
+	PDE *pd = (PDE *)((page_directory & 0xFFFFF000) + KERNEL_BASE);
+	PTE *pt;
+
+	entry = pd[(uint32_t)loc >> 22];
+	if (!(entry & PDE_PRESENT)) return 0;
+	if (entry & PDE_SIZE) // a 4MB page
+		return (entry & 0xFFC00000) | ((uint32_t)loc & 0x003FFFFF);
+
+	pt = (PTE *)((entry & 0xFFFFF000) + KERNEL_BASE);
+	entry = pt[((uint32_t)loc >> 12) & 0x000003FF];
+	if (!(entry & PTE_PRESENT)) return 0;
+
+	return (entry & 0xFFFFF000) | ((uint32_t)loc & 0xFFF);
 }
 
 /*** Zero out pages ***/
@@ -205,7 +295,7 @@ void dealloc_all_pages(PDE *p) {
 void zero_out_pages(void *base, uint32_t n_pages) {
 	int i=0;
 	for (i=0; i<1024*n_pages; i++)
-		*((uint32_t *)((uint32_t)base + i)) = 0;
+		*((uint32_t *)base + i) = 0;
 }
 
 
@@ -12,12 +12,18 @@
 
 int main(void) {
 
+	init_pci();
 	init_disk();
 	init_display();
 	init_interrupts();	
 	init_keyboard();
+	init_fs();
+	init_disk_interrupts();
 	init_physical_memory_manager();
 	init_kernel_pages();
+	init_virtio();
+	init_ahci();
+	init_bcache();
 	init_scheduler();
 	init_timer();
 	init_system_calls();	
@@ -25,6 +31,8 @@ int main(void) {
 	init_mutexes();
 	init_semaphores();
 	init_shared_memory();
+	init_smp();
+	init_kernel_threads();
 
 	enable_interrupts();
 
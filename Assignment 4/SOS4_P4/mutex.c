@@ -11,6 +11,7 @@
 #include "kernel_only.h"
 
 MUTEX mx[MUTEX_MAXNUMBER];	// the mutex locks; maximum 256 of them
+spinlock_t mx_lock;		// protects mx[] (system calls run on all CPUs)
 
 /*** Initialize all mutex objects ***/
 void init_mutexes() {
@@ -32,6 +33,7 @@ mutex_t mutex_create(PCB *p) {
 	// TODO: see background material on what this function should do
 	int i;
 	int ret=0;
+	spin_lock(&mx_lock);
 	for(i=0;i<MUTEX_MAXNUMBER;i++)
 	{
 		if(mx[i].available==TRUE)
@@ -41,6 +43,9 @@ mutex_t mutex_create(PCB *p) {
 			mx[i].creator=p->pid;
 			//NULL?
 			mx[i].lock_with=NULL;
+			mx[i].waits=0;
+			mx[i].wait_ns=0;
+			reset_wake_latency(&mx[i].latency);
 			//reset waiting Q
 			//mx[i].waitq.head=0;
 			//mx[i].waitq.count=0;
@@ -48,9 +53,11 @@ mutex_t mutex_create(PCB *p) {
 				PCB *tempPCB = dequeue(&mx[i].waitq);
 			}
 
+			spin_unlock(&mx_lock);
 			return i;
 		}
 	}
+	spin_unlock(&mx_lock);
 	return 0;
 	// TODO: comment the following line before you start working
 }
@@ -67,16 +74,19 @@ mutex_t mutex_create(PCB *p) {
 void mutex_destroy(mutex_t key, PCB *p) {
 	// TODO: see background material on what this function should do
 
+		spin_lock(&mx_lock);
 		if(mx[key].creator==p->pid)
 		{
 			mx[key].available=TRUE;
-			while(mx[key].waitq.head != NULL)
+			PCB *tempPCB;
+			while((tempPCB = dequeue(&mx[key].waitq)) != NULL) // head is an index, not a pointer
 			{
-				PCB *tempPCB = dequeue(&mx[key].waitq);
-				tempPCB->state = TERMINATED;
+				tempPCB->cold.mutex.wait_on = -1; // out of the queue already
+				terminate_process(tempPCB);
 			//	sys_printf("A process was terminated because a mutex was destroyed!\n");
 			}
 		}
+		spin_unlock(&mx_lock);
 }
 
 /*** Obtain lock on mutex ***/
@@ -92,22 +102,27 @@ bool mutex_lock(mutex_t key, PCB *p) {
 	  (change lock_with) and return TRUE; 
 	  otherwise, insert the calling process into the waiting queue of the mutex, and return FALSE.
 	*/
+	  spin_lock(&mx_lock);
 	  if(mx[key].lock_with==NULL)
 		{
-			p->mutex.wait_on=-1;
+			p->cold.mutex.wait_on=-1;
 			mx[key].lock_with=p;
 			//add current to wait q
 	//	sys_printf("lock is true\n");
+			spin_unlock(&mx_lock);
 			return TRUE;
 		}
 		else
 		{
 		
 			p->state = WAITING;
-			p->mutex.wait_on=key;
-			p->mutex.queue_index=enqueue(&mx[key].waitq,p);
+			p->cold.mutex.wait_on=key;
+			p->cold.mutex.queue_index=enqueue(&mx[key].waitq,p);
+			p->stats.wait_start=get_uptime_ns();
+			mx[key].waits++;
 		//	sys_printf("lock is false\n");
 
+			spin_unlock(&mx_lock);
 			return FALSE;
 		}
 
@@ -135,15 +150,25 @@ bool mutex_unlock(mutex_t key, PCB *p) {
 	Accordingly, we will have to set lock_with, mutex.wait_on in the process PCB, and wake up the process.
 	*/
 
+	spin_lock(&mx_lock);
 	if(mx[key].lock_with==p)
 	{
 	
 		mx[key].lock_with=NULL;
 		//mx[key].available=TRUE;
 		PCB *temp=dequeue(&mx[key].waitq);
-		temp->state =READY;
-		mutex_lock(key,temp);
+		if (temp != NULL) {
+			uint64_t waited = get_uptime_ns() - temp->stats.wait_start;
+			temp->stats.mutex_wait_ns += waited;
+			mx[key].wait_ns += waited;
+
+			// hand the lock over (what mutex_lock does for a free lock)
+			temp->cold.mutex.wait_on=-1;
+			mx[key].lock_with=temp;
+			wake_process(temp, &mx[key].latency);
+		}
 	//	sys_printf("unlock is true\n");
+		spin_unlock(&mx_lock);
 		return TRUE;
 		/*
 		if(mutex_lock(key,temp))
@@ -157,6 +182,7 @@ bool mutex_unlock(mutex_t key, PCB *p) {
 	// TODO: comment the following line before you start working
 	//sys_printf("unlock is false\n");
 
+	spin_unlock(&mx_lock);
 	return FALSE;
 }
 
@@ -170,8 +196,10 @@ void free_mutex_locks(PCB *p) {
 	}
 
 	// remove from wait queue, if any
-	if (p->mutex.wait_on != -1) 
-		remove_queue_item(&mx[p->mutex.wait_on].waitq, p->mutex.queue_index);	
+	spin_lock(&mx_lock);
+	if (p->cold.mutex.wait_on != -1) 
+		remove_queue_item(&mx[p->cold.mutex.wait_on].waitq, p->cold.mutex.queue_index);	
+	spin_unlock(&mx_lock);
 }
 
 
@@ -0,0 +1,32 @@
+////////////////////////////////////////////////////////
+// Packed (compressed) program images
+//
+// Shared by the kernel (see unpack.c) and the host tool that
+// packs the programs (see build/pack.c); whoever includes it
+// provides the uintN_t types
+//
+// A PACK_HEADER, then the program in blocks of PACK_BLOCK_SIZE
+// bytes (the last one shorter), each unpacking on its own.
+// A block is a 32-bit length, then that many bytes: the block
+// as it is if PACK_STORED is set in the length (it did not
+// get any smaller), else LZ4 sequences:
+//	token: literal count (high 4 bits), match length - 4 (low 4 bits);
+//	       15 means more follows, in bytes added up until one is not 255
+//	the literals
+//	match offset: 2 bytes, little endian; the match starts that
+//	       many bytes back in the block (and may overlap its copy)
+// The last sequence of a block has literals only; it ends
+// where the block does
+
+#define PACK_MAGIC		0x5A534F53	// "SOSZ"
+#define PACK_BLOCK_SIZE		4096		// a page of the program per block
+#define PACK_STORED		0x80000000	// the block is not compressed
+#define PACK_MIN_MATCH		4		// shortest match a sequence has
+
+/*** The header (first bytes of the image) ***/
+typedef struct {
+	uint32_t magic;			// PACK_MAGIC
+	uint32_t size;			// bytes of the program once unpacked
+	uint32_t blocks;		// (size + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE
+	uint32_t reserved;
+} PACK_HEADER;
@@ -0,0 +1,96 @@
+////////////////////////////////////////////////////////
+// PCI configuration space
+//
+// Uses configuration mechanism #1: the address of a 32-bit
+// register (bus, device, function, offset) is written to
+// port 0xCF8 and the register is then read or written at
+// port 0xCFC. The functions present are enumerated once, at
+// boot (see init_pci); drivers look for theirs in the table.
+
+#include "kernel_only.h"
+
+PCI_FUNCTION pci_functions[MAX_PCI_FUNCTIONS];
+uint32_t n_pci_functions = 0;
+
+/*** Address of a configuration register ***/
+uint32_t pci_address(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t offset) {
+	return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)(dev & 0x1F) << 11)
+		| ((uint32_t)(fn & 0x07) << 8) | (offset & 0xFC);
+}
+
+/*** Read a 32-bit configuration register ***/
+uint32_t pci_config_read(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t offset) {
+	port_write_dword(0xCF8, pci_address(bus, dev, fn, offset));
+	return port_read_dword(0xCFC);
+}
+
+/*** Write a 32-bit configuration register ***/
+void pci_config_write(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t offset, uint32_t value) {
+	port_write_dword(0xCF8, pci_address(bus, dev, fn, offset));
+	port_write_dword(0xCFC, value);
+}
+
+/*** Enumerate the PCI functions ***/
+// Every function of every device on every bus is entered in
+// pci_functions (the first MAX_PCI_FUNCTIONS of them)
+void init_pci(void) {
+	uint32_t b, d, f, id, cc;
+	PCI_FUNCTION *p;
+
+	for (b=0; b<256; b++) {
+		for (d=0; d<32; d++) {
+			for (f=0; f<8; f++) {
+				id = pci_config_read(b, d, f, 0x00);
+				if ((id & 0xFFFF) == 0xFFFF) { // no such function
+					if (f == 0) break; // nor device
+					continue;
+				}
+
+				if (n_pci_functions < MAX_PCI_FUNCTIONS) {
+					cc = pci_config_read(b, d, f, 0x08); // class, subclass, prog IF, revision
+					p = &pci_functions[n_pci_functions++];
+					p->bus = b; p->dev = d; p->fn = f;
+					p->vendor = (uint16_t)id;
+					p->device = (uint16_t)(id >> 16);
+					p->class = (uint8_t)(cc >> 24);
+					p->subclass = (uint8_t)(cc >> 16);
+					p->irq = (uint8_t)pci_config_read(b, d, f, 0x3C); // interrupt line
+				}
+
+				// functions 1..7 exist only on multi-function devices
+				if (f == 0 && !((pci_config_read(b, d, 0, 0x0C) >> 16) & 0x80)) break;
+			}
+		}
+	}
+}
+
+/*** Find a PCI function by class and subclass ***/
+// Returns TRUE and the location of the first match in *bus,
+// *dev and *fn, FALSE if there is none
+bool pci_find_class(uint8_t class, uint8_t subclass, uint8_t *bus, uint8_t *dev, uint8_t *fn) {
+	uint32_t i;
+
+	for (i=0; i<n_pci_functions; i++) {
+		if (pci_functions[i].class != class || pci_functions[i].subclass != subclass) continue;
+
+		*bus = pci_functions[i].bus; *dev = pci_functions[i].dev; *fn = pci_functions[i].fn;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*** Find a PCI function by vendor and device ID ***/
+// As pci_find_class
+bool pci_find_device(uint16_t vendor, uint16_t device, uint8_t *bus, uint8_t *dev, uint8_t *fn) {
+	uint32_t i;
+
+	for (i=0; i<n_pci_functions; i++) {
+		if (pci_functions[i].vendor != vendor || pci_functions[i].device != device) continue;
+
+		*bus = pci_functions[i].bus; *dev = pci_functions[i].dev; *fn = pci_functions[i].fn;
+		return TRUE;
+	}
+
+	return FALSE;
+}
@@ -16,6 +16,8 @@ extern uint64_t total_memory;
 
 uint32_t total_frames; // max 16384 (*4KB = 64MB)
 
+spinlock_t mem_lock;	// protects the bitmap; CPUs allocate concurrently
+
 
 /*** Initialize physical memory manager ***/
 void init_physical_memory_manager(void) {
@@ -40,11 +42,13 @@ void init_physical_memory_manager(void) {
 void *alloc_frames(uint32_t n_frames, bool mode) {
 	int i;
 	uint32_t *alloc_base = NULL; // memory address to return
+	uint32_t flags;
 
 	if (mode==KERNEL_ALLOC && n_frames > (total_frames-264)) return NULL;
 	if (mode==USER_ALLOC && n_frames > (total_frames-1024)) return NULL;
 
 	uint32_t start_frame;
+	flags = spin_lock_irqsave(&mem_lock);
 	if (mode==KERNEL_ALLOC)
 		start_frame = find_frames(n_frames,264,1023); // kernel memory always from first 4MB
 	else 
@@ -56,6 +60,7 @@ void *alloc_frames(uint32_t n_frames, bool mode) {
 		// update memory bitmap
 		modify_bitmap(start_frame,n_frames,0);
 	}
+	spin_unlock_irqrestore(&mem_lock, flags);
 	
 	return (void *)alloc_base;
 }
@@ -116,6 +121,12 @@ void modify_bitmap(uint32_t start_frame, uint32_t n_frames, bool set) {
 		if (j==8) { // move on to next 8 bits
 			j=0;
 			i++;
+
+			// whole bytes at a time in the middle of a run
+			while (n_frames >= 8) {
+				mem_bitmap[i++] = set ? 0xFF : 0x00;
+				n_frames -= 8;
+			}
 		}
 	}
 }
@@ -125,7 +136,10 @@ void modify_bitmap(uint32_t start_frame, uint32_t n_frames, bool set) {
 // corrsponding to physical address <loc>
 void dealloc_frames(void *loc, uint32_t n_frames) {
 	uint32_t start_frame = ((uint32_t)loc)/4096; // address to frame number
+	uint32_t flags = spin_lock_irqsave(&mem_lock);
+
 	modify_bitmap(start_frame, n_frames, 1);
+	spin_unlock_irqrestore(&mem_lock, flags);
 }
 
 
@@ -5,32 +5,179 @@
 #include "kernel_only.h"
 
 
-extern PCB *current_process; // from scheduler.c
 extern PDE *k_page_directory; // from lmemman.c
+extern PCB *processq_next; // from scheduler.c
+extern spinlock_t sched_lock; // from scheduler.c
+extern CPU cpus[MAX_CPUS]; // from smp.c
+extern PCB *reaper, *loader; // from kthread.c
 
 uint32_t next_pid = 0;
+LOAD_STATS load_stats;
+uint32_t thread_slots[1024];	// user stack slots taken in each address space (see thread_slots_of); sched_lock
 
 /*** Parallel execution of a program ***/
-// Loads n_sector number of sectors
-// starting from sector LBA in disk and adds PCB to ready queue; 
+// Queues n_sector number of sectors starting from sector LBA
+// in disk for the loader and adds PCB to the process queue;
 // control returns to console, a.k.a. multi-tasking system;
 // programs run as background processes (blocks forever if getc is used)
+// tickets decides the process's share of the CPU (see scheduler.c)
+// The console does not touch the disk here: the loader finds out
+// what the image is and sets up the address space (see load_image)
 
-/** DO NOT UNCOMMENT THE FOLLOWING ***/
-/*
-void run(uint32_t LBA, uint32_t n_sectors) {
-	// you implemented this in a previous assignment
-	...
+void run(uint32_t LBA, uint32_t n_sectors, uint32_t tickets) {
+	PCB *user_program = NULL;
+	void *kstack;
+	TRAP_FRAME *regs;
+	uint32_t flags;
 
-	user_program->mutex.wait_on = -1; // not waiting on any mutex
-	user_program->semaphore.wait_on = -1; // not waiting on any semaphore
-	user_program->shared_memory.created = FALSE; // no shared memory objects yet
+	// request memory for PCB and its kernel stack
+	user_program = (PCB *)alloc_kernel_pages(1);
+	kstack = alloc_kernel_pages(KSTACK_PAGES);
 
-	// add PCB to process queue and then return; process will start running when scheduled
-	add_to_processq(user_program); // in scheduler.c
+	if (user_program == NULL || kstack == NULL) {
+		if (user_program != NULL) dealloc_page(user_program,k_page_directory);
+		if (kstack != NULL) dealloc_page(kstack,k_page_directory);
+		puts("run: Not enough kernel memory.\n");
+		return;
+	}
+ 		
+	// create PCB for user process; the first switch to it
+	// returns to Ring 3 through its trap frame, whose stack
+	// pointer and entry point the loader fills in
+	user_program->pid = next_pid++;
+	user_program->kstack = (uint32_t)kstack;
+	regs = init_context(user_program, user_program->kstack + KSTACK_PAGES*4096, TRUE);
+	regs->ss = 0x23; // user data segment (GDT entry 4, RPL=3)
+	regs->cs = 0x1B; // user code segment (GDT entry 3, RPL=3)
+	regs->eflags = 0x00000202; // interrupts enabled
+	// general purpose registers are zero (see init_context)
+
+	user_program->state = NEW; // not yet ready to run
+	user_program->sleep_end = 0; // used when process sleeps
+	user_program->prev_sleeper = user_program->next_sleeper = NULL; // not in timer wheel
+	user_program->mem.page_directory = NULL; // no address space until loaded
+	user_program->cold.disk.LBA = LBA;  // start LBA of program on disk
+	user_program->cold.disk.n_sectors = n_sectors; // number of sectors occupied by program on disk
+
+	user_program->cold.mutex.wait_on = -1; // not waiting on any mutex
+	user_program->cold.semaphore.wait_on = -1; // not waiting on any semaphore
+	user_program->cold.shared_memory.created = FALSE; // no shared memory objects yet
+
+	set_tickets(user_program, tickets); // pass is set when queued (see stride_enqueue)
+	user_program->rt.enabled = FALSE; // best-effort until it asks otherwise
+
+	// add PCB to process queue and then return; process will start
+	// running when scheduled, once the loader has read it in
+	flags = spin_lock_irqsave(&sched_lock);
+	user_program->cold.disk.queued_at = get_uptime_ns();
+	insert_into_processq(user_program); // in scheduler.c
+	kthread_wake(loader);
+	spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/*** User stack slots taken in the address space of p ***/
+// One bit per slot; slot 0 (the initial thread) is never given
+// out. Page directories come from the first 4MB, so their frame
+// numbers tell the address spaces apart. A slot is taken by
+// create_thread and given back by free_process once the stack is
+// gone, not when the thread leaves the process queue. Used with
+// sched_lock held
+uint32_t *thread_slots_of(PCB *p) {
+	return &thread_slots[(uint32_t)p->mem.page_directory >> 12];
+}
+
+/*** Start a new thread in the address space of a process ***/
+// The thread begins at entry (in user space) as if called with
+// fn and arg; it gets its own user stack, and tickets and time
+// slice like p.
+// Runs in the address space of p (i.e. from a system call).
+// Returns the thread ID (a PID); 0xFFFFFFFF on failure
+uint32_t create_thread(PCB *p, uint32_t entry, uint32_t fn, uint32_t arg) {
+	PCB *t;
+	PDE *page_directory = (PDE *)((uint32_t)p->mem.page_directory + KERNEL_BASE);
+	uint32_t slot, *slots, *stack;
+	TRAP_FRAME *regs;
+
+	t = (PCB *)alloc_kernel_pages(1);
+	if (t == NULL) return 0xFFFFFFFF;
+	if ((t->kstack = (uint32_t)alloc_kernel_pages(KSTACK_PAGES)) == 0) {
+		dealloc_page(t,k_page_directory);
+		return 0xFFFFFFFF;
+	}
+
+	spin_lock(&sched_lock);
+
+	slots = thread_slots_of(p);
+	for (slot=1; slot<MAX_THREADS && (*slots & (1 << slot)); slot++);
+
+	if (slot == MAX_THREADS ||
+	    alloc_user_pages(USER_STACK_PAGES, thread_stack_base(slot), page_directory, PTE_READ_WRITE) == NULL) {
+		spin_unlock(&sched_lock);
+		dealloc_page((void *)t->kstack,k_page_directory);
+		dealloc_page(t,k_page_directory);
+		return 0xFFFFFFFF;
+	}
+	*slots |= 1 << slot;
+
+	// entry(fn, arg) with a null return address
+	stack = (uint32_t *)(thread_stack_base(slot) + USER_STACK_PAGES*4096);
+	*(--stack) = arg;
+	*(--stack) = fn;
+	*(--stack) = 0;
+
+	t->pid = next_pid++;
+	regs = init_context(t, t->kstack + KSTACK_PAGES*4096, TRUE);
+	regs->ss = 0x23; // user data segment (GDT entry 4, RPL=3)
+	regs->cs = 0x1B; // user code segment (GDT entry 3, RPL=3)
+	regs->esp = regs->ebp = (uint32_t)stack;
+	regs->eflags = 0x00000202; // interrupts enabled
+	regs->eip = entry;
+
+	t->mem = p->mem; // same address space
+	t->mem.start_stack = thread_stack_base(slot) + USER_STACK_PAGES*4096;
+	t->cold.disk = p->cold.disk;
+	t->thread.slot = slot;
+
+	t->prev_sleeper = t->next_sleeper = NULL; // not in timer wheel
+	t->cold.mutex.wait_on = -1; // not waiting on any mutex
+	t->cold.semaphore.wait_on = -1; // not waiting on any semaphore
+	t->cold.shared_memory.created = FALSE; // a mapping made by p is already visible
+
+	set_tickets(t, p->stride.tickets);
+	t->quantum_us = p->quantum_us;
+	t->rt.enabled = FALSE; // best-effort until it asks otherwise
+
+	t->state = READY; // code is already in memory
+	insert_into_processq(t);
+
+	spin_unlock(&sched_lock);
+
+	return t->pid;
+}
+
+/*** Wait for a thread of the same process to end ***/
+// Returns TRUE if p has to wait (it is made READY when thread tid
+// is removed from the process queue); FALSE if there is no such
+// thread running, i.e. it has already ended
+bool join_thread(PCB *p, uint32_t tid) {
+	PCB *q;
+
+	spin_lock(&sched_lock);
+
+	q = processq_next;
+	do {
+		if (q->pid == tid && q != p && !q->ring0 &&
+		    q->mem.page_directory == p->mem.page_directory) {
+			p->thread.join = q;
+			spin_unlock(&sched_lock);
+			return TRUE;
+		}
+		q = q->next_PCB;
+	} while (q != processq_next);
 
+	spin_unlock(&sched_lock);
+	return FALSE;
 }
-*/
 
 /*** Load the user program to memory ***/
 bool load_disk_to_memory(uint32_t LBA, uint32_t n_sectors, uint8_t *mem) {
@@ -41,7 +188,7 @@ bool load_disk_to_memory(uint32_t LBA, uint32_t n_sectors, uint8_t *mem) {
 	for (;n_sectors>0;) {
 		read_count = (n_sectors>=256?256:n_sectors);
 
-		status = read_disk(LBA,(read_count==256?0:read_count),mem);
+		status = bcache_read(LBA,(read_count==256?0:read_count),mem);
 		
 		if (status == DISK_ERROR_LBA_OUTSIDE_RANGE
 			|| status == DISK_ERROR_SECTORCOUNT_TOO_BIG) 
@@ -59,3 +206,132 @@ bool load_disk_to_memory(uint32_t LBA, uint32_t n_sectors, uint8_t *mem) {
 	return TRUE;
 }
 
+
+/*** Read the image of a process into its address space ***/
+// In pieces of LOAD_CHUNK_SECTORS; each is asked for with the
+// address space of p loaded (bcache_read takes it from CR3) and
+// interrupts off, so that no switch can replace it before.
+// The loader then waits for the disk like any other process
+bool load_program(PCB *p) {
+	uint32_t LBA = p->cold.disk.LBA;
+	uint32_t n_sectors = p->cold.disk.n_sectors;
+	uint8_t *mem = 0; // program code and data start at logical address 0
+	uint32_t count, flags;
+	bool loaded = TRUE;
+
+	while (n_sectors > 0 && loaded) {
+		count = (n_sectors > LOAD_CHUNK_SECTORS ? LOAD_CHUNK_SECTORS : n_sectors);
+
+		flags = save_and_disable_interrupts();
+		load_CR3((uint32_t)p->mem.page_directory);
+		loaded = load_disk_to_memory(LBA, count, mem);
+		load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+		restore_interrupts(flags);
+
+		n_sectors -= count;
+		LBA += count;
+		mem += 512*count;
+	}
+
+	return loaded;
+}
+
+/*** Set up and read in a LOADING process ***/
+// The first sector tells what the image is (and stays in the
+// buffer cache for the image loaders); an ELF program says where
+// its segments go (see elf.c), a packed image takes more memory
+// than disk (see unpack.c). The address space is built with
+// interrupts off, since a switch back to the loader would load
+// the kernel page directory in the middle of it. *unpack_ns is
+// as in load_packed_program. Returns FALSE if the image cannot
+// be read or there is not enough memory
+bool load_image(PCB *p, uint64_t *unpack_ns) {
+	uint8_t sector[512]; // first sector of the image
+	ELF_HEADER *elf = (ELF_HEADER *)sector;
+	PACK_HEADER *pack = (PACK_HEADER *)sector;
+	uint32_t n_sectors = p->cold.disk.n_sectors;
+	uint32_t flags;
+	uint8_t image;
+	bool ok;
+
+	*unpack_ns = 0;
+
+	if (bcache_read(p->cold.disk.LBA, 1, sector) != NO_ERROR) return FALSE;
+	if (is_elf_image(elf, n_sectors)) image = IMAGE_ELF;
+	else if (is_packed_image(pack)) image = IMAGE_PACKED;
+	else image = IMAGE_FLAT;
+	p->cold.disk.image = image;
+
+	flags = save_and_disable_interrupts();
+	if (image == IMAGE_ELF) ok = init_elf_memory(p, elf);
+	else ok = init_logical_memory(p, (image == IMAGE_PACKED ? pack->size : n_sectors*512));
+	restore_interrupts(flags);
+	if (!ok) {
+		puts("run: Not enough memory.\n");
+		return FALSE;
+	}
+
+	p->regs->esp = p->regs->ebp = p->mem.start_stack;
+	p->regs->eip = (image == IMAGE_ELF ? elf->entry : p->mem.start_code); // first instruction logical address
+
+	if (image == IMAGE_ELF) return load_elf_program(p);
+	if (image == IMAGE_PACKED) return load_packed_program(p, unpack_ns);
+	return load_program(p);
+}
+
+/*** The program loader ***/
+// A kernel thread that reads the images of NEW processes, oldest
+// first; a process is LOADING while its image is read and becomes
+// READY when it is in memory. The other processes, the console
+// included, keep running meanwhile
+void load_programs(void *arg) {
+	PCB *p;
+	uint32_t flags;
+	uint64_t start, waited, unpack_ns;
+	bool loaded;
+
+	(void)arg; // not used
+
+	while (1) {
+		flags = spin_lock_irqsave(&sched_lock);
+		// nobody else touches a LOADING process (not even the reaper)
+		if ((p = find_new_process()) != NULL) p->state = LOADING;
+		spin_unlock_irqrestore(&sched_lock, flags);
+
+		if (p == NULL) {
+			kthread_wait(); // until run queues another
+			continue;
+		}
+
+		start = get_uptime_ns();
+		loaded = load_image(p, &unpack_ns);
+		if (!loaded) 
+			sys_printf("run: Load error (%u,%u).\n",
+					p->cold.disk.LBA,
+					p->cold.disk.n_sectors);
+
+		flags = spin_lock_irqsave(&sched_lock);
+
+		waited = start - p->cold.disk.queued_at;
+		if (loaded) {
+			load_stats.loads++;
+			load_stats.queue_ns += waited;
+			if (waited > load_stats.max_queue_ns) load_stats.max_queue_ns = waited;
+			load_stats.read_ns += get_uptime_ns() - start;
+			load_stats.sectors += p->cold.disk.n_sectors;
+			load_stats.bytes += p->mem.end_code - p->mem.start_code + 1;
+			if (p->cold.disk.image == IMAGE_PACKED) {
+				load_stats.packed++;
+				load_stats.unpack_ns += unpack_ns;
+			}
+			else if (p->cold.disk.image == IMAGE_ELF) load_stats.elf++;
+		}
+		else load_stats.failures++;
+
+		p->state = (loaded ? READY : TERMINATED);
+		if (loaded) cpus[p->cpu_id].need_resched = TRUE;
+		else kthread_wake(reaper);
+
+		spin_unlock_irqrestore(&sched_lock, flags);
+	}
+}
@@ -1,133 +1,1020 @@
 ////////////////////////////////////////////////////////
-// A Round-Robin Scheduler with 50% share to console
+// A Stride (proportional-share) Scheduler
 // 
-// Process queue is maintained as a doubly linked list
+// Every process, the console included, holds tickets and
+// gets a share of the CPU proportional to them. A process's
+// pass advances by its stride (STRIDE1/tickets) for every
+// epoch of CPU it uses; the lowest pass runs next.
+//
+// Processes in the real-time class sit above the stride
+// classes: a READY real-time job with budget left always
+// runs first, earliest absolute deadline first (EDF).
+//
+// A process woken up by a mutex unlock or semaphore UP can be
+// handed the CPU directly (handoff), and a process that calls
+// yield runs only when nothing else in its run queue can.
+//
+// Cooperating processes (same explicit group, or attached to the
+// same shared memory object) form a gang: once one member gets a
+// CPU, the other READY members run right after it on that CPU,
+// one epoch each, before the stride order resumes.
+//
+// The choice of process is made by a pluggable policy (see
+// SCHED_POLICY): stride, or plain round-robin. The hooks run
+// with sched_lock held.
+//
+// A process keeps the CPU for its time slice: its own quantum,
+// or else the default quantum of the policy. The timer ticks every
+// epoch regardless; a tick within the slice returns at once (see
+// timer_tick) unless a process became READY on that CPU.
+//
+// Every CPU has its own run queue: the processes whose cpu_id
+// is that CPU. New processes go to the least loaded CPU; a CPU
+// with nothing of its own to run steals a READY process from
+// the CPU with the most of them.
+//
+// Kernel threads (see kthread.c) are scheduled alongside the
+// user processes; only the console and the idle contexts of
+// the CPUs are outside the process queue.
+//
+// Every process has a kernel stack of its own; a trap from Ring 3
+// leaves the registers there (TRAP_FRAME), and a context switch
+// only pushes the callee-saved registers and swaps stack pointers
+// (switch_context). sched_lock is held across the switch, so a
+// process is never picked by another CPU while still on its stack.
+//
+// Process queue is maintained as a doubly linked list; the
+// run queues are views of it. sched_lock protects the list,
+// the scheduling fields of every PCB and the timer wheel.
 // TODO: processes should be on different queues based 
 //       on their state
 
 #include "kernel_only.h"
 
-extern GDT_DESCRIPTOR gdt[6];	// from startup.S
-extern TSS_STRUCTURE TSS;	// from systemcalls.c
-
 extern PDE *k_page_directory;	// from lmemman.c
+extern CPU cpus[MAX_CPUS];	// from smp.c
+extern PCB *reaper;		// from kthread.c
 
 PCB console;	// PCB of the console (==kernel)
-PCB *current_process; // the currently running process
 PCB *processq_next = NULL; // the next user program to run
+spinlock_t sched_lock;
+bool sync_handoff = FALSE;	// woken mutex/semaphore waiters run next (see wake_process)
+/*** Scheduling policies ***/
+// The stride policy (with the EDF class, gangs and handoff) is
+// the default; "sched <name>" on the console switches policy
+SCHED_POLICY sched_policies[N_SCHED_POLICIES] = {
+	{"stride", DEFAULT_QUANTUM_US, stride_enqueue, NULL, stride_pick_next, rt_tick, NULL},
+	{"rr", DEFAULT_QUANTUM_US, NULL, NULL, rr_pick_next, NULL, NULL}
+};
+SCHED_POLICY *sched_policy = &sched_policies[0];
+SCHED_STATS sched_stats;	// since the policy was last switched (or reset)
+
+GANG_STATS gang_stats[MAX_GANGS];
+uint64_t gang_stats_since = 0;	// when gang_stats were last reset
+uint32_t gang_round = 0;	// rounds started so far (on all CPUs)
+
+/*** Load averages ***/
+// Exponentially-damped averages of the number of runnable
+// processes over 1, 5 and 15 minutes, sampled every 5 seconds;
+// fixed point with LOAD_SHIFT fraction bits
+#define LOAD_SHIFT	11
+#define LOAD_EXP_1	1884	// 2^11/exp(5sec/1min)
+#define LOAD_EXP_5	2014	// 2^11/exp(5sec/5min)
+#define LOAD_EXP_15	2037	// 2^11/exp(5sec/15min)
+uint32_t load_average[3];
 
 void init_scheduler() {
-	current_process = &console; // the first process is the console
+	uint8_t *stack;
+	TRAP_FRAME *regs;
+
+	// the first process is the console; it is also what the
+	// BSP runs when there is nothing else
+	cpus[0].id = 0;
+	cpus[0].idle = &console;
+	cpus[0].current = &console;
+
+	console.ring0 = TRUE; // runs on the boot stack
+	console.cpu_id = 0;
+	console.on_cpu = 0;
+	set_tickets(&console, DEFAULT_TICKETS);
+
+	// while the console waits (see kthread_wait) the BSP idles
+	// as an AP does, on a stack of its own (see idle_context)
+	stack = (uint8_t *)alloc_kernel_pages(1);
+	if (stack == NULL) return;
+	regs = init_context(&cpus[0].idle_pcb, (uint32_t)stack + 4096, FALSE);
+	regs->cs = 0x08; // Ring 0
+	regs->eflags = 0x00000202; // interrupts enabled
+	regs->eip = (uint32_t)cpu_idle;
+	cpus[0].idle_pcb.cpu_id = 0;
+	cpus[0].idle_pcb.on_cpu = -1;
+}
+
+/*** What CPU c runs when there is nothing else ***/
+// c->idle, except when that is the console and the console is
+// waiting: then the BSP's own idle context, so that the console
+// is not dispatched only to find its disk read still running
+PCB *idle_context(CPU *c) {
+	if (c->idle == &console && console.state == WAITING && c->idle_pcb.kesp != 0)
+		return &c->idle_pcb;
+	return c->idle;
+}
+
+/*** Set the number of tickets of a process ***/
+// Returns FALSE if the count is out of range
+bool set_tickets(PCB *p, uint32_t tickets) {
+	if (tickets == 0 || tickets > MAX_TICKETS) return FALSE;
+
+	p->stride.tickets = tickets;
+	p->stride.stride = STRIDE1 / tickets;
+	return TRUE;
+}
+
+/*** Set the time slice of a process ***/
+// us is in microseconds; 0 means the default of the policy.
+// Returns FALSE if us is out of range
+bool set_quantum(PCB *p, uint32_t us) {
+	if (us > MAX_QUANTUM_US) return FALSE;
+
+	p->quantum_us = us;
+	return TRUE;
+}
+
+/*** How long a process may run once dispatched ***/
+// In nanoseconds; a real-time job runs until its budget is used
+uint64_t slice_length(PCB *p) {
+	if (p->rt.enabled && p->rt.active)
+		return (p->rt.used_ns < p->rt.budget_ns ? p->rt.budget_ns - p->rt.used_ns : 0);
+
+	if (p->quantum_us != 0) return (uint64_t)p->quantum_us*1000;
+	return (uint64_t)sched_policy->quantum_us*1000;
+}
+
+/*** Charge a process for the CPU it used ***/
+// A real-time process consumes budget of its current job; any
+// other process has its pass moved by a full stride per epoch
+// used, so a process that blocks early pays only for what it used
+void charge_cpu(PCB *p) {
+	uint64_t now = get_uptime_ns();
+	uint64_t used = now - p->stride.slice_start;
+	uint64_t advance;
+	uint32_t g;
+
+	p->stride.window_ns += used;
+	p->stride.slice_start = now;
+
+	if ((g = gang_of(p)) != 0) gang_stats[g].cpu_ns += used;
+
+	if (p->rt.enabled) {
+		p->rt.used_ns += used;
+		// a job that blocks or ends is complete
+		if (p->rt.active && p->state != READY && p->state != RUNNING)
+			end_rt_job(p, now);
+		return;
+	}
+
+	advance = (uint64_t)p->stride.stride * ns_to_us(used);
+	div64_32(&advance, get_epoch_length()*1000);
+	p->stride.pass += advance;
+}
+
+/*** Real-time utilization of all processes except p ***/
+// Per mille; a task uses budget/deadline of the CPU (the
+// deadline is never longer than the period). Called with
+// sched_lock held
+uint32_t rt_utilization(PCB *p) {
+	PCB *q = processq_next;
+	uint32_t util = 0;
+	uint64_t u;
+
+	if (q != NULL) do {
+		if (q != p && q->rt.enabled && q->state != TERMINATED) {
+			u = (uint64_t)ns_to_us(q->rt.budget_ns) * 1000;
+			div64_32(&u, ns_to_us(q->rt.deadline_ns));
+			util += (uint32_t)u;
+		}
+		q = q->next_PCB;
+	} while (q != processq_next);
+
+	return util;
+}
+
+/*** Put a process in or out of the real-time class ***/
+// Times in microseconds; a period of 0 returns the process to
+// the stride class. Returns FALSE if the parameters are invalid
+// or admitting the process would push the total real-time
+// utilization above RT_MAX_UTIL. The check and the update are
+// one critical section, so that two admissions on different
+// CPUs cannot both fit in the same room
+bool set_realtime(PCB *p, uint32_t period, uint32_t budget, uint32_t deadline) {
+	uint64_t u;
+	uint32_t flags;
+
+	if (period != 0 && (budget == 0 || budget > deadline || deadline > period)) return FALSE;
+
+	flags = spin_lock_irqsave(&sched_lock);
+
+	if (period == 0) {
+		p->rt.enabled = FALSE;
+		spin_unlock_irqrestore(&sched_lock, flags);
+		return TRUE;
+	}
+
+	// admission control
+	u = (uint64_t)budget * 1000;
+	div64_32(&u, deadline);
+	if (rt_utilization(p) + (uint32_t)u > RT_MAX_UTIL) {
+		spin_unlock_irqrestore(&sched_lock, flags);
+		return FALSE;
+	}
+
+	p->rt.period_ns = (uint64_t)period * 1000;
+	p->rt.budget_ns = (uint64_t)budget * 1000;
+	p->rt.deadline_ns = (uint64_t)deadline * 1000;
+	p->rt.active = FALSE;
+	p->rt.missed = FALSE;
+	p->rt.used_ns = 0;
+	p->rt.jobs = 0;
+	p->rt.misses = 0;
+	p->rt.enabled = TRUE;
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	return TRUE;
+}
+
+/*** Release a job of a real-time process ***/
+// Called when the process becomes READY after completing its
+// previous job; a job that arrives sooner than one period after
+// the previous release is held back until then
+void start_rt_job(PCB *p, uint64_t now) {
+	if (p->rt.jobs == 0 || now >= p->rt.release + p->rt.period_ns)
+		p->rt.release = now;
+	else
+		p->rt.release += p->rt.period_ns;
+
+	p->rt.abs_deadline = p->rt.release + p->rt.deadline_ns;
+	p->rt.used_ns = 0;
+	p->rt.missed = FALSE;
+	p->rt.active = TRUE;
+	p->rt.jobs++;
+
+	cpus[p->cpu_id].need_resched = TRUE; // EDF may prefer it to what runs now
+}
+
+/*** Complete the current job of a real-time process ***/
+void end_rt_job(PCB *p, uint64_t now) {
+	if (!p->rt.missed && now > p->rt.abs_deadline) {
+		p->rt.missed = TRUE;
+		p->rt.misses++;
+	}
+	p->rt.active = FALSE;
+}
+
+/*** Real-time bookkeeping on every timer tick ***/
+// Counts a miss for every job still incomplete past its deadline,
+// and starts the next job (with a fresh budget) of a process that
+// has not blocked by the end of its period
+void rt_tick(uint64_t now) {
+	PCB *p = processq_next;
+
+	if (p == NULL) return;
+	do {
+		if (p->rt.enabled && p->rt.active) {
+			if (!p->rt.missed && now > p->rt.abs_deadline) {
+				p->rt.missed = TRUE;
+				p->rt.misses++;
+			}
+			if (now >= p->rt.release + p->rt.period_ns) {
+				p->rt.active = FALSE;
+				start_rt_job(p, now);
+			}
+		}
+		p = p->next_PCB;
+	} while (p != processq_next);
+}
+
+/*** Move a READY process to c from the busiest other run queue ***/
+// Returns the stolen process; NULL if no other CPU has a READY
+// process waiting
+PCB *steal_process(CPU *c) {
+	uint32_t ready[MAX_CPUS];
+	uint32_t i, victim = c->id;
+	PCB *p = processq_next;
+
+	if (p == NULL) return NULL;
+
+	for (i=0; i<MAX_CPUS; i++) ready[i] = 0;
+	do {
+		if (p->state == READY && p->on_cpu == -1) ready[p->cpu_id]++;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	for (i=0; i<get_cpu_count(); i++)
+		if (ready[i] > ready[victim]) victim = i;
+	if (victim == c->id) return NULL;
+
+	do {
+		if (p->state == READY && p->on_cpu == -1 && p->cpu_id == victim) {
+			p->cpu_id = c->id;
+			c->stats.steals++;
+			return p;
+		}
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	return NULL;
+}
+
+/*** Pick the next process to run on CPU c: the stride policy ***/
+// Only READY processes in c's run queue that no other CPU is
+// still switching away from are considered.
+// A real-time job that has been released and has budget left
+// preempts everything else; among those the earliest deadline
+// wins. Otherwise, lowest pass among the console (on the BSP,
+// unless it waits) and the user processes; processes that have been waiting are
+// brought up to the CPU's global pass so they cannot claim the
+// CPU time they did not use while away. Ties go to the console,
+// then in round-robin order. With an empty run queue the CPU
+// steals work, or else runs a process that yielded, or else its
+// idle context (see idle_context).
+PCB *stride_pick_next(CPU *c) {
+	PCB *p = processq_next;
+	PCB *next = (c->idle == &console && console.state != WAITING ? &console : NULL);
+	PCB *rt_next = NULL;
+	PCB *yielded = NULL;
+	uint64_t now = get_uptime_ns();
+	bool own = FALSE;
+
+	if (p != NULL) do {
+		if (p->state == READY && p->on_cpu == -1 && p->cpu_id == c->id) {
+			if (p == c->yield_from) yielded = p;
+			else if (p->rt.enabled) {
+				own = TRUE;
+				if (!p->rt.active) start_rt_job(p, now);
+				if (now >= p->rt.release && p->rt.used_ns < p->rt.budget_ns &&
+				    (rt_next == NULL || p->rt.abs_deadline < rt_next->rt.abs_deadline))
+					rt_next = p;
+			}
+			else {
+				own = TRUE;
+				if (p->stride.pass < c->global_pass) p->stride.pass = c->global_pass;
+				if (next == NULL || p->stride.pass < next->stride.pass) next = p;
+			}
+		}
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	if (rt_next != NULL) return rt_next;
+
+	// directed yield: a process just woken up by the previous one
+	// gets the rest of the epoch (the time until the next tick)
+	p = c->handoff;
+	if (p != NULL && p->state == READY && p->on_cpu == -1 && !p->rt.enabled) {
+		p->cpu_id = c->id;
+		return p;
+	}
+
+	// the rest of the gang that has the CPU
+	p = next_gang_member(c);
+	if (p != NULL) return p;
+
+	if (!own && steal_process(c) != NULL) return stride_pick_next(c);
+
+	if (next == NULL) next = yielded;
+	if (next == NULL) return idle_context(c);
+
+	c->global_pass = next->stride.pass;
+	start_gang(c, next);
+	return next;
+}
+
+/*** Gang of a process ***/
+// An explicit group wins over a shared memory attachment;
+// returns 0 if the process is in no gang
+uint32_t gang_of(PCB *p) {
+	if (p->gang.id != 0) return p->gang.id;
+	if (p->cold.shared_memory.created) return GANG_SHM + p->cold.shared_memory.key;
+	return 0;
+}
+
+/*** Next member of the gang running on CPU c ***/
+// The READY member with the lowest pass that has not run in the
+// current round; it is pulled over from any run queue. Returns
+// NULL (and ends the round) if there is none
+PCB *next_gang_member(CPU *c) {
+	PCB *p = processq_next;
+	PCB *next = NULL;
+
+	if (c->gang == 0 || p == NULL) return NULL;
+
+	do {
+		if (p->state == READY && p->on_cpu == -1 && !p->rt.enabled &&
+		    p != c->yield_from && p->gang.round != c->gang_round &&
+		    gang_of(p) == c->gang &&
+		    (next == NULL || p->stride.pass < next->stride.pass)) next = p;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	if (next == NULL) {
+		c->gang = 0;
+		return NULL;
+	}
+
+	if (next->stride.pass < c->global_pass) next->stride.pass = c->global_pass;
+	next->cpu_id = c->id;
+	next->gang.round = c->gang_round;
+	gang_stats[c->gang].dispatches++;
+
+	return next;
+}
+
+/*** Start a gang round on CPU c if p is in a gang ***/
+void start_gang(CPU *c, PCB *p) {
+	c->gang = gang_of(p);
+	if (c->gang == 0) return;
+
+	c->gang_round = ++gang_round;
+	p->gang.round = c->gang_round;
+	gang_stats[c->gang].rounds++;
+	gang_stats[c->gang].dispatches++;
+}
+
+/*** Count work handed on by a gang member ***/
+// A mutex unlock or semaphore UP; the measure of gang throughput
+void gang_sync_op(PCB *p) {
+	uint32_t g = gang_of(p);
+
+	if (g != 0) gang_stats[g].sync_ops++;
+}
+
+/*** Make a process waiting on a mutex or semaphore READY ***/
+// The time until it runs is recorded in l. With handoff on, the
+// process runs next on this CPU (see stride_pick_next).
+// Called with the lock of the synchronization object held;
+// takes sched_lock, which comes after it
+void wake_process(PCB *p, WAKE_LATENCY *l) {
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+
+	p->wake.latency = l;
+	wakeup(p, get_uptime_ns());
+
+	if (sync_handoff) this_cpu()->handoff = p;
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/*** Make a WAITING process READY ***/
+// at is when it was due to run (now, or the end of a sleep); the
+// time from then until it is dispatched is its wake up latency.
+// Called with sched_lock held
+void wakeup(PCB *p, uint64_t at) {
+	p->wake.at = at;
+	p->state = READY;
+	cpus[p->cpu_id].need_resched = TRUE;
+
+	if (sched_policy->wakeup != NULL) sched_policy->wakeup(p);
+}
+
+/*** End a process waiting on a destroyed mutex or semaphore ***/
+// It never runs again; the reaper is woken up to free it (no
+// switch away from it will). Called with the lock of the
+// synchronization object held; takes sched_lock
+void terminate_process(PCB *p) {
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+
+	p->state = TERMINATED;
+	kthread_wake(reaper);
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/*** Record the wake up to run latency of a process ***/
+// In the policy statistics, and in those of the synchronization
+// object that woke p, if any. Called when p is dispatched, with
+// sched_lock held
+void record_wakeup(PCB *p, uint64_t now) {
+	WAKE_LATENCY *l = p->wake.latency;
+	uint64_t t = (now > p->wake.at ? now - p->wake.at : 0);
+	uint32_t us = ns_to_us(t), b = 0;
+
+	while (us != 0 && b < WAKE_HIST_BUCKETS-1) { // bucket b: below 2^b us
+		us >>= 1;
+		b++;
+	}
+	sched_stats.wake_hist[b]++;
+	sched_stats.wakeups++;
+	sched_stats.wake_ns += t;
+
+	if (l != NULL) {
+		l->count++;
+		l->total_ns += t;
+		if (t > l->max_ns) l->max_ns = t;
+	}
+
+	p->wake.at = 0;
+	p->wake.latency = NULL;
+}
+
+/*** Clear the latency statistics of a synchronization object ***/
+void reset_wake_latency(WAKE_LATENCY *l) {
+	l->count = 0;
+	l->total_ns = 0;
+	l->max_ns = 0;
+}
+
+/*** The least loaded CPU ***/
+// The one with the fewest processes in its run queue
+uint32_t least_loaded_cpu() {
+	uint32_t count[MAX_CPUS];
+	uint32_t i, best = 0;
+	PCB *p = processq_next;
+
+	for (i=0; i<MAX_CPUS; i++) count[i] = 0;
+	if (p != NULL) do {
+		if (p->state != TERMINATED) count[p->cpu_id]++;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	for (i=1; i<get_cpu_count(); i++)
+		if (count[i] < count[best]) best = i;
+
+	return best;
+}
+
+/*** New processes start at the current virtual time ***/
+// Enqueue hook of the stride policy
+void stride_enqueue(PCB *p) {
+	p->stride.pass = cpus[p->cpu_id].global_pass;
+}
+
+/*** Pick the next process to run on CPU c: round-robin ***/
+// The policy SOS started with: on the BSP the console gets every
+// other turn (unless it waits); otherwise the READY processes of c's run queue take
+// turns in queue order. Tickets, real-time parameters, gangs and
+// handoff are ignored.
+PCB *rr_pick_next(CPU *c) {
+	PCB *p = processq_next;
+
+	if (c->idle == &console && c->current != &console && console.state != WAITING) return &console;
+
+	if (p != NULL) do {
+		if (p->state == READY && p->on_cpu == -1 && p->cpu_id == c->id && p != c->yield_from)
+			return p;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	if (steal_process(c) != NULL) return rr_pick_next(c);
+
+	p = c->yield_from;
+	if (p != NULL && p->state == READY && p->on_cpu == -1 && p->cpu_id == c->id) return p;
+
+	return idle_context(c);
+}
+
+/*** Switch to the policy called name ***/
+// Resets the policy statistics; returns FALSE if there is no
+// such policy
+bool set_sched_policy(char *name) {
+	uint32_t i, flags;
+
+	for (i=0; i<N_SCHED_POLICIES; i++) {
+		if (strcmp(name, sched_policies[i].name) != 0) continue;
+
+		flags = spin_lock_irqsave(&sched_lock);
+		sched_policy = &sched_policies[i];
+		reset_sched_stats();
+		spin_unlock_irqrestore(&sched_lock, flags);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*** Clear the policy statistics ***/
+void reset_sched_stats() {
+	uint32_t i;
+
+	sched_stats.since = get_uptime_ns();
+	sched_stats.completed = 0;
+	sched_stats.switches = 0;
+	sched_stats.wakeups = 0;
+	sched_stats.wake_ns = 0;
+	for (i=0; i<WAKE_HIST_BUCKETS; i++) sched_stats.wake_hist[i] = 0;
 }
 
 /*** Add process to process queue ***/
 // Returns pointer to added process
-
-/** DO NOT UNCOMMENT THE FOLLOWING **/
-/*
+// The queue is circular; p is added immediately before
+// processq_next, i.e. it will be the last one to get a turn
 PCB *add_to_processq(PCB *p) {
-	
-	// you implemented this in a previous assignment
-	...
-		
+	uint32_t flags = spin_lock_irqsave(&sched_lock);
+
+	insert_into_processq(p);
+
+	spin_unlock_irqrestore(&sched_lock, flags);
+
+	return p;		
+}
+
+/*** Insert a process into the process queue ***/
+// Same as add_to_processq; called with sched_lock held
+void insert_into_processq(PCB *p) {
+	p->cpu_id = least_loaded_cpu();
+	p->on_cpu = -1;
+
+	if (processq_next == NULL) {
+		processq_next = p;
+		p->next_PCB = p;
+		p->prev_PCB = p;
+	}
+	else {
+		p->next_PCB = processq_next;
+		p->prev_PCB = processq_next->prev_PCB;
+		processq_next->prev_PCB->next_PCB = p;
+		processq_next->prev_PCB = p;
+	}
+
+	// NOTE: a process is not yet READY to run since the program
+	// code has not been loaded yet; threads are
+	if (p->state == READY) cpus[p->cpu_id].need_resched = TRUE;
+
+	if (sched_policy->enqueue != NULL) sched_policy->enqueue(p);
 }
-*/
 
 /*** Remove a TERMINATED process from process queue ***/
+// Undoes what the scheduler knows about p; its memory is
+// freed later by free_process, without sched_lock
 // Returns pointer to the next process in process queue
-
-/** DO NOT UNCOMMENT THE FOLLOWING **/
-/*
+// Called with sched_lock held
 PCB *remove_from_processq(PCB *p) {
-	PCB *ret;
+	PCB *ret, *q;
+	uint32_t i;
+
+	if (p->next_PCB == p) { // last process in queue
+		processq_next = NULL;
+		ret = NULL;
+	}
+	else {
+		p->prev_PCB->next_PCB = p->next_PCB;
+		p->next_PCB->prev_PCB = p->prev_PCB;
+		if (processq_next == p) processq_next = p->next_PCB;
+		ret = p->next_PCB;
+	}
+
+	if (sched_policy->dequeue != NULL) sched_policy->dequeue(p);
+	if (!p->ring0) sched_stats.completed++;
 
-	// you implemented this in a previous assignment
-	...
+	// a process may die while sleeping
+	remove_from_timer_wheel(p);
+
+	// threads waiting in thread_join for p can go on
+	wake_joiners(p);
+
+	// the PCB page may soon hold another process
+	for (i=0; i<get_cpu_count(); i++)
+		if (cpus[i].fpu_owner == p) cpus[i].fpu_owner = NULL;
+
+	// other threads still use the address space; only the
+	// last one to go frees it. Decided here, while the
+	// process queue cannot change, in the order of removal
+	p->thread.shares_mm = FALSE;
+	if (!p->ring0 && (q = find_sibling_thread(p)) != NULL) {
+		p->thread.shares_mm = TRUE;
+
+		// the shared memory mapping is part of the address space
+		if (p->cold.shared_memory.created && !q->cold.shared_memory.created) {
+			q->cold.shared_memory.created = TRUE;
+			q->cold.shared_memory.key = p->cold.shared_memory.key;
+			p->cold.shared_memory.created = FALSE;
+		}
+	}
+
+	return ret;
+}
+
+/*** Free the memory of a removed process ***/
+// p must have been taken out with remove_from_processq;
+// processes removed together are freed in the same order.
+// Called by the reaper without sched_lock, with interrupts
+// disabled (the mutex and semaphore locks are not irqsave)
+// Returns the number of frames of the address space freed
+// and, in *runs, the number of bitmap updates that took
+uint32_t free_process(PCB *p, uint32_t *runs) {
+	PDE *page_directory = (PDE *)((uint32_t)p->mem.page_directory + KERNEL_BASE);
+	uint32_t i, base, n_frames;
+
+	*runs = 0;
 
 	// free synchronization primitives
 	free_mutex_locks(p); 
 	free_semaphores(p);
+
+	if (p->ring0) { // a kernel thread; no address space of its own
+		for (i=0; i<KTHREAD_STACK_PAGES; i++)
+			dealloc_page((void *)(p->kstack + i*4096),k_page_directory);
+		dealloc_page((void *)p,k_page_directory);
+		return 0;
+	}
+
+	// nothing runs on the kernel stack any more (see find_terminated_process)
+	for (i=0; i<KSTACK_PAGES; i++)
+		dealloc_page((void *)(p->kstack + i*4096),k_page_directory);
+
+	// the loader gave up before it had an address space (see load_image)
+	if (p->mem.page_directory == NULL) {
+		dealloc_page((void *)p,k_page_directory);
+		return 0;
+	}
+
 	free_shared_memory(p);
 
-	// free used pages
-	dealloc_all_pages((PDE *)((uint32_t) p->mem.page_directory + KERNEL_BASE));
-	// free page used to store PCB
-	dealloc_page((void *)p,(PDE *)((uint32_t) p->mem.page_directory + KERNEL_BASE));
+	// free only the stack of a thread (see remove_from_processq);
+	// create_thread may give its slot out again after that
+	if (p->thread.shares_mm) {
+		base = thread_stack_base(p->thread.slot);
+		for (i=0; i<USER_STACK_PAGES; i++)
+			dealloc_page((void *)(base + i*4096),page_directory);
+		spin_lock(&sched_lock);
+		*thread_slots_of(p) &= ~(1 << p->thread.slot);
+		spin_unlock(&sched_lock);
+		dealloc_page((void *)p,page_directory);
+		*runs = USER_STACK_PAGES;
+		return USER_STACK_PAGES;
+	}
+
+	// free used pages; the next address space in this page
+	// directory frame starts with no threads
+	n_frames = dealloc_all_pages(page_directory, runs);
+	spin_lock(&sched_lock);
+	*thread_slots_of(p) = 0;
+	spin_unlock(&sched_lock);
+	// free page used to store PCB; p cannot be used after this
+	dealloc_page((void *)p,page_directory);
 	// free frame used to store page directory
-	dealloc_frames((void *)((uint32_t)p->mem.page_directory & 0xFFFFF000), 1);
+	dealloc_frames((void *)((uint32_t)page_directory - KERNEL_BASE), 1);
 
-	// load kernel page directory
-	load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+	return n_frames;
+}
 
-	return ret;
+/*** Find another thread sharing the address space of p ***/
+// Returns NULL if there is none; called with sched_lock held
+PCB *find_sibling_thread(PCB *p) {
+	PCB *q = processq_next;
+
+	if (q == NULL || p->mem.page_directory == NULL) return NULL;
+	do {
+		if (q != p && !q->ring0 &&
+		    q->mem.page_directory == p->mem.page_directory) return q;
+		q = q->next_PCB;
+	} while (q != processq_next);
+
+	return NULL;
 }
-*/
 
-/*** Schedule a process ***/
-// Toggle between console and a user program;
-// user program is chosen from the process queue in
-// round-robin fashion
+/*** Make the threads joining p READY ***/
+// Called with sched_lock held
+void wake_joiners(PCB *p) {
+	PCB *q = processq_next;
+
+	if (q == NULL) return;
+	do {
+		if (q->thread.join == p) {
+			q->thread.join = NULL;
+			if (q->state == WAITING) wakeup(q, get_uptime_ns());
+		}
+		q = q->next_PCB;
+	} while (q != processq_next);
+}
+
+/*** Find a TERMINATED process in process queue ***/
+// Skips processes some CPU is still switching away from
+// Returns NULL if there is none
+PCB *find_terminated_process(void) {
+	PCB *p = processq_next;
+
+	if (p == NULL) return NULL;
+	do {
+		if (p->state == TERMINATED && p->on_cpu == -1) return p;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	return NULL;
+}
+
+/*** Find a NEW process in process queue ***/
+// The one queued for loading the longest ago
+// Returns NULL if there is none
+PCB *find_new_process(void) {
+	PCB *p = processq_next, *oldest = NULL;
+
+	if (p == NULL) return NULL;
+	do {
+		if (p->state == NEW && (oldest == NULL ||
+		    p->cold.disk.queued_at < oldest->cold.disk.queued_at)) oldest = p;
+		p = p->next_PCB;
+	} while (p != processq_next);
 
-/** DO NOT UNCOMMENT THE FOLLOWING **/
-/*
-void schedule_something() { // no interruption when here
-	
-	// you implemented this in a previous assignment
-	...
+	return oldest;
 }
-*/
 
-/*** Switch to kernel process described by the PCB ***/
-// We will use the "fastcall" keyword to force GCC to pass 
-// the pointer in register ECX;
-// process switched to is a kernel process; so no ring change
-__attribute__((fastcall)) void switch_to_kernel_process(PCB *p)  {
+/*** Charge time since last dispatch to a process ***/
+void account_user_time(PCB *p) {
+	uint64_t now = get_uptime_ns();
 
-	// load CPU state from process PCB
-	asm volatile ("movl %0, %%edi\n": :"m"(p->cpu.edi));
-	asm volatile ("movl %0, %%esi\n": :"m"(p->cpu.esi));
-	asm volatile ("movl %0, %%eax\n": :"m"(p->cpu.eax));
-	asm volatile ("movl %0, %%ebx\n": :"m"(p->cpu.ebx));
-	asm volatile ("movl %0, %%edx\n": :"m"(p->cpu.edx));
-	asm volatile ("movl %0, %%ebp\n": :"m"(p->cpu.ebp));
-	asm volatile ("movl %0, %%esp\n": :"m"(p->cpu.esp));
+	p->stats.user_ns += now - p->stats.dispatched_at;
+	p->stats.dispatched_at = now;
+}
+
+/*** Account for the CPU going from prev to next ***/
+// A process that leaves while READY was preempted; one that
+// blocked, slept or ended gave up the CPU voluntarily
+void account_switch(PCB *prev, PCB *next) {
+	if (prev != next) {
+		if (prev->state == READY || prev->state == RUNNING)
+			prev->stats.involuntary_switches++;
+		else
+			prev->stats.voluntary_switches++;
+	}
+
+	next->stats.dispatched_at = get_uptime_ns();
+	next->stride.slice_start = next->stats.dispatched_at;
+}
+
+/*** Sample the number of runnable processes ***/
+// Called every 5 seconds by the timer
+void update_load_average() {
+	PCB *p = processq_next;
+	uint32_t n = 0;
+
+	if (p != NULL) do {
+		if (p->state == READY || p->state == RUNNING) n++;
+		p = p->next_PCB;
+	} while (p != processq_next);
+
+	n <<= LOAD_SHIFT;
+	load_average[0] = (load_average[0]*LOAD_EXP_1 + n*((1<<LOAD_SHIFT)-LOAD_EXP_1)) >> LOAD_SHIFT;
+	load_average[1] = (load_average[1]*LOAD_EXP_5 + n*((1<<LOAD_SHIFT)-LOAD_EXP_5)) >> LOAD_SHIFT;
+	load_average[2] = (load_average[2]*LOAD_EXP_15 + n*((1<<LOAD_SHIFT)-LOAD_EXP_15)) >> LOAD_SHIFT;
+}
+
+/*** Return the 1, 5 and 15 minute load averages ***/
+// Fixed point values with 11 fraction bits
+uint32_t *get_load_average() {
+	return load_average;
+}
+
+/*** Schedule a process ***/
+// Charges the current process of this CPU for its CPU time and
+// runs the earliest-deadline real-time job, or else the process
+// with the lowest pass, from this CPU's run queue.
+// Called with interrupts disabled, from the kernel stack of the
+// current process; returns when that process runs again (never,
+// if it ended)
+void schedule_something() {
+	CPU *c = this_cpu();
+	PCB *p;
+	PCB *prev = c->current;
+
+	spin_lock(&sched_lock);
+
+	charge_cpu(prev);
+	// others may pick prev as soon as sched_lock is released, which
+	// is only after this CPU has left its stack (see finish_switch)
+	if (prev != c->idle) prev->on_cpu = -1;
+
+	// the reaper frees what is left of a process that ended
+	if (prev->state == TERMINATED) kthread_wake(reaper);
+
+	p = sched_policy->pick_next(c);
+	c->handoff = NULL;
+	c->yield_from = NULL;
+	if (p != prev) switch_fpu(c);
+	p->on_cpu = c->id;
+	c->current = p;
+	if (p != prev) {
+		c->stats.switches++;
+		sched_stats.switches++;
+	}
+	account_switch(prev, p);
+	if (p->wake.at != 0) record_wakeup(p, p->stats.dispatched_at);
+
+	// the idle context of an AP is never given a slice, so that it
+	// looks for work to steal on every tick
+	c->slice_end = (p == &c->idle_pcb ? 0 : p->stats.dispatched_at + slice_length(p));
+	c->need_resched = FALSE;
+	if (c->tick_tsc != 0) { // this was a tick that used up the slice
+		c->stats.full_cycles += read_tsc() - c->tick_tsc;
+		c->tick_tsc = 0;
+	}
 
-	// switching within the same ring; IRET requires the following in stack (see IRET details)
-	asm volatile ("pushl %0\n"::"m"(p->cpu.eflags));
-	asm volatile ("pushl %0\n": :"m"(p->cpu.cs));
-	asm volatile ("pushl %0\n": :"m"(p->cpu.eip));
+	if (!p->ring0) { // user process
+		processq_next = p->next_PCB; // round-robin among equal passes
+		p->state = RUNNING;
+	}
+	else if (p != c->idle) p->state = RUNNING; // a kernel thread
 
-	// this should be the last one to be copied
-	asm volatile ("movl %0, %%ecx\n": :"m"(p->cpu.ecx));
+	if (p != prev) {
+		if (!p->ring0) {
+			// traps from Ring 3 land on the kernel stack of p
+			c->tss.esp0 = p->kstack + KSTACK_PAGES*4096;
+			load_CR3((uint32_t)p->mem.page_directory);
+		}
+		// kernel contexts run on the kernel page directory, so no CPU
+		// holds on to the address space of a process being reaped
+		else load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
 
-	// issue IRET; see IRET details
-	asm volatile("sti\n"); // interrupts cleared in timer/syscall handler
-	asm volatile("iretl\n"); // this completes the timer/syscall interrupt
+		c->switch_tsc = read_tsc();
+		switch_context(prev, p);
+		// we are back in prev, switched to by some CPU (maybe another)
+	}
+
+	finish_switch();
 }
 
+/*** Switch from one context to another ***/
+// PCB *switch_context(PCB *prev, PCB *next)
+// Pushes the registers a C function must preserve on the stack
+// of prev, keeps the stack pointer in prev->kesp, and resumes next
+// where it last called switch_context (or at start_context, if it
+// never ran). The registers of a process interrupted in Ring 3 are
+// in the trap frame further up its kernel stack, and are restored
+// when the trap returns (return_from_trap).
+// Returns prev, in the context of next
+asm(".globl switch_context\n"
+	"switch_context: \n"
+	"movl 4(%esp), %eax\n"		// prev
+	"movl 8(%esp), %edx\n"		// next
+	"pushl %ebp\n"
+	"pushl %ebx\n"
+	"pushl %esi\n"
+	"pushl %edi\n"
+	"movl %esp, (%eax)\n"		// prev->kesp
+	"movl (%edx), %esp\n"		// next->kesp
+	"popl %edi\n"
+	"popl %esi\n"
+	"popl %ebx\n"
+	"popl %ebp\n"
+	"ret\n"
+);
 
-/*** Switch to user process described by the PCB ***/
-// We will use the "fastcall" keyword to force GCC to pass 
-// the pointer in register ECX
-// a ring change will be necessary here
+/*** Where a context starts the first time it runs ***/
+// init_context leaves its trap frame right above
+asm(".globl start_context\n"
+	"start_context: \n"
+	"call finish_switch\n"
+	"jmp return_from_trap\n"
+);
 
-/** DO NOT UNCOMMENT THE FOLLOWING **/
-/*
-__attribute__((fastcall)) void switch_to_user_process(PCB *p) {
+/*** Leave the kernel ***/
+// The stack holds the trap frame of the process; the user
+// segment selectors are loaded again if it goes back to Ring 3
+asm(".globl return_from_trap\n"
+	"return_from_trap: \n"
+	"testl $3, 36(%esp)\n" // CS of the trap frame
+	"jz 1f\n"
+	"movl $0x23, %eax\n" // user data segment selector (RPL=3)
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"movl %eax, %fs\n"
+	"movl %eax, %gs\n"
+	"1: popal\n"
+	"iretl\n"
+);
 
-	// Note: user code and data GDTs already set up in startup.S
-	// load process page table
-	asm volatile ("movl %0, %%eax\n": :"m"((uint32_t)p->mem.page_directory));
-	asm volatile ("movl %eax, %cr3\n");
+/*** Second half of a context switch ***/
+// Runs on the stack of the context switched to
+void finish_switch() {
+	CPU *c = this_cpu();
 
-	// VirtualBox nonsense: if we do not touch the TSS stack
-	// VirtualBox crashes since it does not sync the page tables
-	// corresponding to this address
-	asm volatile ("movb $0, 0xBFBFFFFF\n");
+	if (c->switch_tsc != 0) {
+		c->stats.switch_cycles += read_tsc() - c->switch_tsc;
+		c->switch_tsc = 0;
+	}
 
-	... 
-	// you implemented this in a previous assignment
+	spin_unlock(&sched_lock);
 }
-*/
 
+/*** Prepare the kernel stack of a process that never ran ***/
+// top is the end of the stack; a trap frame goes right below it
+// (without esp and ss, unless user is TRUE), and below that what
+// switch_context pops on the way to start_context. Returns the
+// trap frame, cleared, for the caller to fill in
+TRAP_FRAME *init_context(PCB *p, uint32_t top, bool user) {
+	TRAP_FRAME *regs;
+	uint32_t *stack;
+	uint32_t i;
+
+	regs = (TRAP_FRAME *)(top - sizeof(TRAP_FRAME) + (user ? 0 : 8));
+	for (i=0; i<(user ? 13 : 11); i++) ((uint32_t *)regs)[i] = 0;
+
+	stack = (uint32_t *)regs;
+	*(--stack) = (uint32_t)start_context;
+	for (i=0; i<4; i++) *(--stack) = 0; // ebp, ebx, esi and edi
 
+	p->kesp = (uint32_t)stack;
+	p->regs = regs;
+	p->ring0 = !user;
+
+	return regs;
+}
@@ -11,6 +11,7 @@
 #include "kernel_only.h"
 
 SEMAPHORE sem[SEM_MAXNUMBER];	// the semaphore locks; maximum 256 of them 
+spinlock_t sem_lock;		// protects sem[] (system calls run on all CPUs)
 
 /*** Initialize all semaphorees ***/
 void init_semaphores() {
@@ -33,6 +34,7 @@ sem_t semaphore_create(uint8_t init_value, PCB *p) {
 	// TODO: see background material on what this function should do
 	int i = 1;
 //	sys_printf("INTIT VALUE IS : %d\n",init_value);
+	spin_lock(&sem_lock);
 	for(;i < SEM_MAXNUMBER; i++)
 	{
 
@@ -43,14 +45,19 @@ sem_t semaphore_create(uint8_t init_value, PCB *p) {
 			sem[i].available = FALSE;
 			sem[i].value = init_value;
 			sem[i].creator = p->pid;
+			sem[i].waits = 0;
+			sem[i].wait_ns = 0;
+			reset_wake_latency(&sem[i].latency);
 			//sem[i].waitq.head = 0;
 			//sem[i].waitq.count = 0;
 			while(sem[i].waitq.head != NULL){
 				PCB *tempPCB = dequeue(&sem[i].waitq);
 			}
+			spin_unlock(&sem_lock);
 			return i;
 		}
 	}
+	spin_unlock(&sem_lock);
 
 	// TODO: comment the following line before you start working
 	return 0;
@@ -65,14 +72,17 @@ sem_t semaphore_create(uint8_t init_value, PCB *p) {
 // using it; otherwise the behavior is undefined
 void semaphore_destroy(sem_t key, PCB *p) {
 	// TODO: see background material on what this function should do
+	spin_lock(&sem_lock);
 	if(sem[key].creator == p->pid){
 		sem[key].available = TRUE;
-		while(sem[key].waitq.head != NULL){
-			PCB *tempPCB = dequeue(&sem[key].waitq);
-			tempPCB->state = TERMINATED;
+		PCB *tempPCB;
+		while((tempPCB = dequeue(&sem[key].waitq)) != NULL){ // head is an index, not a pointer
+			tempPCB->cold.semaphore.wait_on = -1; // out of the queue already
+			terminate_process(tempPCB);
 		//	sys_printf("A process was terminated because a semaphore was destroyed!\n");
 		}
 	}
+	spin_unlock(&sem_lock);
 }
 
 /*** DOWN operation on a semaphore ***/
@@ -84,18 +94,23 @@ bool semaphore_down(sem_t key, PCB *p) {
 	//sys_printf("param key is : %d\n",key);
 //
 	//sys_printf("The value in down currently is : %d\n", sem[key].value);
+	spin_lock(&sem_lock);
 	if(sem[key].value == 0){
 		p->state = WAITING;
-		p->semaphore.wait_on = key;
+		p->cold.semaphore.wait_on = key;
 		//sys_printf("The value of the queued element is : %d\n", p->pid);
-		p->semaphore.queue_index = enqueue(&sem[key].waitq, p);
+		p->cold.semaphore.queue_index = enqueue(&sem[key].waitq, p);
+		p->stats.wait_start = get_uptime_ns();
+		sem[key].waits++;
 		//sys_printf("semaphore down is false\n");
+		spin_unlock(&sem_lock);
 		return FALSE;
 	}
 	else{
-		p->semaphore.wait_on = -1;
+		p->cold.semaphore.wait_on = -1;
 		sem[key].value = sem[key].value-1;;
 	//	sys_printf("semaphore down is true\n");
+		spin_unlock(&sem_lock);
 		return TRUE;
 	}
 	// TODO: comment the following line before you start working
@@ -107,6 +122,7 @@ bool semaphore_down(sem_t key, PCB *p) {
 void semaphore_up(sem_t key, PCB *p) {
 	// TODO: see background material on what this function should do
 //	sys_printf("The value to start is : %d\n", sem[key].value);
+	spin_lock(&sem_lock);
 	sem[key].value = sem[key].value+1;
 //	sys_printf("sema up func\n");
 	if(sem[key].waitq.count > 0){
@@ -114,8 +130,16 @@ void semaphore_up(sem_t key, PCB *p) {
 	//	sys_printf("sema up head not null\n");
 		PCB *tempPCB = dequeue(&sem[key].waitq);
 	//	sys_printf("The pid of the dequeued element is : %d\n", tempPCB->pid);
-		tempPCB->state = READY;
-		semaphore_down(key, tempPCB);
+		if (tempPCB != NULL) { // queue may only hold removed items
+			uint64_t waited = get_uptime_ns() - tempPCB->stats.wait_start;
+			tempPCB->stats.sem_wait_ns += waited;
+			sem[key].wait_ns += waited;
+			// the waiter takes the unit just added (what
+			// semaphore_down does for a non-zero value)
+			tempPCB->cold.semaphore.wait_on = -1;
+			sem[key].value = sem[key].value-1;
+			wake_process(tempPCB, &sem[key].latency);
+		}
 		/*
 		if(semaphore_down(key, tempPCB))
 		{
@@ -124,6 +148,7 @@ void semaphore_up(sem_t key, PCB *p) {
 		*/
 
 	}
+	spin_unlock(&sem_lock);
 
 }
 
@@ -137,8 +162,10 @@ void free_semaphores(PCB *p) {
 	}
 
 	// remove from wait queue, if any
-	if (p->semaphore.wait_on != -1) 
-		remove_queue_item(&sem[p->semaphore.wait_on].waitq, p->semaphore.queue_index);
+	spin_lock(&sem_lock);
+	if (p->cold.semaphore.wait_on != -1) 
+		remove_queue_item(&sem[p->cold.semaphore.wait_on].waitq, p->cold.semaphore.queue_index);
+	spin_unlock(&sem_lock);
 	
 }
 
@@ -11,6 +11,7 @@
 #include "kernel_only.h"
 
 SHMEM shm[SHMEM_MAXNUMBER];	// the shared memory objects; maximum 256 of them
+spinlock_t shm_lock;		// protects shm[] (system calls run on all CPUs)
 
 /*** Initialize all shared memory objects ***/
 void init_shared_memory() {
@@ -31,8 +32,14 @@ void  *shm_create(uint8_t key, uint32_t size, PCB *p) {
 	// some sanity checks: size should not be zero; size should not be
 	// more than 4MB; object should not be in use; process should not
 	// have created another shared memory object
-	if (size == 0 || size > 0x400000 || shm[key].refs != 0) return NULL; 
-	if (p->shared_memory.created) return NULL; // already created one area; unlink from it first
+	if (size == 0 || size > 0x400000) return NULL;
+	if (p->cold.shared_memory.created) return NULL; // already created one area; unlink from it first
+
+	spin_lock(&shm_lock);
+	if (shm[key].refs != 0) {
+		spin_unlock(&shm_lock);
+		return NULL; 
+	}
 
 	// how many pages does <size> bytes take
 	uint32_t n_pages = size/4096;   
@@ -43,8 +50,10 @@ void  *shm_create(uint8_t key, uint32_t size, PCB *p) {
 
 	// allocate pages for user process; alloc_user_pages will update the page 
 	// directory and page tables as necessary
-	if (alloc_user_pages(n_pages, SHM_BEGIN, page_directory, PTE_READ_WRITE)==NULL)
+	if (alloc_user_pages(n_pages, SHM_BEGIN, page_directory, PTE_READ_WRITE)==NULL) {
+		spin_unlock(&shm_lock);
 		return NULL;
+	}
 
 	
 	// remember the start frame address of the allocated memory;
@@ -56,8 +65,9 @@ void  *shm_create(uint8_t key, uint32_t size, PCB *p) {
 	shm[key].size = size;
 
 	shm[key].refs++;
-	p->shared_memory.created = TRUE;
-	p->shared_memory.key = key;
+	p->cold.shared_memory.created = TRUE;
+	p->cold.shared_memory.key = key;
+	spin_unlock(&shm_lock);
 
 	return (void *)SHM_BEGIN; // return logical address of shared memory area start
 }
@@ -68,9 +78,13 @@ void  *shm_create(uint8_t key, uint32_t size, PCB *p) {
 void *shm_attach(uint8_t key, uint32_t mode, PCB *p) {
 	int i;
 	
-	if (shm[key].refs == 0) return NULL; // not yet created
+	if (p->cold.shared_memory.created) return NULL; // already attached to an object
 
-	if (p->shared_memory.created) return NULL; // already attached to an object
+	spin_lock(&shm_lock);
+	if (shm[key].refs == 0) { // not yet created
+		spin_unlock(&shm_lock);
+		return NULL;
+	}
 	
 	// size of shared memory in number of pages
 	uint32_t n_pages = shm[key].size/4096;
@@ -87,8 +101,10 @@ void *shm_attach(uint8_t key, uint32_t mode, PCB *p) {
 	uint32_t pt_frame;
 	if ((uint32_t)(page_directory[pd_entry] & PDE_PRESENT) == 0) { // entry not present
 		// allocate space for page table and set entry
-		if ((pt_frame = (uint32_t)alloc_frames(1, KERNEL_ALLOC)) == NULL)
+		if ((pt_frame = (uint32_t)alloc_frames(1, KERNEL_ALLOC)) == NULL) {
+			spin_unlock(&shm_lock);
 			return NULL;
+		}
 
 		page_directory[pd_entry] = pt_frame | PDE_PRESENT | PDE_READ_WRITE | PDE_USER_SUPERVISOR;
 		zero_out_pages((void *)(pt_frame + KERNEL_BASE), 1); // just to be sure
@@ -105,8 +121,9 @@ void *shm_attach(uint8_t key, uint32_t mode, PCB *p) {
 	}
 
 	shm[key].refs++;
-	p->shared_memory.created = TRUE;
-	p->shared_memory.key = key;
+	p->cold.shared_memory.created = TRUE;
+	p->cold.shared_memory.key = key;
+	spin_unlock(&shm_lock);
 
 	return (void *)SHM_BEGIN; // return logical address of shared memory area start
 }
@@ -114,13 +131,14 @@ void *shm_attach(uint8_t key, uint32_t mode, PCB *p) {
 /***  Unlink from a shared memory area ***/
 void shm_detach(PCB *p) {
 	int i;
-	if (p->shared_memory.created) { // only if process has attached to object
-		shm[p->shared_memory.key].refs--;
-		p->shared_memory.created = FALSE;
+	if (p->cold.shared_memory.created) { // only if process has attached to object
+		spin_lock(&shm_lock);
+		shm[p->cold.shared_memory.key].refs--;
+		p->cold.shared_memory.created = FALSE;
 	
 		// size of shared memory in number of pages
-		uint32_t n_pages = shm[p->shared_memory.key].size/4096;
-		if (shm[p->shared_memory.key].size % 4096 != 0) n_pages++;
+		uint32_t n_pages = shm[p->cold.shared_memory.key].size/4096;
+		if (shm[p->cold.shared_memory.key].size % 4096 != 0) n_pages++;
 
 		// logical address pointer of page directory
 		PDE *page_directory = (PDE *)((uint32_t)p->mem.page_directory + KERNEL_BASE);
@@ -139,9 +157,10 @@ void shm_detach(PCB *p) {
 		}	
 
 		// free space if no more references 
-		if (shm[p->shared_memory.key].refs == 0) {
-			dealloc_frames((void *)shm[p->shared_memory.key].base, n_pages);
+		if (shm[p->cold.shared_memory.key].refs == 0) {
+			dealloc_frames((void *)shm[p->cold.shared_memory.key].base, n_pages);
 		}
+		spin_unlock(&shm_lock);
 	}
 }
 
@@ -149,7 +168,7 @@ void shm_detach(PCB *p) {
 // Space allocated to a shared memory object is deleted when
 // the reference count becomes zero
 void free_shared_memory(PCB *p) {
-	if (p->shared_memory.created) { // if process attached to a shared memory object
+	if (p->cold.shared_memory.created) { // if process attached to a shared memory object
 		shm_detach(p);
 	}
 }
@@ -0,0 +1,600 @@
+////////////////////////////////////////////////////////
+// Symmetric multiprocessing
+//
+// Finds the CPUs and the I/O APIC from the ACPI MADT (or the
+// older Intel MP tables), routes device interrupts through the
+// I/O APIC and starts the application processors (APs) with
+// the INIT-SIPI-SIPI sequence.
+//
+// Every CPU has its own TSS and current process (see CPU in
+// kernel_only.h); kernel stacks belong to the processes. The bootstrap processor
+// (BSP) keeps the PIT, the keyboard and the console; APs get
+// their scheduling epochs from the local APIC timer.
+//
+// Without a local APIC (or a TSC to time the start-up) we stay
+// on one CPU with the 8259 PIC.
+
+#include "kernel_only.h"
+
+extern PDE *k_page_directory;	// from lmemman.c
+extern PCB console;		// from scheduler.c
+extern uint32_t tsc_khz;	// from timer.c
+extern uint16_t virtio_base;	// from virtio.c
+extern uint8_t virtio_irq, virtio_bus, virtio_dev, virtio_fn;	// from virtio.c
+extern volatile uint8_t *ahci_port;	// from ahci.c
+extern uint8_t ahci_irq, ahci_bus, ahci_dev, ahci_fn;	// from ahci.c
+extern uint8_t ap_trampoline[], ap_trampoline_end[];	// from startup.S
+extern uint32_t ap_cr3, ap_stack;			// from startup.S
+
+CPU cpus[MAX_CPUS];		// cpus[0] is the BSP
+uint32_t n_cpus = 1;		// CPUs running
+
+/*** Local APIC registers (offsets) ***/
+#define LAPIC_TPR		0x080
+#define LAPIC_EOI		0x0B0
+#define LAPIC_SVR		0x0F0
+#define LAPIC_ICR_LOW		0x300
+#define LAPIC_ICR_HIGH		0x310
+#define LAPIC_LVT_TIMER		0x320
+#define LAPIC_TIMER_INIT	0x380
+#define LAPIC_TIMER_COUNT	0x390
+#define LAPIC_TIMER_DIVIDE	0x3E0
+
+#define ICR_INIT		0x00004500	// INIT, level assert
+#define ICR_STARTUP		0x00004600	// STARTUP; low byte is the start page
+#define ICR_PENDING		0x00001000	// delivery status
+#define ICR_FIXED		0x00004000	// fixed delivery, level assert; low byte is the vector
+
+uint32_t lapic_base = 0;	// physical (=logical) address of the local APICs; 0 if none
+uint32_t ioapic_base = 0;	// physical (=logical) address of the I/O APIC; 0 if none
+uint32_t ioapic_gsi_base = 0;	// first global system interrupt (GSI) of the I/O APIC
+bool ioapic_active = FALSE;	// device interrupts come through the I/O APIC
+uint8_t irq_gsi[16];		// GSI of each ISA IRQ
+uint16_t irq_flags[16];		// polarity (bits 0-1) and trigger mode (bits 2-3) of each ISA IRQ
+PCI_ROUTE pci_routes[MAX_PCI_ROUTES];	// PCI interrupts the MP table lists
+uint32_t n_pci_routes = 0;
+uint32_t lapic_ticks_per_epoch;	// local APIC timer count for one epoch
+volatile uint32_t ap_booting;	// cpus[] index of the AP being started
+
+/*** The CPU executing this code ***/
+// Each CPU loads its own TSS, so the task register tells
+// them apart
+CPU *this_cpu() {
+	uint32_t tr = 0;
+
+	asm volatile ("str %w0\n": "+r"(tr));
+	if (tr == 0) return &cpus[0]; // early boot; no TSS yet
+
+	return &cpus[(tr >> 3) - 5];
+}
+
+/*** Acquire a spinlock ***/
+void spin_lock(spinlock_t *l) {
+	uint32_t v;
+
+	do {
+		while (l->locked) asm volatile ("pause\n");
+		v = 1;
+		asm volatile ("xchgl %0, %1\n": "+r"(v), "+m"(l->locked): : "memory");
+	} while (v != 0);
+}
+
+/*** Release a spinlock ***/
+void spin_unlock(spinlock_t *l) {
+	asm volatile ("": : : "memory");
+	l->locked = 0;
+}
+
+/*** Disable interrupts and acquire a spinlock ***/
+// Returns the EFLAGS to give to spin_unlock_irqrestore
+uint32_t spin_lock_irqsave(spinlock_t *l) {
+	uint32_t flags;
+
+	asm volatile ("pushfl\n"
+		      "popl %0\n"
+		      "cli\n": "=r"(flags));
+	spin_lock(l);
+	return flags;
+}
+
+/*** Release a spinlock and restore interrupts ***/
+void spin_unlock_irqrestore(spinlock_t *l, uint32_t flags) {
+	spin_unlock(l);
+	asm volatile ("pushl %0\n"
+		      "popfl\n": :"r"(flags));
+}
+
+/*** Number of CPUs running ***/
+uint32_t get_cpu_count() {
+	return n_cpus;
+}
+
+/*** Map the 4MB of physical memory holding phys at PHYS_WINDOW ***/
+// Returns the logical address of phys; only one window exists,
+// so earlier pointers into it become invalid
+uint8_t *map_physical(uint32_t phys) {
+	k_page_directory[PHYS_WINDOW >> 22] = (phys & 0xFFC00000) | PDE_PRESENT | PDE_READ_WRITE | PDE_SIZE;
+	asm volatile ("invlpg %0\n": :"m"(*(uint8_t *)PHYS_WINDOW));
+
+	return (uint8_t *)(PHYS_WINDOW + (phys & 0x003FFFFF));
+}
+
+/*** Map device registers 1:1 (uncached) ***/
+// Uses a 4MB page; the address must be above the kernel's own
+// 4MB so that the mapping lands in kernel address space
+void map_mmio(uint32_t phys) {
+	if (phys < KERNEL_BASE + 0x400000) return;
+	k_page_directory[phys >> 22] = (phys & 0xFFC00000) | PDE_PRESENT | PDE_READ_WRITE |
+				       PDE_WRITE_THROUGH | PDE_CACHE_DISABLE | PDE_SIZE;
+}
+
+/*** Do len bytes add up to zero? ***/
+bool checksum_ok(uint8_t *p, uint32_t len) {
+	uint8_t sum = 0;
+
+	while (len--) sum += *p++;
+	return (sum == 0);
+}
+
+/*** Does p start with the len characters of sig? ***/
+bool has_signature(uint8_t *p, char *sig, uint32_t len) {
+	uint32_t i;
+
+	for (i=0; i<len; i++)
+		if (p[i] != (uint8_t)sig[i]) return FALSE;
+	return TRUE;
+}
+
+/*** Look for a signature on 16-byte boundaries ***/
+// Returns the logical address of the match (in the physical
+// window), or NULL
+uint8_t *scan_for_signature(uint32_t phys, uint32_t len, char *sig, uint32_t sig_len) {
+	uint8_t *p = map_physical(phys);
+	uint32_t i;
+
+	for (i=0; i+sig_len<=len; i+=16)
+		if (has_signature(p+i, sig, sig_len)) return p+i;
+	return NULL;
+}
+
+/*** Record a CPU found in the firmware tables ***/
+void add_cpu(uint8_t apic_id) {
+	if (apic_id == cpus[0].apic_id || n_cpus == MAX_CPUS) return;
+
+	cpus[n_cpus].id = n_cpus;
+	cpus[n_cpus].apic_id = apic_id;
+	n_cpus++;
+}
+
+/*** Read the ACPI Multiple APIC Description Table ***/
+bool parse_madt(uint8_t *madt) {
+	uint32_t len = *(uint32_t *)(madt + 4);
+	uint8_t *e = madt + 44; // entries follow the header
+
+	lapic_base = *(uint32_t *)(madt + 36);
+
+	while (e < madt + len) {
+		switch (e[0]) {
+			case 0: // processor local APIC; flags bit 0 = enabled
+				if (*(uint32_t *)(e + 4) & 1) add_cpu(e[3]);
+				break;
+			case 1: // I/O APIC; we use the first one only
+				if (ioapic_base == 0) {
+					ioapic_base = *(uint32_t *)(e + 4);
+					ioapic_gsi_base = *(uint32_t *)(e + 8);
+				}
+				break;
+			case 2: // interrupt source override of an ISA IRQ
+				if (e[2] == 0 && e[3] < 16) {
+					irq_gsi[e[3]] = (uint8_t)*(uint32_t *)(e + 4);
+					irq_flags[e[3]] = *(uint16_t *)(e + 8);
+				}
+				break;
+		}
+		if (e[1] == 0) break; // malformed entry
+		e += e[1];
+	}
+
+	return (lapic_base != 0);
+}
+
+/*** Find CPUs using ACPI ***/
+// The Root System Description Pointer is in the first KB of the
+// EBDA or in the BIOS area 0xE0000-0xFFFFF; the RSDT it points
+// to lists the tables, one of which is the MADT ("APIC")
+bool find_cpus_acpi() {
+	uint32_t ebda = (uint32_t)*(uint16_t *)(KERNEL_BASE + 0x40E) << 4;
+	uint32_t rsdt, n, i, table;
+	uint8_t *p = NULL;
+
+	if (ebda != 0) p = scan_for_signature(ebda, 1024, "RSD PTR ", 8);
+	if (p == NULL) p = scan_for_signature(0xE0000, 0x20000, "RSD PTR ", 8);
+	if (p == NULL || !checksum_ok(p, 20)) return FALSE;
+
+	rsdt = *(uint32_t *)(p + 16);
+	p = map_physical(rsdt);
+	if (!has_signature(p, "RSDT", 4)) return FALSE;
+
+	n = (*(uint32_t *)(p + 4) - 36) / 4; // 32-bit table addresses follow the header
+	for (i=0; i<n; i++) {
+		p = map_physical(rsdt);
+		table = *(uint32_t *)(p + 36 + i*4);
+
+		p = map_physical(table);
+		if (has_signature(p, "APIC", 4)) return parse_madt(p);
+	}
+
+	return FALSE;
+}
+
+/*** Find CPUs using the Intel MP tables ***/
+// The MP floating pointer ("_MP_") is in the first KB of the
+// EBDA, the last KB of base memory or the BIOS ROM; it points
+// to the configuration table ("PCMP")
+bool find_cpus_mp() {
+	uint32_t ebda = (uint32_t)*(uint16_t *)(KERNEL_BASE + 0x40E) << 4;
+	uint32_t n, i;
+	uint32_t pci_buses[8];	// bitmap of the MP bus IDs that are PCI buses
+	uint8_t isa_bus = 0xFF;
+	uint8_t *p = NULL;
+	uint8_t *e;
+
+	for (i=0; i<8; i++) pci_buses[i] = 0;
+
+	if (ebda != 0) p = scan_for_signature(ebda, 1024, "_MP_", 4);
+	if (p == NULL) p = scan_for_signature(0x9FC00, 1024, "_MP_", 4);
+	if (p == NULL) p = scan_for_signature(0xF0000, 0x10000, "_MP_", 4);
+	if (p == NULL || !checksum_ok(p, 16)) return FALSE;
+
+	if (*(uint32_t *)(p + 4) == 0) return FALSE; // default configurations not supported
+	p = map_physical(*(uint32_t *)(p + 4));
+	if (!has_signature(p, "PCMP", 4)) return FALSE;
+
+	lapic_base = *(uint32_t *)(p + 36);
+	n = *(uint16_t *)(p + 34);
+
+	e = p + 44; // entries follow the header
+	for (i=0; i<n; i++) {
+		switch (e[0]) {
+			case 0: // processor; flags bit 0 = usable
+				if (e[3] & 1) add_cpu(e[1]);
+				e += 20;
+				break;
+			case 1: // bus
+				if (has_signature(e + 2, "ISA", 3)) isa_bus = e[1];
+				if (has_signature(e + 2, "PCI", 3)) pci_buses[e[1] >> 5] |= 1 << (e[1] & 31);
+				e += 8;
+				break;
+			case 2: // I/O APIC; flags bit 0 = usable
+				if (ioapic_base == 0 && (e[3] & 1)) ioapic_base = *(uint32_t *)(e + 4);
+				e += 8;
+				break;
+			case 3: // I/O interrupt assignment (same flag format as ACPI)
+				if (e[1] == 0 && e[4] == isa_bus && e[5] < 16) {
+					irq_gsi[e[5]] = e[7];
+					irq_flags[e[5]] = *(uint16_t *)(e + 2);
+				}
+				// a PCI source is the device (bits 2-6) and its pin
+				if (e[1] == 0 && (pci_buses[e[4] >> 5] & (1 << (e[4] & 31))) && n_pci_routes < MAX_PCI_ROUTES) {
+					pci_routes[n_pci_routes].bus = e[4];
+					pci_routes[n_pci_routes].dev = (e[5] >> 2) & 0x1F;
+					pci_routes[n_pci_routes].pin = e[5] & 0x3;
+					pci_routes[n_pci_routes].gsi = e[7];
+					pci_routes[n_pci_routes].flags = *(uint16_t *)(e + 2);
+					n_pci_routes++;
+				}
+				e += 8;
+				break;
+			default:
+				e += 8;
+				break;
+		}
+	}
+
+	return (lapic_base != 0);
+}
+
+/*** Local APIC register access ***/
+uint32_t lapic_read(uint32_t reg) {
+	return *(volatile uint32_t *)(lapic_base + reg);
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t *)(lapic_base + reg) = value;
+}
+
+/*** I/O APIC register access (through IOREGSEL and IOWIN) ***/
+uint32_t ioapic_read(uint32_t reg) {
+	*(volatile uint32_t *)ioapic_base = reg;
+	return *(volatile uint32_t *)(ioapic_base + 0x10);
+}
+
+void ioapic_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t *)ioapic_base = reg;
+	*(volatile uint32_t *)(ioapic_base + 0x10) = value;
+}
+
+/*** Send an ISA IRQ to a CPU as interrupt vector ***/
+void route_irq(uint8_t irq, uint8_t vector, uint8_t apic_id) {
+	uint32_t pin = irq_gsi[irq] - ioapic_gsi_base;
+	uint32_t low = vector; // fixed delivery, physical destination
+
+	if ((irq_flags[irq] & 0x3) == 0x3) low |= 0x2000; // active low
+	if (((irq_flags[irq] >> 2) & 0x3) == 0x3) low |= 0x8000; // level triggered
+
+	ioapic_write(0x10 + 2*pin + 1, (uint32_t)apic_id << 24);
+	ioapic_write(0x10 + 2*pin, low);
+}
+
+/*** Send the interrupt of a PCI function to a CPU as vector ***/
+// PCI INTx is level triggered and active low, and reaches the
+// I/O APIC on a pin only the firmware knows: the MP table entry
+// of the device, or else an ACPI override that makes line (its
+// ISA IRQ, see PCI_FUNCTION) level triggered, as for the PCI
+// links of the PIIX. Anything else (e.g. the GSIs 16-23 of q35,
+// which only the _PRT method of the AML gives) is not routed.
+// Returns FALSE then, or if the function has no interrupt pin
+bool route_pci_irq(uint8_t bus, uint8_t dev, uint8_t fn, uint8_t line, uint8_t vector, uint8_t apic_id) {
+	uint8_t pin = (uint8_t)(pci_config_read(bus, dev, fn, 0x3C) >> 8); // 1 for INTA#
+	uint32_t low = vector; // fixed delivery, physical destination
+	uint32_t gsi, i;
+	uint16_t flags;
+
+	if (pin == 0 || pin > 4) return FALSE;
+
+	for (i=0; i<n_pci_routes; i++)
+		if (pci_routes[i].bus == bus && pci_routes[i].dev == dev && pci_routes[i].pin == pin - 1) break;
+	if (i < n_pci_routes) {
+		gsi = pci_routes[i].gsi;
+		flags = pci_routes[i].flags;
+	}
+	else if (line < 16 && ((irq_flags[line] >> 2) & 0x3) == 0x3) {
+		gsi = irq_gsi[line];
+		flags = irq_flags[line];
+	}
+	else return FALSE;
+
+	if (gsi < ioapic_gsi_base || gsi - ioapic_gsi_base >= ((ioapic_read(0x01) >> 16) & 0xFF) + 1) return FALSE;
+	gsi -= ioapic_gsi_base;
+
+	if ((flags & 0x3) != 0x1) low |= 0x2000; // active low, unless the firmware says high
+	if (((flags >> 2) & 0x3) != 0x1) low |= 0x8000; // level triggered, unless it says edge
+
+	ioapic_write(0x10 + 2*gsi + 1, (uint32_t)apic_id << 24);
+	ioapic_write(0x10 + 2*gsi, low);
+
+	return TRUE;
+}
+
+/*** Enable the local APIC of this CPU ***/
+void init_lapic() {
+	lapic_write(LAPIC_TPR, 0); // accept all interrupts
+	lapic_write(LAPIC_SVR, 0x100 | SPURIOUS_VECTOR); // software enable
+}
+
+/*** Make the local APIC timer interrupt every epoch ***/
+void start_lapic_timer() {
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3); // divide bus clock by 16
+	lapic_write(LAPIC_LVT_TIMER, 0x20000 | LAPIC_TIMER_VECTOR); // periodic
+	lapic_write(LAPIC_TIMER_INIT, lapic_ticks_per_epoch);
+}
+
+/*** Interrupt the BSP once, ns nanoseconds from now ***/
+// Its local APIC timer, in one-shot mode; the BSP has the PIT
+// for its epochs. Does nothing without a local APIC
+void start_wake_timer(uint64_t ns) {
+	uint64_t count = ns * lapic_ticks_per_epoch;
+
+	if (lapic_ticks_per_epoch == 0) return;
+
+	div64_32(&count, get_epoch_length()*1000000);
+	if (count == 0) count = 1;
+	if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3); // divide bus clock by 16
+	lapic_write(LAPIC_LVT_TIMER, WAKE_TIMER_VECTOR); // one-shot
+	lapic_write(LAPIC_TIMER_INIT, (uint32_t)count);
+}
+
+/*** Have the BSP look at the one-shot timer again ***/
+// An AP cannot set the BSP's timer; the IPI lands in the same
+// handler as the timer (see wake_timer_tick)
+void send_wake_ipi() {
+	if (lapic_ticks_per_epoch != 0) send_ipi(cpus[0].apic_id, ICR_FIXED | WAKE_TIMER_VECTOR);
+}
+
+/*** Count local APIC timer ticks in one epoch ***/
+// All local APICs run off the same bus clock, so the BSP does
+// it once for everybody; timed with the TSC
+void calibrate_lapic_timer() {
+	lapic_write(LAPIC_TIMER_DIVIDE, 0x3);
+	lapic_write(LAPIC_LVT_TIMER, 0x10000 | LAPIC_TIMER_VECTOR); // masked, one-shot
+	lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+
+	wait_until(get_uptime_ns() + (uint64_t)get_epoch_length()*1000000);
+
+	lapic_ticks_per_epoch = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+	lapic_write(LAPIC_TIMER_INIT, 0); // stop
+}
+
+/*** Acknowledge an interrupt ***/
+// Interrupts come through the local APIC on APs, and on the BSP
+// once the I/O APIC is in use; otherwise through the 8259 PIC
+void end_of_interrupt() {
+	if (ioapic_active || this_cpu()->id != 0) lapic_write(LAPIC_EOI, 0);
+	else port_write_byte(0x20,0x20);
+}
+
+/*** Acknowledge an interrupt of the local APIC itself ***/
+// Its timer or an IPI; these never come through the 8259 PIC
+void end_of_lapic_interrupt() {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+/*** Send an inter-processor interrupt ***/
+void send_ipi(uint8_t apic_id, uint32_t icr) {
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING);
+	lapic_write(LAPIC_ICR_HIGH, (uint32_t)apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, icr);
+	while (lapic_read(LAPIC_ICR_LOW) & ICR_PENDING);
+}
+
+/*** Start an AP ***/
+// Gives the AP a stack, which becomes that of its idle context,
+// points the start-up code at it, and sends INIT followed by two
+// STARTUP IPIs (Intel MP specification, appendix B.4)
+// Returns FALSE if the AP does not show up within 100ms
+bool start_ap(CPU *c) {
+	uint8_t *trampoline = (uint8_t *)(KERNEL_BASE + AP_TRAMPOLINE);
+	uint8_t *stack = alloc_kernel_pages(1);
+	PCB *idle = &c->idle_pcb;
+	uint64_t timeout;
+	uint32_t i;
+
+	if (stack == NULL) return FALSE;
+	c->boot_stack = (uint32_t)stack + 4096;
+
+	// idle context: ap_main, then cpu_idle, in Ring 0
+	idle->ring0 = TRUE;
+	idle->cpu_id = c->id;
+	idle->on_cpu = c->id;
+	c->idle = idle;
+	c->current = idle;
+
+	// copy the start-up code below 1MB and fill in its parameters
+	for (i=0; i<(uint32_t)(ap_trampoline_end - ap_trampoline); i++)
+		trampoline[i] = ap_trampoline[i];
+	*(uint32_t *)(trampoline + ((uint8_t *)&ap_cr3 - ap_trampoline)) = (uint32_t)k_page_directory - KERNEL_BASE;
+	*(uint32_t *)(trampoline + ((uint8_t *)&ap_stack - ap_trampoline)) = c->boot_stack;
+	ap_booting = c->id;
+
+	send_ipi(c->apic_id, ICR_INIT);
+	wait_until(get_uptime_ns() + 10000000); // 10ms
+
+	for (i=0; i<2; i++) {
+		send_ipi(c->apic_id, ICR_STARTUP | (AP_TRAMPOLINE >> 12));
+		wait_until(get_uptime_ns() + 200000); // 200us
+	}
+
+	timeout = get_uptime_ns() + 100000000; // 100ms
+	while (!c->started && get_uptime_ns() < timeout);
+
+	return c->started;
+}
+
+/*** Where an AP lands after the start-up code (startup.S) ***/
+// We are on the AP's boot stack with interrupts disabled
+void ap_main() {
+	CPU *c = &cpus[ap_booting];
+
+	asm volatile ("lgdt gdtdesc_v\n"); // virtual GDT address
+	load_IDT();
+	setup_TSS(c); // from here on this_cpu() works
+	init_lapic();
+	start_lapic_timer();
+	init_fpu();
+
+	c->started = TRUE;
+
+	// we are the idle context until the scheduler finds work
+	cpu_idle();
+}
+
+/*** The idle context of an AP ***/
+// Sleeps until the next interrupt; every local APIC timer tick
+// runs the scheduler, which takes the CPU away when there is
+// work (possibly stolen from another CPU's queue)
+void cpu_idle() {
+	while (1) asm volatile ("sti\n"
+				"hlt\n");
+}
+
+/*** Spurious interrupt handler ***/
+// Spurious interrupts must not be acknowledged
+asm("handler_spurious_entry: \n"
+	"iretl\n"
+);
+
+/*** Find and start the other CPUs ***/
+// Must run after the timer (TSC) is set up and before
+// interrupts are enabled
+void init_smp() {
+	uint32_t ebx, i, pins;
+	bool found;
+
+	// CPUID function 1: EBX bits 24-31 hold the initial APIC ID
+	asm volatile ("cpuid\n": "=b"(ebx): "a"(1): "ecx", "edx");
+	cpus[0].apic_id = (uint8_t)(ebx >> 24);
+
+	for (i=0; i<16; i++) {
+		irq_gsi[i] = i; // identity unless overridden
+		irq_flags[i] = 0; // bus default (ISA: active high, edge)
+	}
+
+	found = find_cpus_acpi();
+	if (!found) {
+		n_cpus = 1;
+		lapic_base = ioapic_base = 0;
+		found = find_cpus_mp();
+	}
+
+	// done with the firmware tables
+	k_page_directory[PHYS_WINDOW >> 22] = 0;
+	load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+
+	if (!found || tsc_khz == 0) {
+		n_cpus = 1;
+		return;
+	}
+
+	map_mmio(lapic_base);
+	if (ioapic_base != 0) map_mmio(ioapic_base);
+
+	install_interrupt_handler(SPURIOUS_VECTOR,handler_spurious_entry,0x0008,0x8E);
+	init_lapic();
+
+	// device interrupts through the I/O APIC; all go to the BSP
+	if (ioapic_base != 0) {
+		pins = ((ioapic_read(0x01) >> 16) & 0xFF) + 1;
+		for (i=0; i<pins; i++) ioapic_write(0x10 + 2*i, 0x10000); // masked
+
+		port_write_byte(0x21, 0xFF); // 8259 PICs off
+		port_write_byte(0xA1, 0xFF);
+
+		route_irq(0, 32, cpus[0].apic_id); // timer (see init_timer)
+		route_irq(1, 33, cpus[0].apic_id); // keyboard (see init_keyboard)
+		route_irq(14, 46, cpus[0].apic_id); // disk (see init_disk_interrupts)
+		// a PCI device whose interrupt cannot be routed is not
+		// used; its completions would be lost
+		if (virtio_irq != 0 &&
+		    !route_pci_irq(virtio_bus, virtio_dev, virtio_fn, virtio_irq, 32+virtio_irq, cpus[0].apic_id)) {
+			puts("smp: No I/O APIC route for the virtio disk; not using it.\n");
+			virtio_base = 0;
+			// an AHCI HBA on the same line had left the handler to virtio
+			if (ahci_irq == virtio_irq) install_interrupt_handler(32+ahci_irq,handler_ahci_entry,0x0008,0x8E);
+		}
+		if (ahci_irq != 0 &&
+		    !route_pci_irq(ahci_bus, ahci_dev, ahci_fn, ahci_irq, 32+ahci_irq, cpus[0].apic_id)) {
+			puts("smp: No I/O APIC route for the AHCI disk; not using it.\n");
+			ahci_port = NULL;
+		}
+		ioapic_active = TRUE;
+	}
+
+	calibrate_lapic_timer();
+
+	// the start-up code turns on paging while running at its
+	// physical address; identity map the first 4MB meanwhile
+	k_page_directory[0] = k_page_directory[768];
+
+	for (i=1; i<n_cpus; i++) {
+		if (!start_ap(&cpus[i])) {
+			sys_printf("smp: CPU with APIC ID %d did not start.\n", cpus[i].apic_id);
+			break;
+		}
+	}
+	n_cpus = i;
+
+	k_page_directory[0] = 0;
+	load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+}
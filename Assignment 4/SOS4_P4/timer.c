@@ -1,82 +1,170 @@
 ////////////////////////////////////////////////////////
 // Everything about the Programmable Interval Timer (PIT)
 //
-//
+// The PIT drives the 10ms scheduling epochs; wall time comes
+// from the CPU Time Stamp Counter (TSC), calibrated against
+// the PIT at boot, which gives us a nanosecond clock
 
 #include "kernel_only.h"
 
-extern PCB *current_process; // from scheduler.c
-extern PCB console;
+extern spinlock_t sched_lock; // from scheduler.c
+extern SCHED_POLICY *sched_policy; // from scheduler.c
 
 uint32_t elapsed_epoch;
 
+#define EPOCH_NS		10000000	// each epoch is 10ms long
+#define TSC_SHIFT		24		// fixed point shift of tsc_mult
+#define CALIBRATE_LATCH		11931		// PIT count for ~10ms (see init_timer)
+#define TIMER_WHEEL_SIZE	64		// slots in timer wheel; one epoch per slot
+#define LOAD_FREQ		500		// epochs between load average samples (5 sec)
+
+/*** TSC clock ***/
+uint32_t tsc_khz;		// TSC ticks per millisecond; 0 if no usable TSC
+uint32_t tsc_mult;		// nanoseconds per TSC tick (scaled by 2^TSC_SHIFT)
+volatile uint64_t clock_base_tsc;	// TSC value at last clock update
+volatile uint64_t clock_base_ns;	// nanoseconds since start at last clock update
+volatile uint32_t clock_seq;		// odd while the BSP updates the clock base
+
+/*** Timer wheel of sleeping processes ***/
+// Slot i holds a circular list of processes whose sleep ends in an
+// epoch e with e % TIMER_WHEEL_SIZE == i
+PCB *timer_wheel[TIMER_WHEEL_SIZE];
+uint32_t wheel_epoch;		// last epoch processed by run_timer_wheel
+uint64_t wake_at;		// end of the sleep the one-shot timer is set for; 0 if none
+
 /*** The timer (IRQ0) handler ***/
-// We will save the state to current process' PCB,
-// update the display clock, change the state of the current 
-// process, and call the scheduler
+// Every tick does its bookkeeping in timer_tick; while the
+// running process has time left in its slice, the tick ends
+// there and returns straight to it. Otherwise we will change
+// the state of the current process and call the scheduler; its
+// registers stay on its kernel stack until it runs again
+// APs come here from their local APIC timer; the bookkeeping
+// of the system clock is done by the BSP (the PIT) only
 asm("handler_timer_entry: \n"
 	// CPU would have already pushed these in order:
 	// [SS, ESP](only if not in Ring 0), EFLAGS, CS and EIP
 	"pushal\n" // push all general purpose registers
-	// save stack pointer
-	"movl %esp, %ecx\n" 
-	"jmp timer_interrupt_handler\n"
-);
-__attribute__((fastcall)) void timer_interrupt_handler() {
-	// reload stack pointer (discards C function prologue)	
-	asm volatile ("movl %ecx, %esp\n");
-	
 	// must reset the segment selectors before
 	// accessing any kernel data
-	asm volatile ("movl $0x10, %eax\n"
-		      "movl %eax, %ds\n"
-		      "movl %eax, %es\n"
-		      "movl %eax, %fs\n"
-		      "movl %eax, %gs\n");	
-
-	if (current_process == &console) { // interrupted process was the console (i.e. in Ring 0)
-		asm volatile ("movl %%esp, %0\n": "=r"(current_process->cpu.edi));
-		asm volatile ("movl 4(%%esp), %0\n": "=r"(current_process->cpu.esi));
-		asm volatile ("movl 8(%%esp), %0\n": "=r"(current_process->cpu.ebp));
-		asm volatile ("movl 12(%%esp), %0\n": "=r"(current_process->cpu.esp));
-		asm volatile ("movl 16(%%esp), %0\n": "=r"(current_process->cpu.ebx));
-		asm volatile ("movl 20(%%esp), %0\n": "=r"(current_process->cpu.edx));
-		asm volatile ("movl 24(%%esp), %0\n": "=r"(current_process->cpu.ecx));
-		asm volatile ("movl 28(%%esp), %0\n": "=r"(current_process->cpu.eax));
-		asm volatile ("movl 32(%%esp), %0\n": "=r"(current_process->cpu.eip));
-		asm volatile ("movl 36(%%esp), %0\n": "=r"(current_process->cpu.cs));
-		asm volatile ("movl 40(%%esp), %0\n": "=r"(current_process->cpu.eflags));
-		// account for EFLAGS, CS and EIP pushed by CPU
-		// adding 12 (=3*4) bytes ensures stack pointer is pointing at same location
-		// as before the interrrupt
-		current_process->cpu.esp += 12; 
+	"movl $0x10, %eax\n"
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"movl %eax, %fs\n"
+	"movl %eax, %gs\n"
+	"call timer_tick\n"
+	"testl %eax, %eax\n"
+	// fast path: the slice is not over; back to where we were
+	"jz return_from_trap\n"
+	"pushl %esp\n" // the trap frame
+	"call timer_interrupt_handler\n"
+	"addl $4, %esp\n"
+	"jmp return_from_trap\n"
+);
+
+/*** The one-shot timer (BSP local APIC) handler ***/
+// Ends the sleeps that fall between two epochs; also reached
+// by the IPI of an AP that put such a sleeper on the wheel
+asm("handler_wake_entry: \n"
+	"pushal\n"
+	"movl $0x10, %eax\n"
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"movl %eax, %fs\n"
+	"movl %eax, %gs\n"
+	"call wake_timer_tick\n"
+	"testl %eax, %eax\n"
+	"jz return_from_trap\n"
+	"pushl %esp\n" // the trap frame
+	"call timer_interrupt_handler\n"
+	"addl $4, %esp\n"
+	"jmp return_from_trap\n"
+);
+
+/*** Wake up the sleepers that are due in this epoch ***/
+// Returns TRUE if one of them may run on this CPU before what
+// runs now
+uint32_t wake_timer_tick() {
+	uint64_t now;
+
+	spin_lock(&sched_lock);
+	now = get_uptime_ns();
+	wake_at = 0;
+	set_wake_timer(wake_sleepers(wheel_epoch, now), now);
+	spin_unlock(&sched_lock);
+
+	end_of_lapic_interrupt();
+
+	return this_cpu()->need_resched;
+}
+
+/*** Per tick bookkeeping ***/
+// Returns TRUE if the scheduler must run: the slice of the
+// current process is over, or a process became READY on this CPU
+uint32_t timer_tick() {
+	static uint32_t shown_secs = 0xFFFFFFFF;	// time on the display
+	CPU *c = this_cpu();
+	uint64_t start = read_tsc();
+	uint64_t now;
+	bool expired;
+
+	if (c->id == 0) {
+		elapsed_epoch++; // each epoch is 10ms long
+
+		// fold elapsed TSC ticks into the clock so that conversions
+		// always work on small deltas
+		if (tsc_khz != 0) {
+			now = read_tsc();
+			clock_seq++;
+			clock_base_ns += ((now - clock_base_tsc) * tsc_mult) >> TSC_SHIFT;
+			clock_base_tsc = now;
+			clock_seq++;
+		}
+
+		spin_lock(&sched_lock);
+
+		// wake up sleeping processes that are due
+		run_timer_wheel(get_uptime_ns());
+
+		// policy bookkeeping (stride: count deadline misses and
+		// replenish real-time budgets)
+		if (sched_policy->tick != NULL) sched_policy->tick(get_uptime_ns());
+
+		if (elapsed_epoch % LOAD_FREQ == 0) update_load_average();
+
+		spin_unlock(&sched_lock);
+
+		// the display shows seconds; redraw only when they change
+		if (get_uptime()/1000 != shown_secs) {
+			shown_secs = get_uptime()/1000;
+			update_display_time();
+		}
 	}
-	else { // a regular Ring 3 user process was interrupted
-		asm volatile ("movl %%esp, %0\n": "=r"(current_process->cpu.edi));
-		asm volatile ("movl 4(%%esp), %0\n": "=r"(current_process->cpu.esi));
-		asm volatile ("movl 8(%%esp), %0\n": "=r"(current_process->cpu.ebp));
-		asm volatile ("movl 16(%%esp), %0\n": "=r"(current_process->cpu.ebx));
-		asm volatile ("movl 20(%%esp), %0\n": "=r"(current_process->cpu.edx));
-		asm volatile ("movl 24(%%esp), %0\n": "=r"(current_process->cpu.ecx));
-		asm volatile ("movl 28(%%esp), %0\n": "=r"(current_process->cpu.eax));
-		asm volatile ("movl 32(%%esp), %0\n": "=r"(current_process->cpu.eip));
-		asm volatile ("movl 36(%%esp), %0\n": "=r"(current_process->cpu.cs));
-		asm volatile ("movl 40(%%esp), %0\n": "=r"(current_process->cpu.eflags));
-		asm volatile ("movl 44(%%esp), %0\n": "=r"(current_process->cpu.esp));
-		asm volatile ("movl 48(%%esp), %0\n": "=r"(current_process->cpu.ss));
+
+	// the PIC (or local APIC) masks interrupts when they are being
+	// serviced; notify it that interrupt has been serviced,
+	// otherwise the interrupt will be ignored in future
+	end_of_interrupt();
+
+	now = get_uptime_ns();
+	expired = (c->need_resched || now >= c->slice_end);
+
+	c->stats.ticks++;
+	if (expired) c->tick_tsc = start; // the scheduler adds the rest of the cost
+	else {
+		c->stats.fast_ticks++;
+		c->stats.fast_cycles += read_tsc() - start;
 	}
- 
 
-	if (current_process->state == RUNNING) current_process->state = READY;
+	return expired;
+}
 
-	elapsed_epoch++; // each epoch is 10ms long
+/*** The rest of a tick that ends the slice ***/
+void timer_interrupt_handler(TRAP_FRAME *regs) {
+	current_process->regs = regs;
 
-	update_display_time();
+	if (current_process->state == RUNNING) current_process->state = READY;
 
-	// the PIC masks interrupts when they are being serviced;
-	// notify the PIC that interrupt has been serviced,
-	// otherwise the interrupt will be ignored in future
-	port_write_byte(0x20,0x20);
+	account_user_time(current_process);
 
 	// invoke scheduler
 	schedule_something();
@@ -84,7 +172,37 @@ __attribute__((fastcall)) void timer_interrupt_handler() {
 
 /*** Returns number of milliseconds since start ****/
 uint32_t get_uptime() {
-	return elapsed_epoch*get_epoch_length(); // each epoch is 10ms long
+	return ns_to_ms(get_uptime_ns());
+}
+
+/*** Convert nanoseconds to milliseconds ***/
+uint32_t ns_to_ms(uint64_t ns) {
+	div64_32(&ns, 1000000);
+	return (uint32_t)ns;
+}
+
+/*** Convert nanoseconds to microseconds ***/
+uint32_t ns_to_us(uint64_t ns) {
+	div64_32(&ns, 1000);
+	return (uint32_t)ns;
+}
+
+/*** Returns number of nanoseconds since start ***/
+// Monotonic; falls back to epoch resolution without a TSC
+uint64_t get_uptime_ns() {
+	uint64_t ns;
+	uint32_t seq;
+
+	if (tsc_khz == 0) return (uint64_t)elapsed_epoch*EPOCH_NS;
+
+	// the BSP's timer handler may be updating the clock base
+	// (on this or another CPU); retry if it was
+	do {
+		seq = clock_seq;
+		ns = clock_base_ns + (((read_tsc() - clock_base_tsc) * tsc_mult) >> TSC_SHIFT);
+	} while ((seq & 1) || seq != clock_seq);
+
+	return ns;
 }
 
 /*** Returns number of epochs since start ****/
@@ -97,14 +215,243 @@ uint32_t get_epoch_length() {
 	return 10; // each epoch is 10ms long
 }
 
+/*** Read the Time Stamp Counter ***/
+uint64_t read_tsc() {
+	uint64_t tsc;
+	asm volatile ("rdtsc\n": "=A"(tsc));
+	return tsc;
+}
+
+/*** Divide 64-bit number by 32-bit number ***/
+// Quotient is stored back in n; remainder is returned.
+// We do not link libgcc, so 64-bit division has to be done by hand
+uint32_t div64_32(uint64_t *n, uint32_t base) {
+	uint32_t high = (uint32_t)(*n >> 32);
+	uint32_t low = (uint32_t)*n;
+	uint32_t q_high = 0;
+	uint32_t rem;
+
+	if (high >= base) { // divl faults if the quotient does not fit 32 bits
+		q_high = high / base;
+		high = high % base;
+	}
+	asm ("divl %4\n": "=a"(low), "=d"(rem): "0"(low), "1"(high), "rm"(base));
+
+	*n = ((uint64_t)q_high << 32) | low;
+	return rem;
+}
+
+/*** Calibrate the TSC against the PIT ***/
+// Counts TSC ticks while PIT counter 2 counts down ~10ms;
+// leaves tsc_khz at 0 if the CPU has no TSC
+void calibrate_tsc() {
+	uint32_t edx;
+	uint64_t start, end, ticks;
+
+	tsc_khz = 0;
+
+	// CPUID function 1: EDX bit 4 tells if TSC is present
+	asm volatile ("cpuid\n": "=d"(edx): "a"(1): "ebx", "ecx");
+	if (!(edx & 0x10)) return;
+
+	// gate counter 2 on (bit 0), speaker off (bit 1)
+	port_write_byte(0x61, (port_read_byte(0x61) & 0xFD) | 0x01);
+
+	// counter 2, mode 0 (interrupt on terminal count); OUT2
+	// (bit 5 of port 0x61) goes high when the count reaches zero
+	port_write_byte(0x43, 0xB0);
+	port_write_byte(0x42, CALIBRATE_LATCH & 0xFF); // LSBs
+	port_write_byte(0x42, CALIBRATE_LATCH >> 8); // MSBs
+
+	start = read_tsc();
+	while (!(port_read_byte(0x61) & 0x20));
+	end = read_tsc();
+
+	// TSC ticks in one millisecond = ticks * PIT frequency / (latch * 1000)
+	ticks = (end - start) * 1193182;
+	div64_32(&ticks, CALIBRATE_LATCH*1000);
+	if (ticks < 4000) return; // too slow to be useful (tsc_mult would overflow)
+	tsc_khz = (uint32_t)ticks;
+
+	// nanoseconds per TSC tick = 10^6 / tsc_khz
+	ticks = (uint64_t)1000000 << TSC_SHIFT;
+	div64_32(&ticks, tsc_khz);
+	tsc_mult = (uint32_t)ticks;
+
+	clock_base_tsc = read_tsc();
+	clock_base_ns = 0;
+}
+
+/*** Busy wait until a given time ***/
+// Only for short waits while booting (see smp.c)
+void wait_until(uint64_t ns) {
+	while (get_uptime_ns() < ns);
+}
+
+/*** Put a process to sleep for duration_ns nanoseconds ***/
+// Every sleep goes on the wheel. One that ends in the epoch
+// the wheel is at (its slot has been visited) needs the
+// one-shot timer, which lives on the BSP: an AP asks for it
+// with an IPI
+void sleep_process(PCB *p, uint64_t duration_ns) {
+	uint64_t now = get_uptime_ns();
+	uint64_t epoch = now + duration_ns;
+	bool this_epoch;
+
+	p->sleep_end = now + duration_ns;
+
+	if (duration_ns == 0) {
+		p->state = READY;
+		return;
+	}
+
+	div64_32(&epoch, EPOCH_NS);
+
+	spin_lock(&sched_lock);
+	p->state = WAITING;
+	add_to_timer_wheel(p);
+	this_epoch = ((uint32_t)epoch == wheel_epoch);
+	if (this_epoch && this_cpu()->id == 0) set_wake_timer(p->sleep_end, now);
+	spin_unlock(&sched_lock);
+
+	if (this_epoch && this_cpu()->id != 0) send_wake_ipi();
+}
+
+/*** Set the one-shot timer for the end of a sleep ***/
+// Unless it is already set for an earlier one; at is 0 when
+// there is no sleep to wait for. Without a local APIC the
+// sleep ends at the next tick instead. Called on the BSP with
+// sched_lock held
+void set_wake_timer(uint64_t at, uint64_t now) {
+	if (at == 0 || (wake_at > now && wake_at <= at)) return;
+
+	wake_at = at;
+	start_wake_timer(at > now ? at - now : 0);
+}
+
+/*** Timer wheel slot of a process ***/
+uint32_t timer_wheel_slot(PCB *p) {
+	uint64_t epoch = p->sleep_end;
+
+	div64_32(&epoch, EPOCH_NS);
+	return (uint32_t)epoch % TIMER_WHEEL_SIZE;
+}
+
+/*** Add a sleeping process to the timer wheel ***/
+void add_to_timer_wheel(PCB *p) {
+	uint32_t slot = timer_wheel_slot(p);
+	PCB *head = timer_wheel[slot];
+
+	if (head == NULL) {
+		p->prev_sleeper = p;
+		p->next_sleeper = p;
+		timer_wheel[slot] = p;
+	}
+	else { // add at the end of the slot's list
+		p->next_sleeper = head;
+		p->prev_sleeper = head->prev_sleeper;
+		head->prev_sleeper->next_sleeper = p;
+		head->prev_sleeper = p;
+	}
+}
+
+/*** Remove a process from the timer wheel ***/
+// Does nothing if the process is not sleeping
+void remove_from_timer_wheel(PCB *p) {
+	uint32_t slot;
+
+	if (p->next_sleeper == NULL) return;
+
+	slot = timer_wheel_slot(p);
+	if (p->next_sleeper == p) {
+		timer_wheel[slot] = NULL;
+	}
+	else {
+		p->prev_sleeper->next_sleeper = p->next_sleeper;
+		p->next_sleeper->prev_sleeper = p->prev_sleeper;
+		if (timer_wheel[slot] == p) timer_wheel[slot] = p->next_sleeper;
+	}
+
+	p->prev_sleeper = NULL;
+	p->next_sleeper = NULL;
+}
+
+/*** Wake up the processes of a slot whose sleep is over ***/
+// epoch is the one the slot stands for; processes whose sleep
+// ends in a later round of the wheel are left alone. Returns
+// the earliest end of a sleep still to come in epoch (0 if
+// none)
+uint64_t wake_sleepers(uint32_t epoch, uint64_t now) {
+	uint64_t epoch_end = (uint64_t)(epoch + 1)*EPOCH_NS;
+	uint64_t next_end = 0;
+	PCB *p = timer_wheel[epoch % TIMER_WHEEL_SIZE];
+	PCB *next, *last;
+	bool done;
+
+	if (p == NULL) return 0;
+
+	last = p->prev_sleeper;
+	do {
+		next = p->next_sleeper;
+		done = (p == last);
+
+		if (p->sleep_end <= now) {
+			remove_from_timer_wheel(p);
+			if (p->state == WAITING) wakeup(p, p->sleep_end);
+		}
+		else if (p->sleep_end < epoch_end && (next_end == 0 || p->sleep_end < next_end))
+			next_end = p->sleep_end;
+
+		p = next;
+	} while (!done);
+
+	return next_end;
+}
+
+/*** Wake up processes whose sleep is over ***/
+// Visits the slot of the last call again (sleeps that ended
+// since, if the one-shot timer did not get them) and every
+// slot passed since; sleeps ending later in this epoch get the
+// one-shot timer
+void run_timer_wheel(uint64_t now) {
+	uint64_t epoch = now;
+	uint64_t next_end;
+
+	div64_32(&epoch, EPOCH_NS);
+
+	if ((uint32_t)epoch - wheel_epoch > TIMER_WHEEL_SIZE) // been away for a full round
+		wheel_epoch = (uint32_t)epoch - TIMER_WHEEL_SIZE;
+
+	while (1) {
+		next_end = wake_sleepers(wheel_epoch, now);
+		if (wheel_epoch == (uint32_t)epoch) break;
+		wheel_epoch++;
+	}
+
+	set_wake_timer(next_end, now);
+}
+
 /*** Initialize timer ***/
 void init_timer() {
+	int i;
+
 	// register timer handler
 	// timer generates IRQ0, which is mapped to interrupt 32 (see setup_PIC)
 	install_interrupt_handler(32,handler_timer_entry,0x0008,0x8E);
+	// APs get their epochs from the local APIC timer (see smp.c)
+	install_interrupt_handler(LAPIC_TIMER_VECTOR,handler_timer_entry,0x0008,0x8E);
+	// the end of sleeps between two epochs (see set_wake_timer)
+	install_interrupt_handler(WAKE_TIMER_VECTOR,handler_wake_entry,0x0008,0x8E);
 
 	elapsed_epoch = 0;
 
+	for (i=0; i<TIMER_WHEEL_SIZE; i++) timer_wheel[i] = NULL;
+	wheel_epoch = 0;
+	wake_at = 0;
+
+	// must happen before counter 0 starts interrupting us
+	calibrate_tsc();
+
 	// setup timer to go off every 10ms
 	// The PIT works at a fequency of 1193182 Hz; we want a timer interrupt
 	// every 10 milliseonds; a divider of 11931 gives us 100 pulses per
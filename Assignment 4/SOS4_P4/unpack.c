@@ -0,0 +1,157 @@
+////////////////////////////////////////////////////////
+// Loading packed program images
+//
+// A packed image (see pack.h) takes fewer sectors than the
+// program, so the loader reads less; it is unpacked block by
+// block straight into the pages of the process. Meanwhile the
+// buffer cache is already reading the blocks after the ones
+// being unpacked (see bcache_prefetch), so the disk and the
+// unpacking overlap.
+
+#include "kernel_only.h"
+
+extern PDE *k_page_directory;	// from lmemman.c
+
+/*** Is this the first sector of a packed image? ***/
+// If so, h->size is the size of the program once in memory
+bool is_packed_image(PACK_HEADER *h) {
+	return (h->magic == PACK_MAGIC && h->size != 0 &&
+		h->blocks == (h->size + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE);
+}
+
+/*** Unpack a block of LZ4 sequences ***/
+// Returns FALSE if the block is damaged: it must give exactly
+// out_length bytes, with no match reaching before the block
+bool unpack_block(uint8_t *in, uint32_t in_length, uint8_t *out, uint32_t out_length) {
+	uint8_t *in_end = in + in_length;
+	uint32_t done = 0, n, offset, i;
+	uint8_t token, b;
+
+	while (in < in_end) {
+		token = *in++;
+
+		// literals
+		n = token >> 4;
+		if (n == 15) do {
+			if (in == in_end) return FALSE;
+			b = *in++;
+			n += b;
+		} while (b == 255);
+		if (n > (uint32_t)(in_end - in) || n > out_length - done) return FALSE;
+		for (i=0; i<n; i++) out[done++] = *in++;
+
+		if (in == in_end) break; // the last sequence
+
+		// match
+		if (in_end - in < 2) return FALSE;
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+		n = token & 0x0F;
+		if (n == 15) do {
+			if (in == in_end) return FALSE;
+			b = *in++;
+			n += b;
+		} while (b == 255);
+		n += PACK_MIN_MATCH;
+		if (offset == 0 || offset > done || n > out_length - done) return FALSE;
+		for (i=0; i<n; i++, done++) out[done] = out[done - offset]; // may overlap
+	}
+
+	return (done == out_length);
+}
+
+/*** Have the next need bytes of a packed image in memory ***/
+// The image is read into staging (PACK_STAGING_PAGES pages)
+// up to sector end; bytes from *pos to *have are there and not
+// used yet. Moves them to the front when there is no room and
+// reads more, up to LOAD_CHUNK_SECTORS sectors at a time; then
+// starts reading what comes next. Returns FALSE on a disk error
+// or if the image ends too soon
+bool unpack_fill(uint8_t *staging, uint32_t *pos, uint32_t *have, uint32_t need, uint32_t *LBA, uint32_t end) {
+	uint32_t count, i;
+
+	while (*have - *pos < need) {
+		if (*LBA >= end) return FALSE;
+
+		if (*have + 512 > PACK_STAGING_PAGES*4096) {
+			for (i=*pos; i<*have; i++) staging[i - *pos] = staging[i];
+			*have -= *pos;
+			*pos = 0;
+		}
+
+		count = (PACK_STAGING_PAGES*4096 - *have) / 512;
+		if (count > LOAD_CHUNK_SECTORS) count = LOAD_CHUNK_SECTORS;
+		if (count > end - *LBA) count = end - *LBA;
+
+		if (bcache_read(*LBA, (uint8_t)count, staging + *have) != NO_ERROR) return FALSE;
+		*LBA += count;
+		*have += count*512;
+
+		if (*LBA < end) bcache_prefetch(*LBA);
+	}
+
+	return TRUE;
+}
+
+/*** Read a packed image into the address space of a process ***/
+// Each block is unpacked with the address space of p loaded
+// and interrupts off (as load_program reads), into the pages
+// from logical address 0 on. *unpack_ns gets the time spent
+// unpacking
+bool load_packed_program(PCB *p, uint64_t *unpack_ns) {
+	uint32_t LBA = p->cold.disk.LBA;
+	uint32_t end = LBA + p->cold.disk.n_sectors;
+	uint32_t pos = 0, have = 0, left, raw, length, flags, i;
+	uint8_t *staging, *mem = (uint8_t *)p->mem.start_code; // logical address 0
+	uint64_t start;
+	PACK_HEADER *h;
+	bool loaded;
+
+	*unpack_ns = 0;
+
+	staging = (uint8_t *)alloc_kernel_pages(PACK_STAGING_PAGES);
+	if (staging == NULL) return FALSE;
+
+	loaded = unpack_fill(staging, &pos, &have, sizeof(PACK_HEADER), &LBA, end);
+	h = (PACK_HEADER *)staging;
+	if (loaded) loaded = (h->magic == PACK_MAGIC && h->size == p->mem.end_code + 1);
+	left = (loaded ? h->size : 0);
+	pos += sizeof(PACK_HEADER);
+
+	for (; left > 0 && loaded; left -= raw) {
+		raw = (left > PACK_BLOCK_SIZE ? PACK_BLOCK_SIZE : left);
+
+		if (!unpack_fill(staging, &pos, &have, 4, &LBA, end)) {
+			loaded = FALSE;
+			break;
+		}
+		length = *(uint32_t *)(staging + pos);
+		pos += 4;
+
+		if ((length & ~PACK_STORED) > PACK_BLOCK_SIZE ||
+		    ((length & PACK_STORED) && (length & ~PACK_STORED) != raw) ||
+		    !unpack_fill(staging, &pos, &have, length & ~PACK_STORED, &LBA, end)) {
+			loaded = FALSE;
+			break;
+		}
+
+		start = get_uptime_ns();
+		flags = save_and_disable_interrupts();
+		load_CR3((uint32_t)p->mem.page_directory);
+		if (length & PACK_STORED) {
+			for (i=0; i<raw; i++) mem[i] = staging[pos + i];
+		}
+		else loaded = unpack_block(staging + pos, length, mem, raw);
+		load_CR3((uint32_t)k_page_directory-KERNEL_BASE);
+		restore_interrupts(flags);
+		*unpack_ns += get_uptime_ns() - start;
+
+		pos += length & ~PACK_STORED;
+		mem += raw;
+	}
+
+	for (i=0; i<PACK_STAGING_PAGES; i++)
+		dealloc_page(staging + i*4096, k_page_directory);
+
+	return loaded;
+}
@@ -0,0 +1,334 @@
+////////////////////////////////////////////////////////
+// The virtio-blk driver
+//
+// QEMU (and KVM) can give a guest a paravirtual disk: a PCI
+// function (vendor 0x1AF4, device 0x1001) driven through its
+// legacy I/O port interface, as explained in the virtio 0.9.5
+// specification and http://wiki.osdev.org/Virtio
+//
+// Reads go to the device on a virtqueue: a table of
+// descriptors and two rings, in memory shared with the device.
+// A request is a chain of descriptors (header, the data
+// buffer page by page, status byte) put on the available
+// ring; any number of them may be there at once, and the
+// device puts the ones it is done with on the used ring and
+// raises its interrupt.
+//
+// read_disk uses the device in mode DISK_VIRTIO ("disk
+// virtio"), e.g. with the SOS disk attached to QEMU a second
+// time, as -drive file=SOS.dsk,if=virtio,readonly=on. The
+// requests skip the I/O scheduler (see iosched.c): they do
+// not wait for each other. disk_lock protects everything here
+//
+// I/O ports from BAR0:
+// 0x00: Device features
+// 0x04: Guest features (the ones we use)
+// 0x08: Queue address (physical page number)
+// 0x0C: Queue size (descriptors)
+// 0x0E: Queue select
+// 0x10: Queue notify (write the queue number)
+// 0x12: Device status (1 acknowledge, 2 driver, 4 driver ok, 128 failed)
+// 0x13: ISR status (reading it lowers the interrupt line)
+// 0x14: Device configuration; first the capacity in sectors (64 bits)
+
+#include "kernel_only.h"
+
+extern spinlock_t disk_lock;	// from disk.c
+extern spinlock_t sched_lock;	// from scheduler.c
+extern DISK_STATS disk_stats[N_DISK_MODES];	// from disk.c
+extern volatile uint8_t *ahci_port;	// from ahci.c
+extern uint8_t ahci_irq;	// from ahci.c
+
+uint16_t virtio_base = 0;	// I/O ports of the device; 0 if there is none
+uint8_t virtio_irq = 0;		// its ISA IRQ
+uint8_t virtio_bus, virtio_dev, virtio_fn;	// its PCI function (see route_pci_irq)
+uint32_t virtio_sectors = 0;	// capacity of the disk (up to 2TB)
+
+uint16_t vq_size = 0;		// descriptors in the virtqueue
+VRING_DESC *vq_desc;		// the descriptor table
+VRING_AVAIL *vq_avail;		// chains given to the device
+VRING_USED *vq_used;		// chains the device is done with
+uint16_t vq_free = 0;		// first free descriptor; the free ones are chained through next
+uint16_t vq_n_free = 0;		// number of free descriptors
+uint16_t vq_used_seen = 0;	// used ring entries handled so far
+
+// per request, indexed by its head descriptor; in the kernel
+// image, so their physical address is theirs - KERNEL_BASE
+DISK_REQUEST *vq_requests[VIRTIO_MAX_QUEUE];
+VIRTIO_BLK_HEADER vq_headers[VIRTIO_MAX_QUEUE];
+volatile uint8_t vq_status[VIRTIO_MAX_QUEUE];
+
+DISK_REQUEST *virtio_pending = NULL;	// waiting for free descriptors, in the order they came
+DISK_REQUEST *virtio_pending_tail = NULL;
+uint32_t virtio_in_flight = 0;		// requests on the virtqueue
+uint32_t virtio_max_in_flight = 0;	// most of them at once
+
+/*** The virtio-blk (IRQ) handler ***/
+asm("handler_virtio_entry: \n"
+	"pushal\n"
+	// must reset the segment selectors before
+	// accessing any kernel data
+	"movl $0x10, %eax\n"
+	"movl %eax, %ds\n"
+	"movl %eax, %es\n"
+	"movl %eax, %fs\n"
+	"movl %eax, %gs\n"
+	"call virtio_interrupt_handler\n"
+	"testl %eax, %eax\n"
+	"jz return_from_trap\n"
+	// a woken process should run here now (see timer.c)
+	"pushl %esp\n"
+	"call timer_interrupt_handler\n"
+	"addl $4, %esp\n"
+	"jmp return_from_trap\n"
+);
+
+/*** Find and set up the device ***/
+// The virtqueue takes a few pages of the first 4MB (the device
+// needs them physically contiguous). The interrupt line is the
+// one the BIOS gave the PCI function; IRQ n is interrupt 32+n
+// (see setup_PIC), and smp.c routes it through the I/O APIC
+// when that is in use. Without a line the device is not used
+void init_virtio(void) {
+	uint8_t bus, dev, fn, irq;
+	uint32_t bar0, command, avail_end, bytes, i;
+	uint16_t base, size;
+	uint8_t *ring;
+
+	if (!pci_find_device(0x1AF4, 0x1001, &bus, &dev, &fn)) return;
+
+	bar0 = pci_config_read(bus, dev, fn, 0x10);
+	irq = (uint8_t)pci_config_read(bus, dev, fn, 0x3C); // interrupt line
+	if (!(bar0 & 0x1) || irq == 0 || irq > 15) return; // not in I/O space, or no IRQ
+
+	// I/O space (bit 0) and bus master (bit 2) enable
+	command = pci_config_read(bus, dev, fn, 0x04);
+	pci_config_write(bus, dev, fn, 0x04, command | 0x5);
+	base = (uint16_t)(bar0 & 0xFFFC);
+
+	port_write_byte(base+0x12, 0x00);	// reset
+	port_write_byte(base+0x12, 0x01);	// acknowledge: we see the device
+	port_write_byte(base+0x12, 0x03);	// and can drive it
+	port_write_dword(base+0x04, 0);	// none of the optional features
+
+	port_write_word(base+0x0E, 0);	// queue 0 (the only one)
+	size = port_read_word(base+0x0C);
+	if (size < VIRTIO_MAX_SEGMENTS+2 || size > VIRTIO_MAX_QUEUE) { // must fit the longest request
+		port_write_byte(base+0x12, 0x80); // failed
+		return;
+	}
+
+	// descriptors and available ring, then the used ring from
+	// the next page on; each ring ends in a 16-bit event field
+	avail_end = 16*size + 6 + 2*size;
+	bytes = (avail_end + 4095)/4096*4096 + 6 + 8*size;
+	ring = (uint8_t *)alloc_kernel_pages(bytes_to_frames(bytes)); // zeroed
+	if (ring == NULL) {
+		port_write_byte(base+0x12, 0x80); // failed
+		return;
+	}
+
+	vq_desc = (VRING_DESC *)ring;
+	vq_avail = (VRING_AVAIL *)(ring + 16*size);
+	vq_used = (VRING_USED *)(ring + (avail_end + 4095)/4096*4096);
+	for (i=0; i<size; i++) vq_desc[i].next = (uint16_t)(i+1);
+	vq_free = 0;
+	vq_n_free = size;
+	vq_size = size;
+
+	port_write_dword(base+0x08, ((uint32_t)ring - KERNEL_BASE) >> 12);
+
+	if (port_read_dword(base+0x18) != 0) virtio_sectors = 0xFFFFFFFF;
+	else virtio_sectors = port_read_dword(base+0x14);
+
+	install_interrupt_handler(32+irq,handler_virtio_entry,0x0008,0x8E);
+	if (irq < 8) port_write_byte(0x21, port_read_byte(0x21) & ~(1 << irq));
+	else { // on the slave PIC, through the cascade (IRQ2)
+		port_write_byte(0xA1, port_read_byte(0xA1) & ~(1 << (irq-8)));
+		port_write_byte(0x21, port_read_byte(0x21) & ~0x04);
+	}
+
+	port_write_byte(base+0x12, 0x07);	// driver ok: the device may go
+	virtio_irq = irq;
+	virtio_bus = bus;
+	virtio_dev = dev;
+	virtio_fn = fn;
+	virtio_base = base;
+}
+
+/*** Queue a read on the device ***/
+// req is filled in by submit_disk_request; it waits in
+// virtio_pending if the virtqueue is short of descriptors.
+// Called with disk_lock held
+void virtio_submit(DISK_REQUEST *req) {
+	if (req->LBA >= virtio_sectors) {
+		virtio_finish(req, DISK_ERROR_LBA_OUTSIDE_RANGE);
+		return;
+	}
+	if (req->LBA + req->sectors_left > virtio_sectors) {
+		virtio_finish(req, DISK_ERROR_SECTORCOUNT_TOO_BIG);
+		return;
+	}
+
+	if (virtio_pending == NULL && virtio_start(req)) return;
+
+	req->next = NULL;
+	if (virtio_pending_tail == NULL) virtio_pending = req;
+	else virtio_pending_tail->next = req;
+	virtio_pending_tail = req;
+}
+
+/*** Put a request on the virtqueue ***/
+// One descriptor for the header, one per physically contiguous
+// piece of the buffer, one for the status byte. Returns FALSE
+// if there are not enough free descriptors (nothing is done
+// then); a buffer that is not mapped finishes the request with
+// an error. Called with disk_lock held
+bool virtio_start(DISK_REQUEST *req) {
+	uint32_t phys[VIRTIO_MAX_SEGMENTS], length[VIRTIO_MAX_SEGMENTS];
+	uint32_t n = 0, bytes = req->sectors_left*512, p, l, i;
+	uint8_t *buffer = req->buffer;
+	uint64_t start = get_uptime_ns();
+	uint16_t head, d;
+
+	while (bytes > 0) {
+		p = get_physical_address(req->page_directory, buffer);
+		if (p == 0) {
+			virtio_finish(req, DISK_ERROR);
+			return TRUE;
+		}
+
+		l = 4096 - (p & 0xFFF); // to the end of the page
+		if (l > bytes) l = bytes;
+
+		if (n != 0 && phys[n-1] + length[n-1] == p) length[n-1] += l;
+		else {
+			phys[n] = p;
+			length[n] = l;
+			n++;
+		}
+
+		buffer += l;
+		bytes -= l;
+	}
+
+	if (vq_n_free < n+2) return FALSE;
+
+	head = d = vq_free;
+	vq_headers[head].type = 0; // read
+	vq_headers[head].reserved = 0;
+	vq_headers[head].sector = req->LBA;
+	vq_status[head] = 0xFF; // the device writes 0 on success
+	vq_requests[head] = req;
+
+	// the free list already chains the descriptors we take
+	for (i=0; i<n+2; i++) {
+		if (i == 0) {
+			vq_desc[d].addr = (uint32_t)&vq_headers[head] - KERNEL_BASE;
+			vq_desc[d].len = sizeof(VIRTIO_BLK_HEADER);
+			vq_desc[d].flags = VRING_DESC_F_NEXT;
+		}
+		else if (i <= n) {
+			vq_desc[d].addr = phys[i-1];
+			vq_desc[d].len = length[i-1];
+			vq_desc[d].flags = VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
+		}
+		else {
+			vq_desc[d].addr = (uint32_t)&vq_status[head] - KERNEL_BASE;
+			vq_desc[d].len = 1;
+			vq_desc[d].flags = VRING_DESC_F_WRITE;
+		}
+		if (i < n+1) d = vq_desc[d].next;
+	}
+	vq_free = vq_desc[d].next;
+	vq_n_free -= n+2;
+
+	vq_avail->ring[vq_avail->idx % vq_size] = head;
+	asm volatile ("" : : : "memory"); // the entry before the index
+	vq_avail->idx++;
+	asm volatile ("" : : : "memory");
+	port_write_word(virtio_base+0x10, 0); // notify queue 0
+
+	virtio_in_flight++;
+	if (virtio_in_flight > virtio_max_in_flight) virtio_max_in_flight = virtio_in_flight;
+
+	req->busy_ns += get_uptime_ns() - start;
+	return TRUE;
+}
+
+/*** Finish the requests the device is done with ***/
+// Their descriptors go back to the free list, which may let
+// waiting requests start. Called with disk_lock held
+void virtio_reap(void) {
+	DISK_REQUEST *req, *next;
+	uint16_t head, d;
+	uint8_t status;
+
+	while (vq_used_seen != vq_used->idx) {
+		head = (uint16_t)vq_used->ring[vq_used_seen % vq_size].id;
+		req = vq_requests[head];
+		status = (vq_status[head] == 0 ? NO_ERROR : DISK_ERROR);
+
+		// back to the free list, whole chain at once
+		d = head;
+		vq_n_free++;
+		while (vq_desc[d].flags & VRING_DESC_F_NEXT) {
+			d = vq_desc[d].next;
+			vq_n_free++;
+		}
+		vq_desc[d].next = vq_free;
+		vq_free = head;
+
+		vq_used_seen++;
+		virtio_in_flight--;
+		virtio_finish(req, status);
+	}
+
+	while ((req = virtio_pending) != NULL) {
+		next = req->next; // req may be gone once it starts
+		if (!virtio_start(req)) break;
+		virtio_pending = next;
+	}
+	if (virtio_pending == NULL) virtio_pending_tail = NULL;
+}
+
+/*** A request is over ***/
+// Accounts for it and wakes its waiters up; the owner of req
+// may go on as soon as done is set. Called with disk_lock held
+void virtio_finish(DISK_REQUEST *req, uint8_t status) {
+	PCB *waiter = req->waiter;
+	DISK_WAITER *waiters = req->waiters;
+	uint64_t now = get_uptime_ns();
+
+	if (status == NO_ERROR) {
+		disk_stats[DISK_VIRTIO].reads++;
+		disk_stats[DISK_VIRTIO].sectors += (req->n_sectors == 0 ? 256 : req->n_sectors);
+		disk_stats[DISK_VIRTIO].busy_ns += req->busy_ns;
+		disk_stats[DISK_VIRTIO].wait_ns += now - req->queued_at - req->busy_ns;
+	}
+
+	spin_lock(&sched_lock);
+	req->status = status;
+	req->done = TRUE;
+	wake_disk_waiters(waiter, waiters);
+	spin_unlock(&sched_lock);
+}
+
+// The device raises its interrupt when it has put requests on
+// the used ring (or changed its configuration). An AHCI HBA
+// on the same line is served here too (see init_ahci). Returns
+// TRUE if this CPU must run the scheduler
+uint32_t virtio_interrupt_handler() {
+	extern bool ioapic_active;	// from smp.c
+
+	spin_lock(&disk_lock);
+	port_read_byte(virtio_base+0x13); // ISR status: acknowledges the interrupt
+	virtio_reap();
+	if (ahci_port != NULL && ahci_irq == virtio_irq) ahci_reap();
+	spin_unlock(&disk_lock);
+
+	if (!ioapic_active && virtio_irq >= 8) port_write_byte(0xA0,0x20); // on the slave PIC
+	end_of_interrupt();
+
+	return this_cpu()->need_resched;
+}